@@ -11,6 +11,16 @@ static void print_line(const uint8_t *buf, uint16_t len, void *data) {
   static_cast<Print*>(data)->println();
 }
 
+static void print_network(const GSModule::ScanResult &result, void *data) {
+  Print *p = static_cast<Print*>(data);
+  p->print(result.ssid);
+  p->print(", channel ");
+  p->print(result.channel);
+  p->print(", ");
+  p->print(result.rssi);
+  p->println(" dBm");
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Gainspan Serial2Wifi demo");
@@ -46,10 +56,8 @@ void setup() {
   gs.writeCommand("AT&V");
   gs.readResponse(print_line, &Serial);
 
-  // TODO: Add a proper API for scanning
   Serial.println("Scanning...");
-  gs.writeCommand("AT+WS");
-  gs.readResponse(print_line, &Serial);
+  gs.scan(print_network, &Serial);
 
   // Enable DHCP
   gs.setDhcp(true, "pinoccio");
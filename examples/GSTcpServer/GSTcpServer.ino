@@ -0,0 +1,101 @@
+#include <GS.h>
+#include <SPI.h>
+
+GSModule gs;
+GSTcpServer server(gs, 8080);
+
+#define SSID "Foo"
+#define PASSPHRASE "Bar"
+
+// Clients currently being served. Each gets a buffer to collect
+// written data, which is sent on flush() (or when full).
+uint8_t tx_bufs[4][64];
+GSTcpClient clients[4] = {
+  {gs, tx_bufs[0]}, {gs, tx_bufs[1]}, {gs, tx_bufs[2]}, {gs, tx_bufs[3]},
+};
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Gainspan TCP Server demo");
+  #ifdef VCC_ENABLE // For the Pinoccio scout
+  pinMode(VCC_ENABLE, OUTPUT);
+  digitalWrite(VCC_ENABLE, HIGH);
+  #endif
+  delay(2000);
+
+  // Use an UART
+  //Serial1.begin(115200);
+  //gs.begin(Serial1);
+
+  // Use SPI at 2Mhz (GS1500 supports up to 3.5Mhz). With SPI
+  // transactions, the library uses its own settings for every transfer,
+  // so the bus can be shared with other devices using other settings.
+  SPI.setClockDivider(SPI_CLOCK_DIV8);
+  SPI.begin();
+  #ifdef SPI_HAS_TRANSACTION
+  gs.setSpiSettings(SPISettings(2000000, MSBFIRST, SPI_MODE0));
+  #endif
+  gs.begin(7);
+
+  // Disable the NCM, just in case it was set to autostart. Wait a bit
+  // before doing so, because it seems that if the NCM is configured to
+  // start on boot and we try to disable it within the first second or
+  // so, the module locks up...
+  delay(1000);
+  gs.setNcm(false);
+
+  // Enable DHCP
+  gs.setDhcp(true, "pinoccio");
+
+  // Associate
+  gs.setSecurity(GSModule::GS_SECURITY_WPA_PSK);
+  gs.setWpaPassphrase(PASSPHRASE);
+  while(!gs.associate(SSID)) {
+    Serial.println("Association failed, retrying...");
+    gs.loop();
+  }
+
+  Serial.println("Associated to " SSID);
+
+  server.begin();
+  if (!server)
+    Serial.println("Listen failed");
+
+  Serial.println("setup() done");
+}
+
+void loop() {
+  gs.loop();
+
+  // Take any new connections, without blocking
+  for (uint8_t i = 0; i < sizeof(clients) / sizeof(*clients); ++i) {
+    if (!clients[i]) {
+      clients[i] = server.accept();
+      if (clients[i])
+        Serial.println("New client");
+    }
+  }
+
+  // Echo back whatever clients send, a line at a time (but without
+  // waiting for the end of a line that does not fit in tx_bufs)
+  for (uint8_t i = 0; i < sizeof(clients) / sizeof(*clients); ++i) {
+    GSTcpClient &client = clients[i];
+    if (!client)
+      continue;
+
+    while (client.available()) {
+      int c = client.read();
+      client.write(c);
+      if (c == '\n')
+        client.flush();
+    }
+
+    if (!client.connected()) {
+      Serial.println("Client disconnected");
+      client.stop();
+      client = GSModule::INVALID_CID;
+    }
+  }
+}
+
+/* vim: set filetype=cpp softtabstop=2 shiftwidth=2 expandtab: */
@@ -0,0 +1,70 @@
+#include <GS.h>
+#include <SPI.h>
+
+GSModule gs;
+GSTransparentStream stream(gs);
+
+#define SSID "Foo"
+#define PASSPHRASE "Bar"
+#define HOST "192.168.1.1"
+#define PORT 1234
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Gainspan transparent mode demo");
+  #ifdef VCC_ENABLE // For the Pinoccio scout
+  pinMode(VCC_ENABLE, OUTPUT);
+  digitalWrite(VCC_ENABLE, HIGH);
+  #endif
+  delay(2000);
+
+  // Use an UART
+  //Serial1.begin(115200);
+  //gs.begin(Serial1);
+
+  // Use SPI at 2Mhz (GS1500 supports up to 3.5Mhz)
+  SPI.setClockDivider(SPI_CLOCK_DIV8);
+  SPI.begin();
+  gs.begin(7);
+
+  // Disable the NCM, just in case it was set to autostart. Wait a bit
+  // before doing so, because it seems that if the NCM is configured to
+  // start on boot and we try to disable it within the first second or
+  // so, the module locks up...
+  delay(1000);
+  gs.setNcm(false);
+
+  // Enable DHCP
+  gs.setDhcp(true, "pinoccio");
+
+  // Configure the network and connection used by transparent mode
+  gs.setSecurity(GSModule::GS_SECURITY_WPA_PSK);
+  gs.setWpaPassphrase(PASSPHRASE);
+  gs.setAutoAssociate(SSID);
+  gs.setAutoConnectClient(HOST, PORT);
+
+  // This associates and connects
+  while (!stream.begin()) {
+    Serial.println("Connection failed, retrying...");
+    delay(1000);
+  }
+
+  Serial.println("Connected to " HOST);
+}
+
+void loop() {
+  // Forward data between the serial port and the connection, without
+  // any framing in between
+  uint8_t buf[64];
+  int len = stream.read(buf, sizeof(buf));
+  if (len > 0)
+    Serial.write(buf, len);
+
+  len = 0;
+  while (len < (int)sizeof(buf) && Serial.available())
+    buf[len++] = Serial.read();
+  if (len)
+    stream.write(buf, len);
+}
+
+/* vim: set filetype=cpp softtabstop=2 shiftwidth=2 expandtab: */
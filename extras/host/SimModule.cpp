@@ -0,0 +1,418 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <SPI.h>
+#include "SimModule.h"
+
+static const uint8_t ESC = 0x1b;
+
+static const uint8_t SPI_IDLE = 0xf5;
+static const uint8_t SPI_XOFF = 0xfa;
+static const uint8_t SPI_XON = 0xfd;
+static const uint8_t SPI_ESC = 0xfb;
+static const uint8_t SPI_ESC_XOR = 0x20;
+
+static bool isSpiSpecial(uint8_t c)
+{
+  switch (c) {
+    case 0x00: case 0xff: case 0xf3: case SPI_IDLE:
+    case SPI_XOFF: case SPI_XON: case SPI_ESC:
+      return true;
+    default:
+      return false;
+  }
+}
+
+SimModule *SimModule::spi_instance = NULL;
+
+SimModule::SimModule()
+{
+  reset();
+}
+
+void SimModule::attachSpi(uint8_t data_ready_pin)
+{
+  spi_instance = this;
+  this->data_ready_pin = data_ready_pin;
+  shim_spi_transfer_hook = transferSpiHook;
+  shim_digital_read_hook = digitalReadHook;
+}
+
+void SimModule::reset(bool banner)
+{
+  this->out.clear();
+  this->out_pos = 0;
+  this->rx_state = RX_LINE;
+  this->escape_plus = 0;
+  this->cert_length = 0;
+  this->cert.clear();
+  this->deleted_cert.clear();
+  this->line.clear();
+  this->next_cid = 0;
+  this->next_reply = NULL;
+  this->replies.clear();
+  this->commands = this->frames = this->data_bytes = 0;
+  this->data.clear();
+  this->spi_rx_esc = false;
+  this->spi_escaped = -1;
+  this->spi_was_idle = true;
+  this->spi_xoff_count = this->spi_xoff_left = 0;
+  this->spi_xon_pending = false;
+
+  this->next_baud = 0;
+
+  // The startup banner
+  if (banner) {
+    this->baud = 9600;
+    send("\r\nSerial2WiFi APP\r\n");
+  }
+}
+
+/****************************************************************
+ * Scripting data sent by the module
+ ****************************************************************/
+
+void SimModule::send(const uint8_t *buf, size_t len)
+{
+  // Drop data already read, so out does not keep growing
+  if (this->out_pos == this->out.size()) {
+    this->out.clear();
+    this->out_pos = 0;
+  }
+  this->out.insert(this->out.end(), buf, buf + len);
+}
+
+void SimModule::sendFrame(uint8_t cid, const uint8_t *buf, uint16_t len)
+{
+  char header[12];
+  snprintf(header, sizeof(header), "\x1bZ%x%04u", cid, len);
+  send(header);
+  send(buf, len);
+}
+
+void SimModule::sendUdpFrame(uint8_t cid, const IPAddress &ip, uint16_t port, const uint8_t *buf, uint16_t len)
+{
+  char header[32];
+  snprintf(header, sizeof(header), "\x1by%x%u.%u.%u.%u %u\t%04u", cid, ip[0], ip[1], ip[2], ip[3], port, len);
+  send(header);
+  send(buf, len);
+}
+
+void SimModule::sendAsync(uint8_t subtype, const char *args)
+{
+  char data[100];
+  int len = snprintf(data, sizeof(data), "%x%s%s", subtype, args ? " " : "", args ? args : "");
+  char header[8];
+  snprintf(header, sizeof(header), "\x1b" "A%x%02d", subtype, len);
+  send(header);
+  send((const uint8_t*)data, len);
+}
+
+/****************************************************************
+ * Receiving
+ ****************************************************************/
+
+void SimModule::receive(uint8_t c)
+{
+  switch (this->rx_state) {
+    case RX_LINE:
+      if (c == ESC) {
+        this->rx_state = RX_ESC;
+      } else if (c == '\n') {
+        processCommand();
+        this->line.clear();
+      } else if (c != '\r') {
+        this->line.push_back(c);
+      }
+      break;
+
+    case RX_ESC:
+      if (c == 'Z')
+        this->rx_state = RX_Z_CID;
+      else if (c == 'Y')
+        this->rx_state = RX_Y_CID;
+      else if (c == 'W' && this->cert_length) {
+        this->rx_left = this->cert_length;
+        this->cert_length = 0;
+        this->cert.clear();
+        this->rx_state = RX_CERT;
+      }
+      else
+        this->rx_state = RX_LINE;
+      break;
+
+    case RX_Z_CID:
+    case RX_Y_CID:
+      ackFrame();
+      if (this->fail_data) {
+        // The host does not send the rest of a refused frame
+        this->rx_state = RX_LINE;
+        break;
+      }
+      this->rx_left = 4;
+      this->rx_length = 0;
+      this->rx_colons = 0;
+      this->rx_state = (this->rx_state == RX_Z_CID ? RX_Z_LENGTH : RX_Y_HEADER);
+      break;
+
+    case RX_Y_HEADER:
+      // <ip>:<port>:<length>
+      if (this->rx_colons < 2) {
+        if (c == ':')
+          this->rx_colons++;
+        break;
+      }
+      // fallthrough
+    case RX_Z_LENGTH:
+      this->rx_length = this->rx_length * 10 + (c - '0');
+      if (--this->rx_left == 0) {
+        this->rx_left = this->rx_length;
+        this->frames++;
+        this->rx_state = this->rx_left ? RX_DATA : RX_LINE;
+      }
+      break;
+
+    case RX_DATA:
+      receiveData(c);
+      if (--this->rx_left == 0)
+        this->rx_state = RX_LINE;
+      break;
+
+    case RX_CERT:
+      this->cert.push_back(c);
+      if (--this->rx_left == 0) {
+        send("\r\n0\r\n");
+        this->rx_state = RX_LINE;
+      }
+      break;
+
+    case RX_TRANSPARENT:
+      if (c == '+' && this->escape_plus < 3 && (this->escape_plus ||
+          millis() - this->transparent_last_rx >= TRANSPARENT_GUARD_TIME)) {
+        this->escape_plus++;
+        this->escape_time = millis();
+      } else {
+        // Not an escape sequence after all
+        for (; this->escape_plus; --this->escape_plus)
+          receiveData('+');
+        receiveData(c);
+      }
+      this->transparent_last_rx = millis();
+      break;
+  }
+}
+
+void SimModule::receiveData(uint8_t c)
+{
+  this->data_bytes++;
+  if (this->record_data)
+    this->data.push_back(c);
+}
+
+void SimModule::checkEscape()
+{
+  if (this->rx_state == RX_TRANSPARENT && this->escape_plus == 3 &&
+      millis() - this->escape_time >= TRANSPARENT_GUARD_TIME) {
+    this->escape_plus = 0;
+    this->rx_state = RX_LINE;
+    send("\r\n0\r\n");
+  }
+}
+
+void SimModule::ackFrame()
+{
+  const uint8_t reply[] = {ESC, (uint8_t)(this->fail_data ? 'F' : 'O')};
+  send(reply, sizeof(reply));
+}
+
+void SimModule::processCommand()
+{
+  if (this->line.empty())
+    return;
+
+  this->commands++;
+  const std::string &cmd = this->line;
+  send("\r\n");
+  if (cmd.compare(0, 8, "AT+NCTCP") == 0 ||
+      cmd.compare(0, 8, "AT+NCUDP") == 0 ||
+      cmd.compare(0, 8, "AT+NSTCP") == 0 ||
+      cmd.compare(0, 8, "AT+NSUDP") == 0) {
+    char connect[8];
+    snprintf(connect, sizeof(connect), "7 %x\r\n", this->next_cid);
+    this->next_cid = (this->next_cid + 1) % 16;
+    send(connect);
+  }
+  // Auto connect mode, ATO resumes the previous connection
+  bool transparent = (cmd == "ATA" || cmd == "ATA2" || cmd == "ATO");
+  if (cmd == "ATA" || cmd == "ATA2") {
+    char connect[8];
+    snprintf(connect, sizeof(connect), "7 %x\r\n", this->next_cid);
+    this->next_cid = (this->next_cid + 1) % 16;
+    send(connect);
+  }
+  if (cmd.compare(0, 12, "AT+TCERTADD=") == 0) {
+    // <name>,<format>,<length>,<location>
+    const char *p = strchr(cmd.c_str(), ',');
+    if (p && (p = strchr(p + 1, ',')))
+      this->cert_length = strtoul(p + 1, NULL, 10);
+  }
+  if (cmd.compare(0, 12, "AT+TCERTDEL=") == 0)
+    this->deleted_cert = cmd.substr(12);
+  if (cmd.compare(0, 4, "ATB=") == 0)
+    this->next_baud = strtoul(cmd.c_str() + 4, NULL, 10);
+  if (this->next_reply) {
+    send(this->next_reply);
+    this->next_reply = NULL;
+  } else {
+    for (size_t i = 0; i < this->replies.size(); ++i) {
+      if (cmd == this->replies[i].first) {
+        send(this->replies[i].second);
+        break;
+      }
+    }
+  }
+  send("0\r\n");
+  if (transparent) {
+    this->rx_state = RX_TRANSPARENT;
+    this->transparent_last_rx = millis();
+  }
+}
+
+/****************************************************************
+ * Stream and SPI
+ ****************************************************************/
+
+void SimModule::applyBaud()
+{
+  if (this->next_baud && !pending()) {
+    this->baud = this->next_baud;
+    this->next_baud = 0;
+  }
+}
+
+int SimModule::read()
+{
+  checkEscape();
+  applyBaud();
+  if (!uartTxOk())
+    this->out_pos = this->out.size();
+  if (!pending())
+    return -1;
+  int c = this->out[this->out_pos++];
+  applyBaud();
+  return c;
+}
+
+int SimModule::peek()
+{
+  checkEscape();
+  applyBaud();
+  if (!uartTxOk())
+    this->out_pos = this->out.size();
+  if (!pending())
+    return -1;
+  return this->out[this->out_pos];
+}
+
+size_t SimModule::write(const uint8_t *buf, size_t size)
+{
+  applyBaud();
+  if (!uartRxOk())
+    return size;
+  for (size_t i = 0; i < size; ++i)
+    receive(buf[i]);
+  return size;
+}
+
+uint8_t SimModule::transferSpi(uint8_t c)
+{
+  checkEscape();
+
+  // Unstuff the byte sent by the host
+  if (this->spi_rx_esc) {
+    this->spi_rx_esc = false;
+    receive(c ^ SPI_ESC_XOR);
+    this->spi_xoff_count++;
+  } else if (c == SPI_ESC) {
+    this->spi_rx_esc = true;
+  } else if (c != SPI_IDLE) {
+    receive(c);
+    this->spi_xoff_count++;
+  }
+
+  // Simulate a full receive buffer
+  if (this->spi_xoff_interval && this->spi_xoff_count >= this->spi_xoff_interval) {
+    this->spi_xoff_count = 0;
+    this->spi_xoff_left = this->spi_xoff_length;
+  }
+  if (this->spi_xoff_left) {
+    if (--this->spi_xoff_left == 0)
+      this->spi_xon_pending = true;
+    return SPI_XOFF;
+  }
+  if (this->spi_xon_pending) {
+    this->spi_xon_pending = false;
+    return SPI_XON;
+  }
+
+  // Return the next byte to send, stuffing special bytes
+  if (this->spi_escaped >= 0) {
+    uint8_t res = this->spi_escaped;
+    this->spi_escaped = -1;
+    return res;
+  }
+  if (!pending()) {
+    this->spi_was_idle = true;
+    return SPI_IDLE;
+  }
+  if (this->spi_was_idle) {
+    this->spi_was_idle = false;
+    this->spi_idle_left = this->spi_idle_prefix;
+  }
+  if (this->spi_idle_left) {
+    this->spi_idle_left--;
+    return SPI_IDLE;
+  }
+  uint8_t next = this->out[this->out_pos++];
+  if (isSpiSpecial(next)) {
+    this->spi_escaped = next ^ SPI_ESC_XOR;
+    return SPI_ESC;
+  }
+  return next;
+}
+
+uint8_t SimModule::transferSpiHook(uint8_t c)
+{
+  return spi_instance->transferSpi(c);
+}
+
+int SimModule::digitalReadHook(uint8_t pin)
+{
+  if (pin == spi_instance->data_ready_pin)
+    return spi_instance->dataReady() ? HIGH : LOW;
+  return LOW;
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,248 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _SIM_MODULE_H
+#define _SIM_MODULE_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+/**
+ * A simulated Gainspan module, for running the library on a regular
+ * computer. It can be used as a UART (it is a Stream) or attached to
+ * the SPI shim.
+ *
+ * Everything the module sends is scripted using the send methods. In
+ * addition, the module acknowledges every data frame written to it and
+ * replies to every command.
+ */
+class SimModule : public Stream {
+public:
+  SimModule();
+
+  /**
+   * Make the SPI and digitalRead() shims talk to this module. The
+   * given pin acts as the data ready pin.
+   */
+  void attachSpi(uint8_t data_ready_pin);
+
+  /**
+   * Clear all state, counters and queued data. When banner is false,
+   * no startup banner is sent, like after a reset of just the host.
+   */
+  void reset(bool banner = true);
+
+  /****************************************************************
+   * Scripting data sent by the module
+   ****************************************************************/
+
+  /** Queue raw bytes for sending */
+  void send(const uint8_t *buf, size_t len);
+  void send(const char *str) { send((const uint8_t*)str, strlen(str)); }
+
+  /** Queue an <ESC>Z TCP / UDP client data frame */
+  void sendFrame(uint8_t cid, const uint8_t *buf, uint16_t len);
+
+  /** Queue an <ESC>y UDP server data frame */
+  void sendUdpFrame(uint8_t cid, const IPAddress &ip, uint16_t port, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Queue an <ESC>A asynchronous message, formatted like
+   * AT+ASYNCMSGFMT=1 does.
+   *
+   * @param args   Arguments after the subtype (without the leading
+   *               space), may be NULL.
+   */
+  void sendAsync(uint8_t subtype, const char *args);
+
+  /**
+   * Use the given reply (without the response code) for the next
+   * command, instead of an empty reply. The string must stay valid
+   * until the command is received.
+   */
+  void setNextReply(const char *lines) { this->next_reply = lines; }
+
+  /**
+   * Use the given reply (without the response code) for every command
+   * that matches the given one exactly, unless a reply was set with
+   * setNextReply(). The string must stay valid until reset().
+   */
+  void setReply(const char *command, const char *lines) { this->replies.push_back(std::make_pair(command, lines)); }
+
+  /** @returns the number of queued bytes the host did not read yet */
+  size_t pending() { return this->out.size() - this->out_pos; }
+
+  /****************************************************************
+   * Behaviour
+   ****************************************************************/
+
+  /** When set, data frames are refused with <ESC>F */
+  bool fail_data = false;
+
+  /**
+   * Over SPI, send this many idle bytes whenever data becomes
+   * available, like the real module does after being idle.
+   */
+  uint8_t spi_idle_prefix = 0;
+
+  /**
+   * Over SPI, send XOFF for spi_xoff_length transfers after every
+   * spi_xoff_interval data bytes received. 0 disables this.
+   */
+  uint16_t spi_xoff_interval = 0;
+  uint16_t spi_xoff_length = 0;
+
+  /**
+   * Over a UART, the module's baud rate, changed by ATB. When the host
+   * uses a different baud rate (see begin()), all data is lost.
+   */
+  unsigned long baud = 9600;
+
+  /**
+   * When nonzero, data the module sends at a higher baud rate than
+   * this is lost, but the module still understands the host.
+   */
+  unsigned long max_tx_baud = 0;
+
+  /****************************************************************
+   * Counters
+   ****************************************************************/
+
+  /** Commands received */
+  uint32_t commands = 0;
+  /** Data frames and data bytes received */
+  uint32_t frames = 0;
+  uint32_t data_bytes = 0;
+
+  /**
+   * When set, received data bytes are appended to data. This includes
+   * data received in transparent mode.
+   */
+  bool record_data = false;
+  std::vector<uint8_t> data;
+
+  /** The last certificate received through AT+TCERTADD */
+  std::vector<uint8_t> cert;
+  /** The name of the last certificate deleted through AT+TCERTDEL */
+  std::string deleted_cert;
+
+  /****************************************************************
+   * Stream and SPI
+   ****************************************************************/
+
+  virtual int available() { checkEscape(); return pending(); }
+  virtual int read();
+  virtual int peek();
+  virtual size_t write(uint8_t c) { return write(&c, 1); }
+  virtual size_t write(const uint8_t *buf, size_t size);
+  using Print::write;
+
+  /** Set the baud rate used by the host, like HardwareSerial */
+  void begin(unsigned long baud) { this->host_baud = baud; }
+
+  /** Transfer a single SPI byte */
+  uint8_t transferSpi(uint8_t c);
+
+  /** The state of the data ready pin */
+  bool dataReady() { checkEscape(); return pending() || this->spi_escaped >= 0; }
+
+protected:
+  enum RXState {
+    RX_LINE,
+    RX_ESC,
+    RX_Z_CID,
+    RX_Z_LENGTH,
+    RX_Y_CID,
+    RX_Y_HEADER,
+    RX_DATA,
+    RX_TRANSPARENT,
+    RX_CERT,
+  };
+
+  /** Silence needed around the +++ escape sequence in transparent mode */
+  static const unsigned long TRANSPARENT_GUARD_TIME = 1000;
+
+  /** Process a byte sent by the host */
+  void receive(uint8_t c);
+  /** Reply to a complete command line */
+  void processCommand();
+  /** Acknowledge a data frame header */
+  void ackFrame();
+  /** Count (and record) a received data byte */
+  void receiveData(uint8_t c);
+  /**
+   * Leave transparent mode when the escape sequence was followed by
+   * enough silence.
+   */
+  void checkEscape();
+  /**
+   * Apply a baud rate change, once the reply sent at the old rate
+   * has been read.
+   */
+  void applyBaud();
+  /** Can the host and module understand each other? */
+  bool uartRxOk() { return this->host_baud == this->baud; }
+  bool uartTxOk() { return uartRxOk() && (!this->max_tx_baud || this->baud <= this->max_tx_baud); }
+
+  static int digitalReadHook(uint8_t pin);
+  static uint8_t transferSpiHook(uint8_t c);
+  static SimModule *spi_instance;
+  uint8_t data_ready_pin = 0xff;
+
+  std::vector<uint8_t> out;
+  size_t out_pos = 0;
+
+  RXState rx_state = RX_LINE;
+  std::string line;
+  uint16_t rx_left = 0;
+  uint16_t rx_length = 0;
+  uint8_t rx_colons = 0;
+  // Length announced by the last AT+TCERTADD
+  uint16_t cert_length = 0;
+  // Transparent mode state
+  unsigned long transparent_last_rx = 0;
+  unsigned long escape_time = 0;
+  uint8_t escape_plus = 0;
+  uint8_t next_cid = 0;
+  const char *next_reply = NULL;
+  unsigned long host_baud = 9600;
+  unsigned long next_baud = 0;
+  std::vector<std::pair<std::string, const char*> > replies;
+
+  // SPI state
+  bool spi_rx_esc = false;
+  int spi_escaped = -1;
+  uint8_t spi_idle_left = 0;
+  bool spi_was_idle = true;
+  uint16_t spi_xoff_count = 0;
+  uint16_t spi_xoff_left = 0;
+  bool spi_xon_pending = false;
+};
+
+#endif // _SIM_MODULE_H
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,577 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Benchmarks for the hot paths of the library, running against a
+ * simulated module. For every benchmark, the throughput and (on x86)
+ * the number of cpu cycles per byte are printed. Every benchmark also
+ * checks that all data arrived intact, the exit status is non-zero when
+ * that fails. Finally, features that are not performance critical are
+ * checked for correctness only.
+ *
+ * Usage: ./bench [milliseconds per benchmark]
+ */
+
+#include <GS.h>
+#include <time.h>
+#include "SimModule.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t cycles() { return __rdtsc(); }
+#else
+static uint64_t cycles() { return 0; }
+#endif
+
+// Module class that exposes some internals to benchmark directly
+class BenchModule : public GSModule {
+public:
+  using GSModule::GSModule;
+  using GSCore::processIncoming;
+  using GSCore::readResponseInternal;
+};
+
+static const uint8_t SS_PIN = 10;
+static const uint8_t DATA_READY_PIN = 9;
+
+static unsigned long bench_ms = 500;
+static bool failed = false;
+static uint8_t payload[GSCore::MAX_DATA_FRAME_SIZE];
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    failed = true; \
+    return; \
+  } \
+} while(0)
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Measures a benchmark. Run iterations while running() returns true and
+ * call add() with the number of bytes processed.
+ */
+class Measurement {
+public:
+  Measurement(const char *name) : name(name), start(now()), start_cycles(cycles()) { }
+
+  bool running() { return now() - this->start < bench_ms / 1000.0; }
+  void add(uint64_t bytes) { this->bytes += bytes; }
+
+  void report() {
+    double seconds = now() - this->start;
+    uint64_t used = cycles() - this->start_cycles;
+    printf("%-36s %10.2f MB/s", this->name, this->bytes / seconds / 1e6);
+    if (used)
+      printf(" %10.1f cycles/byte", (double)used / this->bytes);
+    printf("\n");
+  }
+
+private:
+  const char *name;
+  double start;
+  uint64_t start_cycles;
+  uint64_t bytes = 0;
+};
+
+static bool beginUart(BenchModule &gs, SimModule &sim)
+{
+  return gs.begin(sim);
+}
+
+static bool beginSpi(BenchModule &gs, SimModule &sim, bool data_ready = true)
+{
+  sim.attachSpi(DATA_READY_PIN);
+  return gs.begin(SS_PIN, data_ready ? DATA_READY_PIN : GSCore::INVALID_PIN);
+}
+
+/****************************************************************
+ * Receiving
+ ****************************************************************/
+
+static void benchProcessIncoming()
+{
+  uint8_t rx_buf[4096];
+  SimModule sim;
+  BenchModule gs(rx_buf);
+  CHECK(gs.begin(sim));
+
+  // Let the simulator generate a stream of frames with an async
+  // message in between, but feed it directly to processIncoming().
+  SimModule gen;
+  while (gen.read() >= 0) /* skip the banner */;
+  const uint16_t FRAME_SIZE = 1024;
+  gen.sendFrame(1, payload, FRAME_SIZE);
+  gen.sendAsync(2, "5"); // DISCONNECT 5
+  std::vector<uint8_t> stream;
+  int c;
+  while ((c = gen.read()) >= 0)
+    stream.push_back(c);
+
+  Measurement m("processIncoming");
+  while (m.running()) {
+    for (size_t pos = 0; pos < stream.size(); pos += 32) {
+      size_t n = stream.size() - pos;
+      gs.processIncoming(&stream[pos], n < 32 ? n : 32);
+    }
+    CHECK(gs.skipData(1, 0xffff) == FRAME_SIZE);
+    m.add(stream.size());
+  }
+  m.report();
+}
+
+static void benchReadData(const char *name, bool spi, bool data_ready = true)
+{
+  uint8_t rx_buf[4096];
+  SimModule sim;
+  BenchModule gs(rx_buf);
+  if (spi)
+    sim.spi_idle_prefix = 63;
+  CHECK(spi ? beginSpi(gs, sim, data_ready) : beginUart(gs, sim));
+
+  const uint16_t FRAME_SIZE = 1024;
+  uint8_t buf[256];
+  Measurement m(name);
+  while (m.running()) {
+    sim.sendFrame(1, payload, FRAME_SIZE);
+    sim.sendFrame(1, payload, FRAME_SIZE);
+    uint16_t read = 0;
+    // Without a data ready pin, reads can come up empty while chewing
+    // through idle bytes, but not forever.
+    unsigned long start = millis();
+    while (read < 2 * FRAME_SIZE) {
+      size_t n = gs.readData(1, buf, sizeof(buf));
+      if (n == 0) {
+        CHECK(millis() - start < 1000);
+        continue;
+      }
+      CHECK(memcmp(buf, payload + read % FRAME_SIZE, n) == 0);
+      read += n;
+    }
+    m.add(read);
+  }
+  m.report();
+}
+
+static void benchUdpServerReceive()
+{
+  uint8_t rx_buf[4096];
+  SimModule sim;
+  BenchModule gs(rx_buf);
+  CHECK(gs.begin(sim));
+  GSUdpServer server(gs);
+  CHECK(server.begin(1234));
+
+  const uint16_t PACKET_SIZE = 512;
+  uint8_t buf[PACKET_SIZE];
+  IPAddress ip(192, 168, 1, 2);
+  Measurement m("GSUdpServer::parsePacket/read");
+  while (m.running()) {
+    // The NSUDP reply always gives cid 0
+    sim.sendUdpFrame(0, ip, 4321, payload, PACKET_SIZE);
+    CHECK(server.parsePacket() == PACKET_SIZE);
+    CHECK(server.remotePort() == 4321);
+    CHECK(server.read(buf, sizeof(buf)) == PACKET_SIZE);
+    CHECK(memcmp(buf, payload, PACKET_SIZE) == 0);
+    m.add(PACKET_SIZE);
+  }
+  m.report();
+}
+
+static void count_line(const uint8_t *, uint16_t, void *data)
+{
+  ++*(int*)data;
+}
+
+static void benchReadResponse()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+
+  // A scan reply is likely the longest response there is
+  std::string reply;
+  for (int i = 0; i < 10; ++i)
+    reply += "00:1d:7e:12:34:56, SSID                            , 11,  INFRA , -64 , WPA2-ENTERPRISE\r\n";
+
+  Measurement m("readResponseInternal");
+  while (m.running()) {
+    sim.setNextReply(reply.c_str());
+    gs.writeCommand("AT+WS");
+    int lines = 0;
+    uint8_t buf[GSCore::MAX_DATA_LINE_SIZE];
+    uint16_t len = sizeof(buf);
+    CHECK(gs.readResponseInternal(buf, &len, NULL, true, count_line, &lines) == GSCore::GS_SUCCESS);
+    CHECK(lines == 10);
+    m.add(reply.size());
+  }
+  m.report();
+}
+
+/****************************************************************
+ * Sending
+ ****************************************************************/
+
+static void benchWriteData(const char *name, bool spi)
+{
+  SimModule sim;
+  BenchModule gs;
+  if (spi) {
+    sim.spi_xoff_interval = 512;
+    sim.spi_xoff_length = 16;
+  }
+  CHECK(spi ? beginSpi(gs, sim) : beginUart(gs, sim));
+
+  const uint16_t FRAME_SIZE = 1024;
+  Measurement m(name);
+  while (m.running()) {
+    CHECK(gs.writeData(1, payload, FRAME_SIZE));
+    m.add(FRAME_SIZE);
+  }
+  m.report();
+  CHECK(sim.data_bytes == sim.frames * FRAME_SIZE);
+}
+
+static void benchWriteChunks()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+  sim.record_data = true;
+
+  static const uint8_t trailer[4] PROGMEM = {0xde, 0xad, 0xbe, 0xef};
+  const uint8_t header[8] = {'H', 'E', 'A', 'D', 'E', 'R', '\r', '\n'};
+  const uint16_t PAYLOAD_SIZE = 1000;
+  const GSChunk chunks[] = {
+    {header, sizeof(header), false},
+    {payload, PAYLOAD_SIZE, false},
+    {trailer, sizeof(trailer), true},
+  };
+  const size_t FRAME_SIZE = sizeof(header) + PAYLOAD_SIZE + sizeof(trailer);
+
+  Measurement m("writeData (UART, 3 chunks)");
+  while (m.running()) {
+    CHECK(gs.writeData(1, chunks, 3));
+    m.add(FRAME_SIZE);
+  }
+  m.report();
+  CHECK(sim.data_bytes == sim.frames * FRAME_SIZE);
+  CHECK(memcmp(sim.data.data(), header, sizeof(header)) == 0);
+  CHECK(memcmp(sim.data.data() + sizeof(header), payload, PAYLOAD_SIZE) == 0);
+  CHECK(memcmp(sim.data.data() + sizeof(header) + PAYLOAD_SIZE, trailer, sizeof(trailer)) == 0);
+}
+
+static uint16_t fill_payload(uint8_t *buf, uint16_t len, void *data)
+{
+  uint32_t *pos = (uint32_t*)data;
+  for (uint16_t i = 0; i < len; ++i)
+    buf[i] = payload[(*pos)++ % sizeof(payload)];
+  return len;
+}
+
+static void benchWriteBulkData(const char *name, bool spi)
+{
+  SimModule sim;
+  BenchModule gs;
+  if (spi) {
+    sim.spi_xoff_interval = 512;
+    sim.spi_xoff_length = 16;
+  }
+  CHECK(spi ? beginSpi(gs, sim) : beginUart(gs, sim));
+  sim.record_data = true;
+
+  const uint32_t TRANSFER_SIZE = 64 * 1024;
+  uint8_t frame[GSCore::MAX_DATA_FRAME_SIZE];
+  uint64_t written = 0;
+  Measurement m(name);
+  while (m.running()) {
+    uint32_t pos = 0;
+    GSCore::BulkResult result;
+    CHECK(gs.writeBulkData(1, TRANSFER_SIZE, fill_payload, &pos, frame, sizeof(frame), &result));
+    CHECK(result.bytes == TRANSFER_SIZE);
+    CHECK(result.frames == (TRANSFER_SIZE + sizeof(frame) - 1) / sizeof(frame));
+    written += TRANSFER_SIZE;
+    m.add(TRANSFER_SIZE);
+  }
+  m.report();
+  CHECK(sim.data_bytes == written);
+  for (size_t i = 0; i < TRANSFER_SIZE; ++i)
+    CHECK(sim.data[i] == payload[i % sizeof(payload)]);
+}
+
+static void benchQueueData(const char *name, bool spi)
+{
+  SimModule sim;
+  BenchModule gs;
+  if (spi) {
+    sim.spi_xoff_interval = 512;
+    sim.spi_xoff_length = 16;
+  }
+  CHECK(spi ? beginSpi(gs, sim) : beginUart(gs, sim));
+  uint8_t tx_queue[2048];
+  gs.setTxQueue(tx_queue);
+  sim.record_data = true;
+
+  // Write odd-sized chunks, so frames wrap around the end of the queue
+  const uint16_t WRITE_SIZE = 300;
+  uint64_t written = 0;
+  Measurement m(name);
+  while (m.running()) {
+    uint16_t done = gs.queueData(1, payload, WRITE_SIZE);
+    while (done < WRITE_SIZE) {
+      gs.loop();
+      done += gs.queueData(1, payload + done, WRITE_SIZE - done);
+    }
+    written += WRITE_SIZE;
+    m.add(WRITE_SIZE);
+  }
+  gs.flushTxQueue();
+  m.report();
+  CHECK(sim.data_bytes == written);
+  for (size_t i = 0; i < sim.data.size(); ++i)
+    CHECK(sim.data[i] == payload[i % WRITE_SIZE]);
+}
+
+static void benchTcpClientWrite()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+  uint8_t tx_buf[256];
+  GSTcpClient client(gs, tx_buf);
+  CHECK(client.connect(IPAddress(10, 0, 0, 1), 80));
+
+  const uint16_t WRITE_SIZE = 64;
+  uint64_t written = 0;
+  Measurement m("GSTcpClient::write (64 bytes)");
+  while (m.running()) {
+    CHECK(client.write(payload, WRITE_SIZE) == WRITE_SIZE);
+    written += WRITE_SIZE;
+    m.add(WRITE_SIZE);
+  }
+  client.flush();
+  m.report();
+  CHECK(sim.data_bytes == written);
+}
+
+static void benchUdpServerSend()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+  GSUdpServer server(gs);
+  CHECK(server.begin(1234));
+
+  const uint16_t PACKET_SIZE = 200;
+  IPAddress ip(192, 168, 1, 2);
+  Measurement m("GSUdpServer::beginPacket/endPacket");
+  while (m.running()) {
+    CHECK(server.beginPacket(ip, 4321));
+    CHECK(server.write(payload, PACKET_SIZE) == PACKET_SIZE);
+    CHECK(server.endPacket());
+    m.add(PACKET_SIZE);
+  }
+  m.report();
+  CHECK(sim.data_bytes == sim.frames * PACKET_SIZE);
+}
+
+/****************************************************************
+ * Functional checks
+ ****************************************************************/
+
+// These features are not on a hot path, so they are only checked for
+// correctness against the simulated module, without measuring.
+
+static void checkBaudRate()
+{
+  {
+    SimModule sim;
+    BenchModule gs;
+    CHECK(gs.begin(sim));
+    CHECK(gs.setBaudRate(sim, 9600, 115200));
+    CHECK(sim.baud == 115200);
+    CHECK(gs.writeCommandCheckOk("AT"));
+  }
+  {
+    // The module cannot send faster than 230400, so the link probe
+    // fails at higher rates and the upgrade falls back until it works
+    SimModule sim;
+    sim.max_tx_baud = 230400;
+    BenchModule gs;
+    CHECK(gs.begin(sim));
+    CHECK(gs.upgradeBaudRate(sim, 9600, 921600) == 230400);
+    CHECK(sim.baud == 230400);
+    CHECK(gs.writeCommandCheckOk("AT"));
+
+    // A failed switch leaves the current rate working
+    CHECK(!gs.setBaudRate(sim, 230400, 460800));
+    CHECK(sim.baud == 230400);
+    CHECK(gs.writeCommandCheckOk("AT"));
+  }
+}
+
+static void checkTransparent()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+  sim.record_data = true;
+
+  GSTransparentStream stream(gs);
+  CHECK(!stream);
+  CHECK(stream.begin());
+  CHECK(stream);
+  CHECK(gs.isTransparent());
+
+  // Data is sent raw, without escaping or framing, both ways
+  const uint8_t out[] = "a+b\x1bZ1";
+  CHECK(stream.write(out, sizeof(out)) == sizeof(out));
+  CHECK(sim.frames == 0);
+  CHECK(sim.data.size() == sizeof(out) && memcmp(sim.data.data(), out, sizeof(out)) == 0);
+  sim.send("\x1bZ0hello");
+  uint8_t buf[16];
+  CHECK(stream.read(buf, sizeof(buf)) == 8 && memcmp(buf, "\x1bZ0hello", 8) == 0);
+
+  // A command leaves transparent mode through +++, after which the
+  // stream can resume the same connection
+  uint32_t commands = sim.commands;
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(!gs.isTransparent() && !stream);
+  CHECK(sim.commands == commands + 1);
+  CHECK(sim.data.size() == sizeof(out));
+  CHECK(stream.begin());
+  stream.print("more");
+  CHECK(sim.data.size() == sizeof(out) + 4);
+  CHECK(stream.end());
+  CHECK(gs.writeCommandCheckOk("AT"));
+}
+
+struct CertSource {
+  const uint8_t *data;
+  uint16_t left;
+};
+
+static uint16_t read_cert(uint8_t *buf, uint16_t len, void *data)
+{
+  CertSource *src = (CertSource*)data;
+  if (len > src->left)
+    len = src->left;
+  memcpy(buf, src->data, len);
+  src->data += len;
+  src->left -= len;
+  return len;
+}
+
+/** Stream that reads from a buffer, for addCert() */
+class BufferStream : public Stream {
+public:
+  BufferStream(const uint8_t *buf, size_t len) : buf(buf), left(len) { }
+  virtual int available() { return this->left; }
+  virtual int read() { return this->left ? (--this->left, *this->buf++) : -1; }
+  virtual int peek() { return this->left ? *this->buf : -1; }
+  virtual size_t write(uint8_t) { return 0; }
+  using Print::write;
+private:
+  const uint8_t *buf;
+  size_t left;
+};
+
+static void checkAddCert()
+{
+  SimModule sim;
+  BenchModule gs;
+  CHECK(gs.begin(sim));
+
+  const uint16_t CERT_SIZE = 1000;
+  CHECK(gs.addCert("a", false, payload, CERT_SIZE));
+  CHECK(sim.cert.size() == CERT_SIZE && memcmp(sim.cert.data(), payload, CERT_SIZE) == 0);
+  CHECK(gs.addCert_P("b", false, payload, CERT_SIZE));
+  CHECK(sim.cert.size() == CERT_SIZE && memcmp(sim.cert.data(), payload, CERT_SIZE) == 0);
+  CHECK(sim.deleted_cert.empty());
+
+  // A source that runs short is padded to the announced length, after
+  // which the broken certificate is deleted again
+  CertSource src = {payload, CERT_SIZE / 2};
+  CHECK(!gs.addCert("c", true, CERT_SIZE, read_cert, &src));
+  CHECK(sim.cert.size() == CERT_SIZE);
+  CHECK(memcmp(sim.cert.data(), payload, CERT_SIZE / 2) == 0);
+  for (uint16_t i = CERT_SIZE / 2; i < CERT_SIZE; ++i)
+    CHECK(sim.cert[i] == 0);
+  CHECK(sim.deleted_cert == "c");
+  CHECK(gs.writeCommandCheckOk("AT"));
+
+  // The same for a stream that runs short
+  BufferStream stream(payload, CERT_SIZE / 4);
+  CHECK(!gs.addCert("d", true, stream, CERT_SIZE));
+  CHECK(sim.cert.size() == CERT_SIZE);
+  CHECK(memcmp(sim.cert.data(), payload, CERT_SIZE / 4) == 0);
+  for (uint16_t i = CERT_SIZE / 4; i < CERT_SIZE; ++i)
+    CHECK(sim.cert[i] == 0);
+  CHECK(sim.deleted_cert == "d");
+
+  BufferStream full(payload, CERT_SIZE);
+  CHECK(gs.addCert("e", false, full, CERT_SIZE));
+  CHECK(sim.cert.size() == CERT_SIZE && memcmp(sim.cert.data(), payload, CERT_SIZE) == 0);
+  CHECK(sim.deleted_cert == "d");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1)
+    bench_ms = strtoul(argv[1], NULL, 10);
+
+  for (size_t i = 0; i < sizeof(payload); ++i)
+    payload[i] = i * 7;
+
+  benchProcessIncoming();
+  benchReadData("readData (UART)", false);
+  benchReadData("readData (SPI, idle bytes)", true);
+  benchReadData("readData (SPI, polling)", true, false);
+  benchUdpServerReceive();
+  benchReadResponse();
+  benchWriteData("writeData (UART)", false);
+  benchWriteData("writeData (SPI, XOFF)", true);
+  benchWriteChunks();
+  benchWriteBulkData("writeBulkData (UART)", false);
+  benchWriteBulkData("writeBulkData (SPI, XOFF)", true);
+  benchQueueData("queueData (UART)", false);
+  benchQueueData("queueData (SPI, XOFF)", true);
+  benchTcpClientWrite();
+  benchUdpServerSend();
+
+  checkBaudRate();
+  checkTransparent();
+  checkAddCert();
+
+  return failed ? 1 : 0;
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,144 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+
+SPIClass SPI;
+int (*shim_digital_read_hook)(uint8_t pin) = NULL;
+uint8_t (*shim_spi_transfer_hook)(uint8_t data) = NULL;
+const SPISettings *shim_spi_settings = NULL;
+unsigned long shim_spi_transactions = 0;
+static SPISettings current_spi_settings;
+
+void pinMode(uint8_t, uint8_t) { }
+void digitalWrite(uint8_t, uint8_t) { }
+
+int digitalRead(uint8_t pin)
+{
+  return shim_digital_read_hook ? shim_digital_read_hook(pin) : LOW;
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long micros() { return now_us(); }
+unsigned long millis() { return now_us() / 1000; }
+
+void delay(unsigned long ms)
+{
+  uint64_t end = now_us() + ms * 1000;
+  while (now_us() < end) /* wait */;
+}
+
+// There are no real interrupts, so the data ready interrupt is never
+// triggered and the library falls back to polling.
+void attachInterrupt(uint8_t, void (*)(void), int) { }
+void detachInterrupt(uint8_t) { }
+void noInterrupts() { }
+void interrupts() { }
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+  if (shim_spi_settings) {
+    fprintf(stderr, "SPI: nested beginTransaction()\n");
+    abort();
+  }
+  current_spi_settings = settings;
+  shim_spi_settings = &current_spi_settings;
+}
+
+void SPIClass::endTransaction()
+{
+  if (!shim_spi_settings) {
+    fprintf(stderr, "SPI: endTransaction() without beginTransaction()\n");
+    abort();
+  }
+  shim_spi_settings = NULL;
+  ++shim_spi_transactions;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  if (!shim_spi_settings) {
+    fprintf(stderr, "SPI: transfer() outside of a transaction\n");
+    abort();
+  }
+  return shim_spi_transfer_hook ? shim_spi_transfer_hook(data) : data;
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+  uint8_t *p = (uint8_t*)buf;
+  while (count--) {
+    *p = transfer(*p);
+    p++;
+  }
+}
+
+size_t Print::write(const uint8_t *buf, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+    n += write(*buf++);
+  return n;
+}
+
+size_t Print::print(long n, int base)
+{
+  if (n < 0 && base == DEC)
+    return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", n);
+  return write(buf);
+}
+
+size_t Stream::readBytes(uint8_t *buf, size_t len)
+{
+  size_t n = 0;
+  while (n < len) {
+    int c = read();
+    if (c < 0)
+      break;
+    buf[n++] = c;
+  }
+  return n;
+}
+
+// vim: set sw=2 sts=2 expandtab:
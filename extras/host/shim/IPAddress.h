@@ -0,0 +1,60 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SHIM_IPADDRESS_H
+#define _SHIM_IPADDRESS_H
+
+#include <stdint.h>
+
+class IPAddress {
+public:
+  IPAddress() { address.dword = 0; }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    address.bytes[0] = a;
+    address.bytes[1] = b;
+    address.bytes[2] = c;
+    address.bytes[3] = d;
+  }
+  IPAddress(uint32_t address) { this->address.dword = address; }
+
+  operator uint32_t() const { return address.dword; }
+  bool operator==(const IPAddress& other) const { return address.dword == other.address.dword; }
+  uint8_t operator[](int index) const { return address.bytes[index]; }
+  uint8_t& operator[](int index) { return address.bytes[index]; }
+  IPAddress& operator=(uint32_t address) { this->address.dword = address; return *this; }
+
+private:
+  union {
+    uint8_t bytes[4];
+    uint32_t dword;
+  } address;
+};
+
+const IPAddress INADDR_NONE(0, 0, 0, 0);
+
+#endif // _SHIM_IPADDRESS_H
+
+// vim: set sw=2 sts=2 expandtab:
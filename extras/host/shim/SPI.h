@@ -0,0 +1,81 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SHIM_SPI_H
+#define _SHIM_SPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_MODE0 0x00
+#define MSBFIRST 1
+
+#define SPI_HAS_TRANSACTION 1
+
+class SPISettings {
+public:
+  SPISettings(uint32_t clock = 4000000, uint8_t bitOrder = MSBFIRST, uint8_t dataMode = SPI_MODE0)
+    : clock(clock), bitOrder(bitOrder), dataMode(dataMode) { }
+  uint32_t clock;
+  uint8_t bitOrder;
+  uint8_t dataMode;
+};
+
+/**
+ * Transactions abort() when nested or unbalanced, and every transfer
+ * must happen inside one, to catch the mistakes that cause silent bus
+ * corruption on real hardware.
+ */
+class SPIClass {
+public:
+  static uint8_t transfer(uint8_t data);
+  static void transfer(void *buf, size_t count);
+  static void begin() { }
+  static void end() { }
+  static void setClockDivider(uint8_t) { }
+  static void beginTransaction(SPISettings settings);
+  static void endTransaction();
+  static void usingInterrupt(uint8_t) { }
+};
+
+extern SPIClass SPI;
+
+/**
+ * Called for every byte transferred, when set. Should return the byte
+ * received from the slave. Without a hook, everything sent is received
+ * again.
+ */
+extern uint8_t (*shim_spi_transfer_hook)(uint8_t data);
+
+/** The settings of the current transaction, if any */
+extern const SPISettings *shim_spi_settings;
+/** Number of transactions completed so far */
+extern unsigned long shim_spi_transactions;
+
+#endif // _SHIM_SPI_H
+
+// vim: set sw=2 sts=2 expandtab:
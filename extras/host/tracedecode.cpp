@@ -0,0 +1,113 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Decoder for the output of GSCore::dumpTrace(). Reads a log from
+ * stdin and writes it to stdout, replacing each trace record by the
+ * text GS_DUMP_LINES prints for the same event, prefixed by the time in
+ * seconds since the first record. Other lines are passed unchanged.
+ *
+ * Usage: ./tracedecode < log.txt
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <GSCore.h>
+
+static void printRecord(unsigned event, unsigned cid, unsigned length)
+{
+  switch (event) {
+    case GSCore::TRACE_TX_FRAME:
+      printf(">>| Writing bulk data frame for cid %u containing %u bytes\n", cid, length);
+      break;
+    case GSCore::TRACE_TX_UDP_FRAME:
+      printf(">>| Writing UDP server bulk data frame for cid %u containing %u bytes\n", cid, length);
+      break;
+    case GSCore::TRACE_TX_COMMAND:
+      printf(">>= (command of %u bytes)\n", length);
+      break;
+    case GSCore::TRACE_RX_FRAME:
+      printf("<<| Read bulk data frame for cid %u containing %u bytes\n", cid, length);
+      break;
+    case GSCore::TRACE_RX_UDP_FRAME:
+      printf("<<| Read bulk UDP server data frame for cid %u containing %u bytes\n", cid, length);
+      break;
+    case GSCore::TRACE_RX_DATA_OK:
+      printf("<<| Read data OK response\n");
+      break;
+    case GSCore::TRACE_RX_DATA_FAIL:
+      printf("<<| Read data FAIL response\n");
+      break;
+    case GSCore::TRACE_RX_LINE:
+      printf("<<= (line of %u bytes)\n", length);
+      break;
+    case GSCore::TRACE_RX_ASYNC:
+      printf("<<| Read async data: (subtype %x, %u bytes)\n", cid, length);
+      break;
+    case GSCore::TRACE_SPI_XOFF:
+      printf("SPI: XOFF\n");
+      break;
+    case GSCore::TRACE_SPI_XON:
+      printf("SPI: XON\n");
+      break;
+    case GSCore::TRACE_RX_DROPPED:
+      printf("rx_data is full, dropped %u bytes for cid %u\n", length, cid);
+      break;
+    default:
+      printf("Unknown trace event %u (cid %u, length %u)\n", event, cid, length);
+      break;
+  }
+}
+
+int main()
+{
+  char line[256];
+  bool first = true;
+  uint32_t prev_time = 0;
+  // Seconds since the first record. Summing the differences handles
+  // wraparound of micros().
+  double elapsed = 0;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    const char *p = strstr(line, "GSTRACE ");
+    unsigned long time;
+    unsigned event, cid, length, lost;
+    if (p && sscanf(p, "GSTRACE lost %u", &lost) == 1) {
+      printf("(%u trace records lost)\n", lost);
+    } else if (p && sscanf(p, "GSTRACE %lx %x %x %x", &time, &event, &cid, &length) == 4) {
+      if (!first)
+        elapsed += (uint32_t)(time - prev_time) / 1e6;
+      first = false;
+      prev_time = time;
+      printf("%12.6f ", elapsed);
+      printRecord(event, cid, length);
+    } else {
+      fputs(line, stdout);
+    }
+  }
+  return 0;
+}
+
+// vim: set sw=2 sts=2 expandtab:
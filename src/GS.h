@@ -1,4 +1,6 @@
 #include "GSModule/GSModule.h"
 #include "GSModule/GSTcpClient.h"
+#include "GSModule/GSTcpServer.h"
+#include "GSModule/GSTransparentStream.h"
 #include "GSModule/GSUdpClient.h"
 #include "GSModule/GSUdpServer.h"
@@ -34,45 +34,123 @@ size_t GSClient::write(uint8_t c)
 
 size_t GSClient::write(const uint8_t *buf, size_t size)
 {
-  if (!gs.writeData(this->cid, buf, size))
-    return 0;
+  if (gs.hasTxQueue()) {
+    // The tx queue combines writes already, so skip tx_buf
+    if (!flushTx())
+      return 0;
+    if (size > 0xffff)
+      size = 0xffff;
+    size_t done = gs.queueData(this->cid, buf, size);
+    if (done)
+      this->tx_last = millis();
+    return done;
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    if (this->tx_len == 0 && size - done >= this->tx_size) {
+      // The rest of the data would fill up the (empty) buffer, so just
+      // skip the buffer and send it directly. This also handles writes
+      // when there is no buffer.
+      if (!gs.writeData(this->cid, buf + done, size - done))
+        return 0;
+      break;
+    }
+
+    size_t len = this->tx_size - this->tx_len;
+    if (len > size - done)
+      len = size - done;
+    memcpy(this->tx_buf + this->tx_len, buf + done, len);
+    this->tx_len += len;
+    done += len;
+
+    if (this->tx_len == this->tx_size && !flushTx())
+      return 0;
+  }
+  this->tx_last = millis();
   return size;
 }
 
+bool GSClient::flushTx()
+{
+  if (this->tx_len == 0)
+    return true;
+
+  if (gs.hasTxQueue()) {
+    uint16_t done = gs.queueData(this->cid, this->tx_buf, this->tx_len);
+    this->tx_len -= done;
+    memmove(this->tx_buf, this->tx_buf + done, this->tx_len);
+    return this->tx_len == 0;
+  }
+
+  bool res = gs.writeData(this->cid, this->tx_buf, this->tx_len);
+  this->tx_len = 0;
+  return res;
+}
+
+void GSClient::checkTxTimeout()
+{
+  if (this->tx_len && this->tx_timeout &&
+      (unsigned long)(millis() - this->tx_last) >= this->tx_timeout)
+    flushTx();
+}
+
 int GSClient::available()
 {
+  checkTxTimeout();
   return gs.availableData(this->cid);
 }
 
 int GSClient::read()
 {
+  checkTxTimeout();
   return gs.readData(this->cid);
 }
 
 int GSClient::read(uint8_t *buf, size_t size)
 {
+  checkTxTimeout();
   return gs.readData(this->cid, buf, size);
 }
 
 int GSClient::peek()
 {
+  checkTxTimeout();
   return gs.peekData(this->cid);
 }
 
+size_t GSClient::borrow(const uint8_t **buf)
+{
+  return gs.borrowData(this->cid, buf);
+}
+
+void GSClient::consume(size_t len)
+{
+  gs.consumeData(this->cid, len);
+}
+
 void GSClient::flush()
 {
-  // Nothing todo, we don't keep any buffers
+  flushTx();
+  gs.flushTxQueue();
 }
 
 void GSClient::stop()
 {
+  flushTx();
+  // Send any queued data before closing the connection
+  gs.flushTxQueue();
   gs.disconnect(this->cid);
+  // Nobody is going to read any data still buffered, so free up the
+  // space for other connections
+  gs.skipData(this->cid, 0xffff);
 }
 
 uint8_t GSClient::connected()
 {
   if (this->cid == GSModule::INVALID_CID)
     return false;
+  checkTxTimeout();
   return gs.getConnectionInfo(this->cid).connected;
 }
 
@@ -83,6 +161,8 @@ GSClient::operator bool()
 
 GSClient& GSClient::operator =(GSCore::cid_t cid)
 {
+  // Any buffered data belongs to the old cid
+  flushTx();
   this->cid = cid;
   return *this;
 }
@@ -36,6 +36,28 @@ class GSClient : public Client {
   public:
     GSClient(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
 
+    /**
+     * Create a client that collects written data in the given buffer
+     * instead of sending every write in its own frame. The data is sent
+     * when the buffer is full, when flush() is called or when no data
+     * was written for the idle timeout (see setTxTimeout()).
+     *
+     * The buffer size should not be bigger than
+     * GSCore::MAX_DATA_FRAME_SIZE, since that is the most that fits in a
+     * single frame.
+     *
+     * When the module has a tx queue (see GSCore::setTxQueue()), writes
+     * go into that queue instead and never wait for the module. They
+     * then return how many bytes fit, which can be less than written.
+     */
+    template <size_t N>
+    GSClient(GSModule &gs, uint8_t (&tx_buf)[N]) : GSClient(gs, tx_buf, N) {
+      static_assert(N <= GSCore::MAX_DATA_FRAME_SIZE, "tx buffer is bigger than a data frame");
+    }
+
+    /** The default value for setTxTimeout() */
+    static const uint16_t DEFAULT_TX_TIMEOUT = 10;
+
     /****************************************************************
      * Stuff from Client / Stream / Print
      ****************************************************************/
@@ -51,13 +73,74 @@ class GSClient : public Client {
     virtual operator bool();
     GSClient& operator =(GSCore::cid_t cid);
 
+    /****************************************************************
+     * Zero-copy reading
+     ****************************************************************/
+
+    /**
+     * Get direct access to received data, without copying it.
+     *
+     * @see GSCore::borrowData() for details and limitations.
+     *
+     * @returns the number of bytes available at *buf.
+     */
+    size_t borrow(const uint8_t **buf);
+
+    /**
+     * Remove data previously returned by borrow().
+     */
+    void consume(size_t len);
+
+    /****************************************************************
+     * Gainspan-specific stuff
+     ****************************************************************/
+
+    /**
+     * Set after how many milliseconds without writes buffered data is
+     * sent. Since there is no timer, this is only checked when the
+     * client is used (e.g. by calling available() or connected()), so
+     * make sure to do that regularly. Pass 0 to only send data when the
+     * buffer is full or flush() is called.
+     *
+     * Only relevant when a tx buffer was passed to the constructor.
+     */
+    void setTxTimeout(uint16_t timeout) { this->tx_timeout = timeout; }
+
     // Include other overloads of write
     using Print::write;
 
   protected:
+    GSClient(GSModule &gs, uint8_t *tx_buf, uint16_t tx_size)
+      : gs(gs), cid(GSModule::INVALID_CID), tx_buf(tx_buf), tx_size(tx_size) { } ;
+
+    /**
+     * Send any data in tx_buf. With a tx queue, any data that does
+     * not fit in the queue stays in tx_buf.
+     *
+     * @returns false when sending failed or not all data fit in the tx
+     * queue, true otherwise.
+     */
+    bool flushTx();
+
+    /**
+     * Send any data in tx_buf when the idle timeout expired.
+     */
+    void checkTxTimeout();
+
     GSModule &gs;
     GSModule::cid_t cid;
 
+    // Buffer for written data, or NULL to send every write directly
+    uint8_t *tx_buf = NULL;
+    // Size of tx_buf
+    uint16_t tx_size = 0;
+    // Amount of data in tx_buf
+    uint16_t tx_len = 0;
+    // Milliseconds without writes before tx_buf is sent, 0 to disable
+    uint16_t tx_timeout = DEFAULT_TX_TIMEOUT;
+    // When data was last written to tx_buf (in millis)
+    unsigned long tx_last = 0;
+
 };
 
 #endif // _GS_CLIENT_H
@@ -30,6 +30,13 @@
 #include "util.h"
 #include "static_assert.h"
 
+// Update a performance counter, see GSCore::Stats
+#if GS_STATS
+#define STATS_ADD(counter, n) (this->stats.counter += (n))
+#else
+#define STATS_ADD(counter, n) do { } while(0)
+#endif
+
 static void dump_byte(Print *p, const char *prefix, int c, bool newline = true) {
   if (c >= 0 && p) {
     p->print(prefix);
@@ -51,22 +58,73 @@ static void dump_byte(Print *p, const char *prefix, int c, bool newline = true)
   }
 }
 
+/**
+ * Helper to quickly toggle the SS pin. On AVR, digitalWrite() takes
+ * longer than transferring an SPI byte, so the port register is written
+ * directly there.
+ */
+class SSPin {
+public:
+#if defined(__AVR__)
+  SSPin(uint8_t pin)
+    : reg(portOutputRegister(digitalPinToPort(pin))), mask(digitalPinToBitMask(pin)) { }
+  // Interrupts are disabled so an ISR writing to another pin of the
+  // same port does not clobber our write.
+  void low() { uint8_t sreg = SREG; cli(); *reg &= ~mask; SREG = sreg; }
+  void high() { uint8_t sreg = SREG; cli(); *reg |= mask; SREG = sreg; }
+private:
+  volatile uint8_t *reg;
+  uint8_t mask;
+#else
+  SSPin(uint8_t pin) : pin(pin) { }
+  void low() { digitalWrite(this->pin, LOW); }
+  void high() { digitalWrite(this->pin, HIGH); }
+private:
+  uint8_t pin;
+#endif
+};
+
 /*******************************************************
  * Methods for setting up the module
  *******************************************************/
 
-GSCore::GSCore()
+// Buffer used by the default constructor. When only the other
+// constructor is used, the linker leaves this buffer out.
+static uint8_t default_rx_data[GSCore::DEFAULT_RX_DATA_SIZE];
+
+GSCore::GSCore() : GSCore(default_rx_data, sizeof(default_rx_data))
+{
+  static_assert( is_power_of_two(sizeof(default_rx_data)), "DEFAULT_RX_DATA_SIZE is not a power of two" );
+}
+
+GSCore::GSCore(uint8_t *rx_buf, uint16_t rx_size)
 {
   static_assert( max_for_type(__typeof__(rx_async_len)) >= sizeof(rx_async) - 1, "rx_async_len is too small for rx_async" );
-  static_assert( max_for_type(rx_data_index_t) >= sizeof(rx_data) - 1, "rx_data_index_t is too small for rx_data" );
-  // Check that the buffer size is a power of two, which makes all
-  // modulo operations efficient bitwise ands. Additionally, this also
-  // guarantees that the size of rx_data (which is a power of two by
-  // definition) is divisible by the buffer size, which is needed to
-  // guarantee proper negative wraparound.
-  static_assert( is_power_of_two(sizeof(rx_data)), "rx_data size is not a power of two" );
+  // Offsets into rx_data are calculated by adding up to two offsets
+  // into rx_data and a frame header, so that must fit in
+  // rx_data_index_t. Additionally, RX_NO_FRAME must never be a valid
+  // offset.
+  static_assert( max_for_type(rx_data_index_t) >= 2 * MAX_RX_DATA_SIZE + MAX_RX_HEADER_SIZE, "rx_data_index_t is too small for rx_data" );
+  static_assert( ((MAX_CID | RX_FLAG_UDP_SERVER | RX_FLAG_DONE | RX_FLAG_LONG) & RX_PACKED_LENGTH_BIT8) == 0, "RX_FLAG_* values overlap" );
+  static_assert( RX_SHORT_LENGTH_MAX < MAX_DATA_FRAME_SIZE, "RX_FLAG_LONG is never needed" );
+  static_assert( RX_NO_FRAME >= MAX_RX_DATA_SIZE, "RX_NO_FRAME is a valid rx_data offset" );
+  // The buffer size is a power of two, which makes all modulo
+  // operations efficient bitwise ands. Additionally, this also
+  // guarantees that the size of rx_data_index_t (which is a power of
+  // two by definition) is divisible by the buffer size, which is needed
+  // to guarantee proper negative wraparound.
+  this->rx_data = rx_buf;
+  this->rx_data_mask = rx_size - 1;
   this->debug = NULL;
   this->error = NULL;
+#if GS_STATS
+  memset(&this->stats, 0, sizeof(this->stats));
+#endif
+#if GS_TRACE
+  static_assert(GS_TRACE_SIZE > 0 && GS_TRACE_SIZE <= 255, "GS_TRACE_SIZE does not fit trace_len");
+  this->trace_first = this->trace_len = 0;
+  this->trace_lost = 0;
+#endif
 }
 
 bool GSCore::begin(Stream &serial)
@@ -81,7 +139,7 @@ bool GSCore::begin(Stream &serial)
   return res;
 }
 
-bool GSCore::begin(uint8_t ss, uint8_t data_ready)
+bool GSCore::begin(uint8_t ss, uint8_t data_ready, bool rx_interrupt)
 {
   if (this->serial || this->ss_pin != INVALID_PIN || ss == INVALID_PIN)
     return false;
@@ -95,6 +153,13 @@ bool GSCore::begin(uint8_t ss, uint8_t data_ready)
 
   bool res = _begin();
   this->initializing = false;
+
+  // Only attach the interrupt after initialization, since _begin()
+  // needs to read the startup banner and command replies itself.
+  if (res && rx_interrupt && !attachRxInterrupt()) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println(F("Cannot attach data ready interrupt, polling instead"));
+  }
   return res;
 }
 
@@ -102,22 +167,39 @@ bool GSCore::_begin()
 {
   this->rx_state = GS_RX_IDLE;
   this->rx_data_head = this->rx_data_tail = 0;
-  this->tail_frame.length = 0;
+  this->head_header = RX_NO_FRAME;
+  for (cid_t cid = 0; cid <= MAX_CID; ++cid)
+    this->rx_cids[cid].frame = RX_NO_FRAME;
   this->spi_prev_was_esc = false;
   this->spi_xoff = false;
+  this->spi_rx_len = this->spi_rx_pos = 0;
+  this->tx_queue_head = this->tx_queue_tail = 0;
+  this->tx_state = GS_TX_IDLE;
   this->ncm_auto_cid = INVALID_CID;
+  this->accept_len = 0;
+  memset(this->handlers, 0, sizeof(this->handlers));
+  this->disconnect_events = 0;
+  this->transparent = this->transparent_suspended = false;
   this->events = 0;
-  this->spi_poll_time = micros() - MINIMUM_POLL_INTERVAL;
+  // Start out fast and do a full poll right away
+  this->spi_poll_interval = this->spi_poll_min;
+  this->spi_poll_time = micros() - this->spi_poll_interval;
 
-  // TODO: Query AT+NSTAT=? to see if we are aready connected (in case
-  // the NCM already connected before we were initialized).
   this->associated = false;
 
   // The startup procedure is:
   //  - Wait for the data_ready pin to go high
   //  - Read the startup banner
+  // When the module was not reset along with us, there is no banner,
+  // so keep probing with an AT command until it answers.
   uint32_t start = millis();
+  uint32_t probe = start - STARTUP_PROBE_INTERVAL;
   do {
+    if ((unsigned long)(millis() - probe) >= STARTUP_PROBE_INTERVAL) {
+      writeRaw((const uint8_t*)"AT\r\n", 4);
+      probe = millis();
+    }
+
     if (this->data_ready_pin != INVALID_PIN) {
       // Check the data_ready pin.
       if (digitalRead(this->data_ready_pin) == HIGH)
@@ -143,8 +225,15 @@ bool GSCore::_begin()
 
   // When we get here, some data is available. We just clear out all of
   // it (since checking the banner is tricky, there's a few different
-  // things that could be printed).
-  while(readRaw() != -1) /* nothing */;
+  // things that could be printed), including any replies to probes
+  // that are still on their way.
+  uint32_t quiet = millis();
+  while ((unsigned long)(millis() - quiet) < STARTUP_QUIET_TIME) {
+    if (readRaw() != -1)
+      quiet = millis();
+    if (this->unrecoverableError)
+      return false;
+  }
 
   // Always start with disabling verbose mode, otherwise we won't be
   // able to interpret responses
@@ -165,17 +254,104 @@ bool GSCore::_begin()
 
   memset(this->connections, 0, sizeof(connections));
 
+#if GS_WARM_START
+  // The module might have been running and associated already (e.g.
+  // after an MCU-only reset or when the NCM started on power-up).
+  // Find out, and find out what it is configured with, so associate()
+  // and writeConfigCommand() can skip anything that would change
+  // nothing. Failures here are not fatal, then we just know less.
+  writeCommand("AT+NSTAT=?");
+  readResponse(" ", parseStatusField, this);
+
+  this->config_len = 0;
+  bool stored_profile = false;
+  void *data[] = {this, &stored_profile};
+  writeCommand("AT&V");
+  readResponse(" ", parseConfigField, data);
+#endif
+
+  return true;
+}
+
+
+void GSCore::setRtsPin(uint8_t pin)
+{
+  this->rts_pin = pin;
+  this->rts_stopped = false;
+  if (pin != INVALID_PIN) {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+}
+
+void GSCore::setCtsPin(uint8_t pin)
+{
+  this->cts_pin = pin;
+  if (pin != INVALID_PIN)
+    pinMode(pin, INPUT);
+}
+
+bool GSCore::waitForCts()
+{
+  // RTS is active low
+  if (this->cts_pin == INVALID_PIN || digitalRead(this->cts_pin) == LOW)
+    return true;
+
+  STATS_ADD(cts_stalls, 1);
+  unsigned long start = millis();
+  while (digitalRead(this->cts_pin) == HIGH) {
+    if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println(F("Timeout waiting for CTS"));
+      return false;
+    }
+  }
   return true;
 }
 
+bool GSCore::probeLink()
+{
+  IrqGuard guard(*this);
+  waitForCommands();
+  finishTxFrame();
+
+  for (uint8_t i = 0; i < LINK_PROBE_TRIES; ++i) {
+    writeRaw((const uint8_t*)"AT\r\n", 4);
+
+    // Look for a line containing just "0" (OK in non-verbose mode),
+    // anything else is ignored
+    enum { LINE_START, GOT_ZERO, OTHER } state = LINE_START;
+    unsigned long start = millis();
+    while ((unsigned long)(millis() - start) < LINK_PROBE_TIMEOUT) {
+      int c = readRaw();
+      if (this->unrecoverableError)
+        return false;
+      if (c == -1)
+        continue;
+      if (c == '\r' || c == '\n') {
+        if (state == GOT_ZERO)
+          return true;
+        state = LINE_START;
+      } else {
+        state = (c == '0' && state == LINE_START) ? GOT_ZERO : OTHER;
+      }
+    }
+  }
+  return false;
+}
 
 void GSCore::end()
 {
+  abortCommands(GS_UNRECOVERABLE_ERROR);
+  detachRxInterrupt();
   this->serial = NULL;
   if (this->ss_pin != INVALID_PIN)
     pinMode(this->ss_pin, INPUT);
   this->ss_pin = INVALID_PIN;
   this->data_ready_pin = INVALID_PIN;
+  // Queued data can no longer be sent
+  this->tx_queue_head = this->tx_queue_tail;
+  this->tx_state = GS_TX_IDLE;
 
   // Make sure that queries on state still return something sane
   memset(this->connections, 0, sizeof(connections));
@@ -185,10 +361,16 @@ void GSCore::end()
 
 void GSCore::loop()
 {
-  if (this->unrecoverableError)
+  if (this->unrecoverableError) {
+    abortCommands(GS_UNRECOVERABLE_ERROR);
     return;
+  }
 
+  IrqGuard guard(*this);
+  processCommands();
   readAndProcessAsync();
+  processTxQueue();
+  processCommands();
 
   if (this->onNcmDisconnect && (this->events & EVENT_NCM_DISCONNECTED)) {
     this->events &= ~EVENT_NCM_DISCONNECTED;
@@ -206,6 +388,155 @@ void GSCore::loop()
     this->events &= ~EVENT_NCM_CONNECTED;
     this->onNcmConnect(this->eventData, this->ncm_auto_cid);
   }
+
+  dispatchConnectionHandlers();
+}
+
+bool GSCore::setConnectionHandlers(cid_t cid, data_handler_t onData, disconnect_handler_t onDisconnect, void *data)
+{
+  if (cid > MAX_CID || !this->connections[cid].connected)
+    return false;
+
+  IrqGuard guard(*this);
+  this->handlers[cid].onData = onData;
+  this->handlers[cid].onDisconnect = onDisconnect;
+  this->handlers[cid].data = data;
+  return true;
+}
+
+void GSCore::clearConnectionHandlers(cid_t cid)
+{
+  if (cid > MAX_CID)
+    return;
+
+  IrqGuard guard(*this);
+  memset(&this->handlers[cid], 0, sizeof(this->handlers[cid]));
+  this->disconnect_events &= ~(1 << cid);
+}
+
+void GSCore::dispatchConnectionHandlers()
+{
+  for (cid_t cid = 0; cid <= MAX_CID; ++cid) {
+    ConnectionHandlers &h = this->handlers[cid];
+    // Offer buffered data first, so it is not lost on disconnect
+    if (h.onData && this->rx_cids[cid].frame != RX_NO_FRAME) {
+      RXFrame frame = frameAt(this->rx_cids[cid].frame);
+      if (frame)
+        h.onData(h.data, cid, frame);
+    }
+
+    if (this->disconnect_events & (1 << cid)) {
+      disconnect_handler_t onDisconnect = h.onDisconnect;
+      void *data = h.data;
+      clearConnectionHandlers(cid);
+      if (onDisconnect)
+        onDisconnect(data, cid);
+    }
+  }
+}
+
+GSCore *GSCore::rx_irq_instances[MAX_RX_INTERRUPTS];
+
+// attachInterrupt() does not allow passing data to the ISR, so every
+// slot needs its own ISR.
+void GSCore::rxInterrupt0() { rx_irq_instances[0]->handleRxInterrupt(); }
+void GSCore::rxInterrupt1() { rx_irq_instances[1]->handleRxInterrupt(); }
+
+static_assert(GSCore::MAX_RX_INTERRUPTS == 2, "ISR count does not match MAX_RX_INTERRUPTS");
+
+bool GSCore::attachRxInterrupt()
+{
+  static void (* const isrs[])() = {rxInterrupt0, rxInterrupt1};
+
+  if (this->data_ready_pin == INVALID_PIN)
+    return false;
+
+  int irq = digitalPinToInterrupt(this->data_ready_pin);
+  if (irq == NOT_AN_INTERRUPT)
+    return false;
+
+  for (uint8_t slot = 0; slot < MAX_RX_INTERRUPTS; ++slot) {
+    if (!rx_irq_instances[slot]) {
+      rx_irq_instances[slot] = this;
+      this->rx_irq_slot = slot;
+      this->rx_irq_pending = false;
+      #ifdef SPI_HAS_TRANSACTION
+      // Make sure other SPI users do not get interrupted by us
+      SPI.usingInterrupt(irq);
+      #endif
+      attachInterrupt(irq, isrs[slot], RISING);
+      // Data might have become available before attaching
+      handleRxInterrupt();
+      return true;
+    }
+  }
+  return false;
+}
+
+void GSCore::detachRxInterrupt()
+{
+  if (this->rx_irq_slot == INVALID_PIN)
+    return;
+
+  detachInterrupt(digitalPinToInterrupt(this->data_ready_pin));
+  rx_irq_instances[this->rx_irq_slot] = NULL;
+  this->rx_irq_slot = INVALID_PIN;
+}
+
+void GSCore::handleRxInterrupt()
+{
+  this->rx_irq_pending = true;
+  if (this->busy == 0)
+    drainModule();
+}
+
+void GSCore::drainModule()
+{
+  // Don't steal the reply to a command from readResponse, just leave
+  // rx_irq_pending set so we get called again after the reply.
+  if (this->response_pending)
+    return;
+
+  // In transparent mode, data is read by the application only
+  if (this->transparent)
+    return;
+
+  // Another device (or module) is using the bus, releaseSpiBus() calls
+  // us again when it is done.
+  if (spi_bus_claims && this->ss_pin != INVALID_PIN)
+    return;
+
+  ++this->busy;
+  do {
+    this->rx_irq_pending = false;
+    // Reading stops when the data ready pin goes low (or we processed a
+    // lot of bytes, in which case loop() will continue later).
+    int16_t tries = 1024;
+    while (tries > 0) {
+      uint16_t len = readAndProcessBlock();
+      if (!len)
+        break;
+      tries -= len;
+    }
+  } while (this->rx_irq_pending && !this->response_pending);
+
+  // When we stopped with data still available (because of the byte
+  // limit above, or because rx_data is full in lossless mode), there
+  // will be no new rising edge, so remember to drain again when the
+  // next IrqGuard goes away.
+  if (this->rx_irq_slot != INVALID_PIN && digitalRead(this->data_ready_pin) == HIGH)
+    this->rx_irq_pending = true;
+  --this->busy;
+}
+
+void GSCore::resumeDrain()
+{
+  // In lossless mode, draining stops when rx_data is full and the data
+  // ready pin does not make a new edge when room frees up again, so
+  // drain again when the last IrqGuard goes away.
+  if (this->rx_lossless && this->rx_irq_slot != INVALID_PIN && !this->rx_irq_pending &&
+      digitalRead(this->data_ready_pin) == HIGH)
+    this->rx_irq_pending = true;
 }
 
 /*******************************************************
@@ -214,98 +545,170 @@ void GSCore::loop()
 
 int GSCore::peekData(cid_t cid)
 {
+  IrqGuard guard(*this);
   // If availableData returns non-zero, then at least one byte is
   // available in the buffer, so we can just return that without further
   // checking.
-  if (availableData(cid) > 0)
-    return this->rx_data[this->rx_data_tail];
+  RXFrame frame = getFrameHeader(cid);
+  if (frame && availableData(frame.cid) > 0) {
+    const RXCidState &state = this->rx_cids[frame.cid];
+    RXHeader header;
+    loadFrameHeader(state.frame, &header);
+    return this->rx_data[rxIndex(frameData(state.frame, &header) + state.read)];
+  }
   return -1;
 }
 
 int GSCore::readData(cid_t cid)
 {
+  IrqGuard guard(*this);
   // First, make sure we have a valid frame header
-  if (!getFrameHeader(cid))
+  RXFrame frame = getFrameHeader(cid);
+  if (!frame)
     return -1;
 
-  return getData();
+  return getData(frame.cid);
 }
 
 size_t GSCore::readData(cid_t cid, uint8_t *buf, size_t size)
 {
+  return readOrSkipData(cid, buf, size);
+}
+
+uint16_t GSCore::skipData(cid_t cid, uint16_t len)
+{
+  return readOrSkipData(cid, NULL, len);
+}
+
+bool GSCore::discardFrame(cid_t cid)
+{
+  IrqGuard guard(*this);
+  RXFrame frame = getFrameHeader(cid);
+  if (!frame)
+    return false;
+
+  return readOrSkipData(frame.cid, NULL, frame.length) == frame.length;
+}
+
+size_t GSCore::readOrSkipData(cid_t cid, uint8_t *buf, size_t size)
+{
+  IrqGuard guard(*this);
   // First, make sure we have a valid frame header
-  if (!getFrameHeader(cid))
+  RXFrame frame = getFrameHeader(cid);
+  if (!frame)
     return 0;
 
-  if (this->rx_data_tail != this->rx_data_head) {
-    // There is data in the buffer. Find out how much data we can read
-    // consecutively
-    rx_data_index_t len;
-    if (this->rx_data_head > this->rx_data_tail) {
-      // Data can be read from the tail to the head
-      len = this->rx_data_head - this->rx_data_tail;
-    } else {
-      // Data can be read from the tail to the end of the buffer
-      len = sizeof(this->rx_data) - this->rx_data_tail;
-    }
-    // Don't read beyond the end of the frame
-    if (len > this->tail_frame.length)
-      len = this->tail_frame.length;
-    // Don't write beyond the end of the buffer
-    if (len > size)
-      len = size;
-    memcpy(buf, &this->rx_data[this->rx_data_tail], len);
-    this->rx_data_tail = (this->rx_data_tail + len) % sizeof(this->rx_data);
-    this->tail_frame.length -= len;
-    // If the buffer isn't full yet, call ourselves again to read more
-    // data:
-    //  - From the start of the buffer if we read up to the end of rx_data
-    //  - From a next frame, if we read up to the end of the frame
-    //  - From the module directly, if we emptied rx_data
-    if (len != size)
-      len += readData(cid, buf + len, size - len);
-    return len;
-  } else {
-    // No data buffered, try reading from the module directly, as long
-    // as it keeps sending us data
-    size_t read = 0;
-    while (read < size) {
-      int c = readRaw();
-      if (c == -1)
-        break;
-      buf[read++] = c;
-      this->tail_frame.length--;
-      if(--this->head_frame.length == 0) {
-        this->rx_state = GS_RX_IDLE;
-        break;
+  RXCidState &state = this->rx_cids[frame.cid];
+  size_t read = 0;
+  while (read < size && state.frame != RX_NO_FRAME) {
+    const uint8_t *data;
+    // When skipping, all buffered data for the frame can be skipped at
+    // once, when reading only a contiguous block can be copied.
+    size_t len = buf ? bufferedBlock(frame.cid, &data) : bufferedData(frame.cid);
+    if (len) {
+      // There is data in the buffer, copy as much as fits
+      if (len > size - read)
+        len = size - read;
+      if (buf)
+        memcpy(buf + read, data, len);
+      consumeData(frame.cid, len);
+      read += len;
+    } else if (state.frame == this->head_header) {
+      // No data buffered, so this must be the frame the module is
+      // still sending. Try reading from the module directly, as long as
+      // it keeps sending us data.
+      while (read < size && this->head_frame.length) {
+        int c = readRaw();
+        if (c == -1)
+          return read;
+        if (buf)
+          buf[read] = c;
+        ++read;
+        if (--this->head_frame.length == 0)
+          headFrameComplete();
       }
+      // Continue with the next frame for this cid if this frame is done
+      consumeData(frame.cid, 0);
+    } else {
+      break;
     }
-    return read;
   }
+  return read;
 }
 
 int GSCore::readData(cid_t *cid)
 {
+  IrqGuard guard(*this);
   // First, make sure we have a valid frame header
-  if (!getFrameHeader(ANY_CID))
+  RXFrame frame = getFrameHeader(ANY_CID);
+  if (!frame)
     return -1;
 
-  int c = getData();
+  int c = getData(frame.cid);
   if (c >= 0)
-    *cid = this->tail_frame.cid;
+    *cid = frame.cid;
   return c;
 }
 
+uint16_t GSCore::borrowData(cid_t cid, const uint8_t **buf)
+{
+  IrqGuard guard(*this);
+  RXFrame frame = getFrameHeader(cid);
+  if (!frame)
+    return 0;
+
+  // If nothing is buffered, but the module is sending the current
+  // frame for this cid, pull its data into the buffer (without dropping
+  // any data to make room).
+  const RXCidState &state = this->rx_cids[frame.cid];
+  if (bufferedData(frame.cid) == 0 && state.frame == this->head_header &&
+      this->rx_irq_slot == INVALID_PIN) {
+    while (this->head_frame.length && rxFree() > 0) {
+      int c = readRaw();
+      if (c == -1)
+        break;
+      processIncoming(c);
+    }
+  }
+
+  return bufferedBlock(frame.cid, buf);
+}
+
+void GSCore::consumeData(cid_t cid, uint16_t len)
+{
+  IrqGuard guard(*this);
+  if (cid > MAX_CID)
+    return;
+
+  RXCidState &state = this->rx_cids[cid];
+  if (state.frame == RX_NO_FRAME)
+    return;
+
+  RXHeader header;
+  loadFrameHeader(state.frame, &header);
+  if (len > header.length - state.read)
+    len = header.length - state.read;
+  state.read += len;
+
+  if (state.read == header.length && state.frame != this->head_header)
+    finishFrame(cid);
+  resumeDrain();
+}
+
 GSCore::cid_t GSCore::firstCidWithData()
 {
-  if (!getFrameHeader(ANY_CID))
+  IrqGuard guard(*this);
+  RXFrame frame = getFrameHeader(ANY_CID);
+  if (!frame)
     return INVALID_CID;
-  return this->tail_frame.cid;
+  return frame.cid;
 }
 
 uint16_t GSCore::availableData(cid_t cid)
 {
-  if (!getFrameHeader(cid))
+  IrqGuard guard(*this);
+  RXFrame frame = getFrameHeader(cid);
+  if (!frame)
     return 0;
 
   // If we return a number here, we must be sure that that many bytes
@@ -323,24 +726,36 @@ uint16_t GSCore::availableData(cid_t cid)
   // available() returns > 0. So we should only return 0 when really is
   // no data available. For this reason, if our buffer is empty, try to
   // read at least one byte from the module.
-  if (this->rx_data_head == this->rx_data_tail)
+  uint16_t len = bufferedData(frame.cid);
+  if (len == 0 && this->rx_irq_slot == INVALID_PIN) {
     processIncoming(readRaw());
-
-  uint16_t len = (this->rx_data_head - this->rx_data_tail) % sizeof(this->rx_data);
-  if (len > this->tail_frame.length)
-    len = this->tail_frame.length;
+    len = bufferedData(frame.cid);
+  }
   return len;
 }
 
 bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
 {
-  if (cid > MAX_CID)
+  // Hardware doesn't support more than MAX_DATA_FRAME_SIZE
+  if (len > MAX_DATA_FRAME_SIZE)
+    return writeData(cid, buf, MAX_DATA_FRAME_SIZE) && writeData(cid, buf + MAX_DATA_FRAME_SIZE, len - MAX_DATA_FRAME_SIZE);
+
+  GSChunk chunk = {buf, len, false};
+  return writeData(cid, &chunk, 1);
+}
+
+bool GSCore::writeData(cid_t cid, const GSChunk *chunks, uint8_t num_chunks)
+{
+  if (cid > MAX_CID || this->transparent)
     return false;
 
-  // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
-  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
-    return writeData(cid, buf, 1400) && writeData(cid, buf + 1400, len - 1400);
+  uint16_t len = chunksLength(chunks, num_chunks);
+  if (len > MAX_DATA_FRAME_SIZE)
+    return false;
+
+  IrqGuard guard(*this);
+  // Data queued earlier must be sent first
+  flushTxQueue();
 
   if (GS_DUMP_LINES && this->debug) {
     this->debug->print(">>| Writing bulk data frame for cid ");
@@ -350,44 +765,54 @@ bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
     this->debug->println(" bytes");
   }
 
-  uint8_t header[8]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  snprintf((char*)header, sizeof(header), "\x1bZ%x%04d", cid, len);
+  uint8_t header[MAX_FRAME_HEADER_SIZE];
+  uint8_t headerlen = formatFrameHeader(header, cid, NULL, 0, len);
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
   writeRaw(header, 3);
   if (!readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending bulk data frame failed");
+    STATS_ADD(data_response_failures, 1);
     return false;
   }
 
-  // Then, write the rest of the escape sequence (-1 to not write the
-  // trailing 0)
-  writeRaw(header + 3, sizeof(header) - 1 - 3);
+  // Then, write the rest of the escape sequence
+  writeRaw(header + 3, headerlen - 3);
   // And write the actual data
-  writeRaw(buf, len);
+  writeChunks(chunks, num_chunks);
+  trace(GS_TRACE_DATA, TRACE_TX_FRAME, cid, len);
+  STATS_ADD(tx_frames[cid], 1);
+  STATS_ADD(tx_bytes[cid], len);
   return true;
 }
 
 bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len)
 {
-  if (cid > MAX_CID)
+  GSChunk chunk = {buf, len, false};
+  return writeData(cid, ip, port, &chunk, 1);
+}
+
+bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const GSChunk *chunks, uint8_t num_chunks)
+{
+  if (cid > MAX_CID || this->transparent)
     return false;
 
-  // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
-  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
+  // Hardware doesn't support more than MAX_DATA_FRAME_SIZE
+  uint16_t len = chunksLength(chunks, num_chunks);
+  if (len > MAX_DATA_FRAME_SIZE)
     return false;
 
-  uint8_t ipbuf[16];
-  snprintf((char*)ipbuf, sizeof(ipbuf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  IrqGuard guard(*this);
+  finishTxFrame();
 
   if (GS_DUMP_LINES && this->debug) {
+    char ipbuf[IP_STRING_SIZE];
+    formatIpAddress(ipbuf, ip);
     this->debug->print(">>| Writing UDP server bulk data frame for cid ");
     this->debug->print(cid);
     this->debug->print(" to ");
-    this->debug->print((const char*)ipbuf);
+    this->debug->print(ipbuf);
     this->debug->print(":");
     this->debug->print(port);
     this->debug->print(" containing ");
@@ -395,9 +820,8 @@ bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *bu
     this->debug->println(" bytes");
   }
 
-  uint8_t header[28]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  size_t headerlen = snprintf((char*)header, sizeof(header), "\x1bY%x%s:%u:%04d", cid, ipbuf, port, len);
+  uint8_t header[MAX_FRAME_HEADER_SIZE];
+  uint8_t headerlen = formatFrameHeader(header, cid, &ip, port, len);
 
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
@@ -405,6 +829,7 @@ bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *bu
   if (!readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending UDP server bulk data frame failed");
+    STATS_ADD(data_response_failures, 1);
     return false;
   }
 
@@ -414,179 +839,1003 @@ bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *bu
   // <ESC>O if everything is ok...)
 
   // And write the actual data
-  writeRaw(buf, len);
+  writeChunks(chunks, num_chunks);
+  trace(GS_TRACE_DATA, TRACE_TX_UDP_FRAME, cid, len);
+  STATS_ADD(tx_frames[cid], 1);
+  STATS_ADD(tx_bytes[cid], len);
   return true;
 }
 
-/*******************************************************
- * Methods for writing commands / reading replies
- *******************************************************/
+uint8_t GSCore::formatFrameHeader(uint8_t *buf, cid_t cid, const IPAddress *ip, uint16_t port, uint16_t len)
+{
+  // <ESC>Z<cid><len4> or <ESC>Y<cid><ip>:<port>:<len4>
+  uint8_t headerlen = 0;
+  buf[headerlen++] = 0x1b;
+  buf[headerlen++] = ip ? 'Y' : 'Z';
+  headerlen += formatNumber((char*)buf + headerlen, cid, 16);
+  if (ip) {
+    headerlen += formatIpAddress((char*)buf + headerlen, *ip);
+    buf[headerlen++] = ':';
+    headerlen += formatNumber((char*)buf + headerlen, port);
+    buf[headerlen++] = ':';
+  }
+  headerlen += formatNumber((char*)buf + headerlen, len, 10, 4);
+  return headerlen;
+}
 
-void GSCore::writeCommand(const char *fmt, ...)
+bool GSCore::writeBulkData(cid_t cid, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result)
 {
-  va_list args;
+  return writeBulkData(cid, NULL, 0, len, callback, data, buf, size, result);
+}
 
-  va_start(args, fmt);
-  writeCommand(fmt, args);
-  va_end(args);
+bool GSCore::writeBulkData(cid_t cid, IPAddress ip, uint16_t port, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result)
+{
+  return writeBulkData(cid, &ip, port, len, callback, data, buf, size, result);
 }
 
-void GSCore::writeCommand(const char *fmt, va_list args)
+bool GSCore::writeBulkData(cid_t cid, const IPAddress *ip, uint16_t port, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result)
 {
-  uint8_t buf[128];
-  size_t len = vsnprintf((char*)buf, sizeof(buf) - 2, fmt, args);
-  if (len > sizeof(buf) - 2) {
-    len = sizeof(buf) - 2;
-    if (GS_LOG_ERRORS && this->error) {
-      this->error->print("Command truncated: ");
-      this->error->write(buf, len);
-      this->error->println();
-    }
-  }
+  if (result)
+    memset(result, 0, sizeof(*result));
+
+  if (cid > MAX_CID || size == 0 || this->transparent)
+    return false;
+  if (size > MAX_DATA_FRAME_SIZE)
+    size = MAX_DATA_FRAME_SIZE;
+
+  IrqGuard guard(*this);
+  if (ip)
+    finishTxFrame();
+  else
+    flushTxQueue();
 
   if (GS_DUMP_LINES && this->debug) {
-    this->debug->print(">>= ");
-    this->debug->write(buf, len);
-    this->debug->println();
+    this->debug->print(">>| Writing ");
+    this->debug->print(len);
+    this->debug->print(" bytes of bulk data for cid ");
+    this->debug->println(cid);
   }
 
-  buf[len++] = '\r';
-  buf[len++] = '\n';
+  unsigned long start = millis();
+  uint32_t done = 0;
+  bool ok = true;
+  while (done < len) {
+    uint16_t frame_len = (len - done < size) ? len - done : size;
+
+    // Start the frame right away. The module only needs the length
+    // after it acknowledged this part, so the data can be produced
+    // while waiting for that.
+    uint8_t header[MAX_FRAME_HEADER_SIZE];
+    formatFrameHeader(header, cid, ip, port, 0);
+    writeRaw(header, 3);
+
+    uint16_t filled = 0;
+    while (filled < frame_len) {
+      uint16_t n = callback(buf + filled, frame_len - filled, data);
+      if (n == 0)
+        break;
+      filled += n;
+    }
 
-  this->writeRaw(buf, len);
-}
+    if (!readDataResponse()) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println("Sending bulk data frame failed");
+      STATS_ADD(data_response_failures, 1);
+      ok = false;
+      break;
+    }
 
-bool GSCore::writeCommandCheckOk(const char *fmt, ...)
-{
-  va_list args;
+    // The module now expects the rest of the frame, so send it even
+    // when the callback ran out of data.
+    uint8_t headerlen = formatFrameHeader(header, cid, ip, port, filled);
+    writeRaw(header + 3, headerlen - 3);
+    writeRaw(buf, filled);
+    trace(GS_TRACE_DATA, ip ? TRACE_TX_UDP_FRAME : TRACE_TX_FRAME, cid, filled);
+    STATS_ADD(tx_frames[cid], 1);
+    STATS_ADD(tx_bytes[cid], filled);
+    if (result) {
+      result->bytes += filled;
+      result->frames++;
+    }
 
-  va_start(args, fmt);
-  writeCommand(fmt, args);
-  va_end(args);
+    done += filled;
+    if (filled < frame_len) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println("Bulk data callback ran out of data");
+      ok = false;
+      break;
+    }
+  }
 
-  return (readResponse() == GS_SUCCESS);
+  if (result)
+    result->duration = millis() - start;
+  return ok && !this->unrecoverableError;
 }
 
-GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+uint16_t GSCore::chunksLength(const GSChunk *chunks, uint8_t num_chunks)
 {
-  uint16_t read = 0;
-  uint16_t line_start = 0;
-  bool dropped_data = false;
-  bool skip_line = false;
-  GSResponse res;
-  unsigned long start = millis();
-  while(true) {
-    if (this->unrecoverableError)
-      return GS_UNRECOVERABLE_ERROR;
+  uint32_t len = 0;
+  for (uint8_t i = 0; i < num_chunks; ++i)
+    len += chunks[i].len;
+  // Make sure an overflow is not mistaken for a small frame
+  return len < 0xffff ? len : 0xffff;
+}
 
-    int c = readRaw();
-    if (c == -1) {
-      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
-        if (GS_LOG_ERRORS && this->error)
-          this->error->println("Response timeout");
-        // On a response timeout, our state will be (and probably stay)
-        // wrong. Flag an unrecoverable error.
-        this->unrecoverableError = true;
-        return GS_UNRECOVERABLE_ERROR;
-      }
+void GSCore::writeChunks(const GSChunk *chunks, uint8_t num_chunks)
+{
+  for (uint8_t i = 0; i < num_chunks; ++i) {
+    const GSChunk &chunk = chunks[i];
+    if (!chunk.progmem) {
+      writeRaw(chunk.buf, chunk.len);
       continue;
     }
 
-    if (this->rx_state != GS_RX_IDLE || c == 0x1b) {
-      // We're currently handling connection or async data, or are about
-      // to. Let processIncoming sort that out.
-      processIncoming(c);
-    } else if ((c == '\r' || c == '\n')) {
-      // This normalizes all sequences of line endings into a single
-      // \r\n and strips leading \r\n sequences, because responses tend
-      // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
-      // As a side effect, this removes empty lines from output, but
-      // that's ok.
-      if (read - line_start == 0)
-        continue;
+    // writeRaw() needs the data in RAM, so copy it a block at a time
+    uint8_t block[SPI_BLOCK_SIZE];
+    for (uint16_t done = 0; done < chunk.len; done += sizeof(block)) {
+      uint16_t n = chunk.len - done;
+      if (n > sizeof(block))
+        n = sizeof(block);
+      memcpy_P(block, chunk.buf + done, n);
+      writeRaw(block, n);
+    }
+  }
+}
 
-      if (skip_line) {
-        // Data from this line has been dropped because the buffer was
-        // full, and it was too long for a response anyway, so further
-        // ignore this line.
-        skip_line = false;
-        // Remove the line from the buffer
-        read = line_start;
-        if (GS_DUMP_LINES && this->debug)
-          this->debug->println("<<| Skipped uninteresting long line");
-        continue;
-      }
-      skip_line = false;
+void GSCore::setTxQueue(uint8_t *tx_buf, uint16_t tx_size)
+{
+  IrqGuard guard(*this);
+  flushTxQueue();
+  this->tx_queue = tx_buf;
+  this->tx_queue_mask = tx_size - 1;
+  this->tx_queue_head = this->tx_queue_tail = this->tx_queue_last = 0;
+  this->tx_state = GS_TX_IDLE;
+}
 
-      res = processResponseLine(buf + line_start, read - line_start, connect_cid);
-      // When we get a GS_LINK_LOST, we're apparently not associated
-      // when we thought we would be. Call processDisassciation() to fix
-      // that.
-      if (res == GS_LINK_LOST)
-        processDisassociation();
+uint16_t GSCore::txQueueFree()
+{
+  if (!this->tx_queue)
+    return 0;
 
-      if (keep_data && !callback && !dropped_data && res == GS_UNKNOWN_RESPONSE) {
-        // Unknown response, so it's probably actual data that the
-        // caller will want to have. Leave it in the buffer, and
-        // terminate it with \r\n.
-        if (read < *len) buf[read++] = '\r';
-        if (read < *len) buf[read++] = '\n';
-        line_start = read;
-      } else {
-        // If we have a callback, pass any unknown response to it
-        if (keep_data && callback && res == GS_UNKNOWN_RESPONSE)
-          callback(&buf[line_start], read - line_start, data);
-
-        // Remove the line from the buffer since we either handled it
-        // already, or we're not interested in the data
-        read = line_start;
-
-        if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
-          // All other responses indicate the end of the reply
-          *len = read;
-          return res;
-        }
-      }
-    } else {
-      if (read < *len) {
-        buf[read++] = c;
-      } else if ((read - line_start) >= MAX_RESPONSE_SIZE ) {
-        // The buffer is full. However, the line is too long for a
-        // response, so there is no danger in just discarding the byte.
-        if (keep_data && GS_LOG_ERRORS && this->error)
-          dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
-
-        // Make sure we won't try to parse the few bytes we have as a
-        // response.
-        skip_line = true;
-        dropped_data = true;
-      } else {
-        // The buffer is full, but we can't just discard the byte: It
-        // might be part of the final response we're waiting for.
-        // Instead, drop the last byte of the previous line to make
-        // room, and move any data in the current line accordingly.
-        if (line_start > 0) {
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer too small, removed byte: ", buf[line_start - 1]);
-          memmove(&buf[line_start - 1], &buf[line_start], (read - line_start));
-          line_start--;
-          buf[read] = c;
-        } else {
-          // line_start == 0 should only happen if len <
-          // MAX_RESPONSE_SIZE, but better be safe than sorry.
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer tiny? Dropped byte: ", c);
+  uint16_t free = txIndex(this->tx_queue_tail - this->tx_queue_head - 1);
+  if (free <= sizeof(TXHeader))
+    return 0;
+  free -= sizeof(TXHeader);
+  return free < MAX_DATA_FRAME_SIZE ? free : MAX_DATA_FRAME_SIZE;
+}
+
+void GSCore::copyToTxQueue(uint16_t pos, const void *buf, uint16_t len)
+{
+  uint16_t first = this->tx_queue_mask + 1 - pos;
+  if (first > len)
+    first = len;
+  memcpy(this->tx_queue + pos, buf, first);
+  memcpy(this->tx_queue, (const uint8_t*)buf + first, len - first);
+}
+
+void GSCore::copyFromTxQueue(uint16_t pos, void *buf, uint16_t len)
+{
+  uint16_t first = this->tx_queue_mask + 1 - pos;
+  if (first > len)
+    first = len;
+  memcpy(buf, this->tx_queue + pos, first);
+  memcpy((uint8_t*)buf + first, this->tx_queue, len - first);
+}
+
+uint16_t GSCore::queueData(cid_t cid, const uint8_t *buf, uint16_t len)
+{
+  if (cid > MAX_CID || !this->tx_queue)
+    return 0;
+
+  IrqGuard guard(*this);
+  uint16_t done = 0;
+  while (done < len) {
+    uint16_t free = txIndex(this->tx_queue_tail - this->tx_queue_head - 1);
+    uint16_t pos = this->tx_queue_last;
+    TXHeader header;
+
+    // Add to the newest frame when possible, which saves the overhead
+    // of a frame. Once its length was sent, it can no longer grow.
+    bool extend = false;
+    if (this->tx_queue_head != this->tx_queue_tail &&
+        (pos != this->tx_queue_tail || this->tx_state != GS_TX_SENDING)) {
+      copyFromTxQueue(pos, &header, sizeof(header));
+      extend = (header.cid == cid && header.length < MAX_DATA_FRAME_SIZE);
+    }
+
+    if (!extend) {
+      if (free <= sizeof(header))
+        break;
+      pos = this->tx_queue_head;
+      header.cid = cid;
+      header.length = 0;
+      this->tx_queue_head = txIndex(this->tx_queue_head + sizeof(header));
+      this->tx_queue_last = pos;
+      free -= sizeof(header);
+    }
+
+    uint16_t n = len - done;
+    if (n > free)
+      n = free;
+    if (n > MAX_DATA_FRAME_SIZE - header.length)
+      n = MAX_DATA_FRAME_SIZE - header.length;
+    if (n == 0)
+      break;
+
+    copyToTxQueue(this->tx_queue_head, buf + done, n);
+    this->tx_queue_head = txIndex(this->tx_queue_head + n);
+    header.length += n;
+    copyToTxQueue(pos, &header, sizeof(header));
+    done += n;
+  }
+
+  if (done < len)
+    STATS_ADD(tx_queue_full, 1);
+
+  // When the module is idle, start sending right away
+  processTxQueue();
+  return done;
+}
+
+void GSCore::processTxQueue(bool start)
+{
+  // Frames would end up in the transparent data stream
+  if (this->transparent)
+    return;
+
+  while (this->tx_queue_head != this->tx_queue_tail) {
+    if (this->unrecoverableError) {
+      // Nothing can be sent anymore
+      this->tx_queue_head = this->tx_queue_tail;
+      this->tx_state = GS_TX_IDLE;
+      return;
+    }
+
+    TXHeader header;
+    copyFromTxQueue(this->tx_queue_tail, &header, sizeof(header));
+
+    switch (this->tx_state) {
+      case GS_TX_IDLE:
+        // Data acks cannot be told apart from a command reply, so let
+        // commands go first.
+        if (!start || this->response_pending || this->commands)
+          return;
+        if (GS_DUMP_LINES && this->debug) {
+          this->debug->print(">>| Writing queued bulk data frame for cid ");
+          this->debug->println(header.cid);
         }
+        this->tx_state = GS_TX_PREFIX;
+        this->tx_sent = 0;
+        // fallthrough
+
+      case GS_TX_PREFIX:
+      {
+        // First, write the escape sequence up to the cid. After this,
+        // the module responds with <ESC>O or <ESC>F, which
+        // processIncoming() handles.
+        uint8_t prefix[3];
+        prefix[0] = 0x1b;
+        prefix[1] = 'Z';
+        formatNumber((char*)prefix + 2, header.cid, 16);
+        this->tx_sent += writeRawNonBlocking(prefix + this->tx_sent, sizeof(prefix) - this->tx_sent);
+        if (this->tx_sent < sizeof(prefix))
+          return;
+        this->tx_state = GS_TX_WAIT_ACK;
+        this->tx_start = millis();
+        return;
+      }
 
-        // Once we threw away a byte of data, don't store any new ones
-        // (to make sure the returned data is cleanly truncated instead
-        // of having gaps).
-        dropped_data = true;
+      case GS_TX_WAIT_ACK:
+        if ((unsigned long)(millis() - this->tx_start) > RESPONSE_TIMEOUT) {
+          if (GS_LOG_ERRORS && this->error)
+            this->error->println("Data response timeout");
+          // On a response timeout, our state will be (and probably
+          // stay) wrong. Flag an unrecoverable error.
+          STATS_ADD(response_timeouts, 1);
+          this->unrecoverableError = true;
+          continue;
+        }
+        return;
+
+      case GS_TX_FAILED:
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println("Sending queued bulk data frame failed");
+        STATS_ADD(data_response_failures, 1);
+        this->connections[header.cid].error = true;
+        this->tx_queue_tail = txIndex(this->tx_queue_tail + sizeof(header) + header.length);
+        this->tx_state = GS_TX_IDLE;
+        continue;
+
+      case GS_TX_ACKED:
+        this->tx_state = GS_TX_SENDING;
+        this->tx_sent = 0;
+        // fallthrough
+
+      case GS_TX_SENDING:
+      {
+        // Then, write the rest of the escape sequence
+        char digits[4];
+        if (this->tx_sent < sizeof(digits)) {
+          formatNumber(digits, header.length, 10, sizeof(digits));
+          this->tx_sent += writeRawNonBlocking((uint8_t*)digits + this->tx_sent, sizeof(digits) - this->tx_sent);
+          if (this->tx_sent < sizeof(digits))
+            return;
+        }
+
+        // And write the actual data, a contiguous block at a time
+        uint16_t data_sent;
+        while ((data_sent = this->tx_sent - sizeof(digits)) < header.length) {
+          uint16_t pos = txIndex(this->tx_queue_tail + sizeof(header) + data_sent);
+          uint16_t n = header.length - data_sent;
+          if (n > this->tx_queue_mask + 1 - pos)
+            n = this->tx_queue_mask + 1 - pos;
+          uint16_t written = writeRawNonBlocking(this->tx_queue + pos, n);
+          this->tx_sent += written;
+          if (written < n)
+            return;
+        }
+
+        trace(GS_TRACE_DATA, TRACE_TX_FRAME, header.cid, header.length);
+        STATS_ADD(tx_frames[header.cid], 1);
+        STATS_ADD(tx_bytes[header.cid], header.length);
+        this->tx_queue_tail = txIndex(this->tx_queue_tail + sizeof(header) + header.length);
+        this->tx_state = GS_TX_IDLE;
+        continue;
       }
     }
   }
 }
 
+void GSCore::finishTxFrame()
+{
+  IrqGuard guard(*this);
+  while (this->tx_state != GS_TX_IDLE) {
+    processTxQueue(false);
+    if (this->tx_state == GS_TX_WAIT_ACK)
+      readAndProcessBlock();
+  }
+}
+
+void GSCore::flushTxQueue()
+{
+  IrqGuard guard(*this);
+  while (!this->transparent && this->tx_queue_head != this->tx_queue_tail) {
+    processCommands();
+    processTxQueue();
+    if (this->tx_queue_head != this->tx_queue_tail)
+      readAndProcessBlock();
+  }
+}
+
+/*******************************************************
+ * Methods for writing commands / reading replies
+ *******************************************************/
+
+void GSCore::writeCommand(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  writeCommand(fmt, args);
+  va_end(args);
+}
+
+void GSCore::writeCommand(const char *fmt, va_list args)
+{
+  // Commands would end up in the transparent data stream otherwise.
+  // If this fails, the command will just cause a response timeout.
+  leaveTransparentMode();
+
+  uint8_t buf[MAX_COMMAND_SIZE + 3];
+  size_t len = formatString((char*)buf, sizeof(buf) - 2, fmt, args);
+  if (len > MAX_COMMAND_SIZE) {
+    len = MAX_COMMAND_SIZE;
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Command truncated: ");
+      this->error->write(buf, len);
+      this->error->println();
+    }
+  }
+
+  if (GS_DUMP_LINES && this->debug) {
+    this->debug->print(">>= ");
+    this->debug->write(buf, len);
+    this->debug->println();
+  }
+
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+
+  IrqGuard guard(*this);
+  // Replies cannot be matched to commands, so let any asynchronous
+  // commands finish first
+  waitForCommands();
+  // Never write halfway a data frame
+  finishTxFrame();
+  // Make sure the data ready interrupt leaves the reply alone
+  this->response_pending = true;
+  trace(GS_TRACE_LINES, TRACE_TX_COMMAND, INVALID_CID, len - 2);
+  this->writeRaw(buf, len);
+}
+
+void GSCore::discardRaw(uint16_t time)
+{
+  unsigned long start = millis();
+  while ((unsigned long)(millis() - start) < time)
+    readRaw();
+}
+
+bool GSCore::leaveTransparentMode()
+{
+  if (!this->transparent)
+    return true;
+
+  IrqGuard guard(*this);
+  // The escape sequence is only recognized when surrounded by silence.
+  // The module replies once there was silence after it as well.
+  discardRaw(TRANSPARENT_GUARD_TIME);
+  writeRaw((const uint8_t*)"+++", 3);
+
+  this->transparent = false;
+  this->response_pending = true;
+  if (readResponse() != GS_SUCCESS) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println(F("Failed to leave transparent mode"));
+    return false;
+  }
+  this->transparent_suspended = true;
+  return true;
+}
+
+uint8_t GSCore::formatCommand(uint8_t *buf, uint8_t size, const char *fmt, va_list args)
+{
+  size_t len = formatString((char*)buf, size - 2, fmt, args);
+  if (len > (size_t)size - 3) {
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Command too long: ");
+      this->error->write(buf, size - 3);
+      this->error->println();
+    }
+    return 0;
+  }
+
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return len;
+}
+
+bool GSCore::submitCommand(PendingCommand *cmd, const char *fmt, ...)
+{
+  if (!cmd->done)
+    return false;
+
+  va_list args;
+  va_start(args, fmt);
+  cmd->len = formatCommand(cmd->buf, sizeof(cmd->buf), fmt, args);
+  va_end(args);
+
+  if (!cmd->len)
+    return false;
+
+  cmd->done = false;
+  cmd->response = GS_UNKNOWN_RESPONSE;
+  cmd->connect_cid = INVALID_CID;
+  cmd->next = NULL;
+
+  // Append the command to the end of the queue
+  IrqGuard guard(*this);
+  PendingCommand **tail = &this->commands;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = cmd;
+
+  // When the module is idle, send the command right away
+  processCommands();
+  return true;
+}
+
+void GSCore::processCommands()
+{
+  PendingCommand *cmd = this->commands;
+  if (!cmd || this->transparent)
+    return;
+
+  if (this->unrecoverableError) {
+    abortCommands(GS_UNRECOVERABLE_ERROR);
+    return;
+  }
+
+  if (cmd->done) {
+    // Remove the command before calling the callback, so it can be
+    // submitted again from the callback
+    this->commands = cmd->next;
+    this->command_sent = false;
+    this->response_pending = false;
+    cmd->next = NULL;
+    if (cmd->done_callback)
+      cmd->done_callback(cmd, cmd->data);
+
+    cmd = this->commands;
+    if (!cmd)
+      return;
+  }
+
+  if (!this->command_sent) {
+    // Never write halfway a data frame, loop() will get back here
+    if (this->tx_state != GS_TX_IDLE)
+      return;
+    if (GS_DUMP_LINES && this->debug) {
+      this->debug->print(">>= ");
+      this->debug->write(cmd->buf, cmd->len - 2);
+      this->debug->println();
+    }
+    // Make sure the data ready interrupt leaves the reply alone, so
+    // the line callback is never called from the interrupt handler.
+    this->response_pending = true;
+    trace(GS_TRACE_LINES, TRACE_TX_COMMAND, INVALID_CID, cmd->len - 2);
+    this->writeRaw(cmd->buf, cmd->len);
+    this->command_sent = true;
+    this->command_start = millis();
+    // The command is sent, so reuse its buffer for the reply
+    initResponseParser(&this->command_parser, cmd->buf, sizeof(cmd->buf), &cmd->connect_cid, cmd->line_callback != NULL, cmd->line_callback, cmd->data);
+  } else if ((unsigned long)(millis() - this->command_start) > RESPONSE_TIMEOUT) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Response timeout");
+    // On a response timeout, our state will be (and probably stay)
+    // wrong. Flag an unrecoverable error.
+    STATS_ADD(response_timeouts, 1);
+    this->unrecoverableError = true;
+    abortCommands(GS_UNRECOVERABLE_ERROR);
+  }
+}
+
+void GSCore::waitForCommands()
+{
+  IrqGuard guard(*this);
+  finishTxFrame();
+  while (this->commands && !this->transparent) {
+    processCommands();
+    readAndProcessBlock();
+  }
+}
+
+void GSCore::abortCommands(GSResponse res)
+{
+  while (this->commands) {
+    PendingCommand *cmd = this->commands;
+    this->commands = cmd->next;
+    cmd->next = NULL;
+    cmd->response = res;
+    cmd->done = true;
+    if (cmd->done_callback)
+      cmd->done_callback(cmd, cmd->data);
+  }
+  this->command_sent = false;
+  this->response_pending = false;
+}
+
+bool GSCore::writeCommandCheckOk(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  writeCommand(fmt, args);
+  va_end(args);
+
+  return (readResponse() == GS_SUCCESS);
+}
+
+bool GSCore::writeConfigCommand(const char *fmt, ...)
+{
+  char buf[MAX_DATA_LINE_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  size_t len = formatString(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  (void)len;
+
+#if GS_WARM_START
+  // The module reports settings without the AT prefix. Commands that
+  // do not fit are sent (truncated) by writeCommand below, but not
+  // remembered.
+  const char *setting = buf + 2;
+  bool remember = len > 2 && len <= MAX_COMMAND_SIZE;
+  uint16_t name;
+  uint32_t value;
+  if (remember && hashConfig(setting, len - 2, &name, &value)) {
+    // Only the hash of the value is known, so a different value with
+    // the same 32-bit hash would be wrongly skipped. With FNV-1a, the
+    // chance of that is about 1 in 4 billion per change.
+    ConfigEntry *entry = findConfig(name);
+    if (entry && entry->value == value) {
+      if (GS_DUMP_LINES && this->debug) {
+        this->debug->print(">>- ");
+        this->debug->println(buf);
+      }
+      STATS_ADD(config_skipped, 1);
+      return true;
+    }
+  }
+#endif
+
+  writeCommand("%s", buf);
+  if (readResponse() != GS_SUCCESS)
+    return false;
+
+#if GS_WARM_START
+  if (remember)
+    storeConfig(setting, len - 2);
+#endif
+  return true;
+}
+
+void GSCore::forgetConfig(const char *prefix)
+{
+#if GS_WARM_START
+  if (!prefix) {
+    this->config_len = 0;
+    return;
+  }
+
+  // Skip the AT and hash just the name
+  uint16_t name = (uint16_t)hash(prefix + 2, strlen(prefix + 2));
+  ConfigEntry *entry = findConfig(name);
+  if (entry)
+    *entry = this->config[--this->config_len];
+#endif
+}
+
+#if GS_WARM_START
+GSCore::ConfigEntry *GSCore::findConfig(uint16_t name)
+{
+  for (uint8_t i = 0; i < this->config_len; ++i) {
+    if (this->config[i].name == name)
+      return &this->config[i];
+  }
+  return NULL;
+}
+
+void GSCore::storeConfig(const char *setting, uint8_t len)
+{
+  uint16_t name;
+  uint32_t value;
+  if (!hashConfig(setting, len, &name, &value))
+    return;
+
+  ConfigEntry *entry = findConfig(name);
+  if (!entry) {
+    if (this->config_len == MAX_CONFIG_ENTRIES)
+      return;
+    entry = &this->config[this->config_len++];
+    entry->name = name;
+  }
+  entry->value = value;
+}
+
+bool GSCore::hashConfig(const char *setting, uint8_t len, uint16_t *name, uint32_t *value)
+{
+  const char *eq = (const char*)memchr(setting, '=', len);
+  if (!eq)
+    return false;
+
+  *name = (uint16_t)hash(setting, eq - setting);
+  *value = hash(eq + 1, len - (eq + 1 - setting));
+  return true;
+}
+
+void GSCore::parseStatusField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data)
+{
+  GSCore *gs = (GSCore*)data;
+  const char *str = (const char*)buf;
+
+  // Looks like:
+  //   WSTATE=CONNECTED     MODE=INFRA
+  //   BSSID=00:24:01:a2:1b:5a    SSID="name"     CHANNEL=11 ...
+  // The SSID itself might contain spaces, but those are kept in the
+  // field because of the quotes.
+  if (len == 16 && strncmp(str, "WSTATE=CONNECTED", 16) == 0)
+    gs->processAssociation();
+  else if (len >= 7 && strncmp(str, "SSID=\"", 6) == 0 && str[len - 1] == '"')
+    gs->associated_ssid = hash(str + 6, len - 7);
+}
+
+void GSCore::parseConfigField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data)
+{
+  GSCore *gs = (GSCore*)((void**)data)[0];
+  bool *stored_profile = (bool*)((void**)data)[1];
+  const char *str = (const char*)buf;
+
+  // Looks like:
+  //   ACTIVE PROFILE
+  //   E0 V0 &K0 &R1 +NDHCP=1 +WM=0 +WAUTO=0,"name",,0 ...
+  //   STORED PROFILE 0
+  //   ...
+  // Only the active profile is interesting. Settings that are too long
+  // for a field might be truncated, so they just stay unknown.
+  if (field == 0 && len == 6 && strncmp(str, "STORED", 6) == 0)
+    *stored_profile = true;
+  if (*stored_profile || len == MAX_FIELD_SIZE)
+    return;
+
+  if (*str == '+')
+    gs->storeConfig(str, len);
+}
+#endif // GS_WARM_START
+
+uint32_t GSCore::hash(const char *buf, uint8_t len)
+{
+  // 32-bit FNV-1a
+  uint32_t h = 2166136261UL;
+  while (len--) {
+    h ^= (uint8_t)*buf++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  ResponseParser parser;
+  initResponseParser(&parser, buf, *len, connect_cid, keep_data, callback, data);
+  GSResponse res = readResponseInternal(&parser);
+  *len = parser.read;
+  return res;
+}
+
+GSCore::GSResponse GSCore::readResponseInternal(ResponseParser *parser)
+{
+  IrqGuard guard(*this);
+  GSResponse res = readResponseLines(parser);
+  // Once the reply is read, the data ready interrupt can take over
+  // again (when guard is destroyed).
+  this->response_pending = false;
+  return res;
+}
+
+GSCore::GSResponse GSCore::readResponseLines(ResponseParser *parser)
+{
+  unsigned long start = millis();
+  while(true) {
+    if (this->unrecoverableError)
+      return GS_UNRECOVERABLE_ERROR;
+
+    int c = readRaw();
+    if (c == -1) {
+      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println("Response timeout");
+        // On a response timeout, our state will be (and probably stay)
+        // wrong. Flag an unrecoverable error.
+        STATS_ADD(response_timeouts, 1);
+        this->unrecoverableError = true;
+        return GS_UNRECOVERABLE_ERROR;
+      }
+      continue;
+    }
+
+    if (this->rx_state != GS_RX_IDLE || c == 0x1b) {
+      // We're currently handling connection or async data, or are about
+      // to. Let processIncoming sort that out.
+      processIncoming(c);
+    } else {
+      GSResponse res = parseResponse(parser, c);
+      if (res != GS_UNKNOWN_RESPONSE)
+        return res;
+    }
+  }
+}
+
+void GSCore::initResponseParser(ResponseParser *parser, uint8_t *buf, uint16_t size, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  parser->buf = buf;
+  parser->size = size;
+  parser->read = 0;
+  parser->line_start = 0;
+  parser->dropped_data = false;
+  parser->skip_line = false;
+  parser->keep_data = keep_data;
+  parser->connect_cid = connect_cid;
+  parser->callback = callback;
+  parser->data = data;
+  parser->field_callback = NULL;
+}
+
+GSCore::GSResponse GSCore::parseResponse(ResponseParser *p, uint8_t c)
+{
+  if (p->field_callback)
+    return parseField(p, c);
+
+  if ((c == '\r' || c == '\n')) {
+    // This normalizes all sequences of line endings into a single
+    // \r\n and strips leading \r\n sequences, because responses tend
+    // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
+    // As a side effect, this removes empty lines from output, but
+    // that's ok.
+    if (p->read - p->line_start == 0)
+      return GS_UNKNOWN_RESPONSE;
+
+    if (p->skip_line) {
+      // Data from this line has been dropped because the buffer was
+      // full, and it was too long for a response anyway, so further
+      // ignore this line.
+      p->skip_line = false;
+      // Remove the line from the buffer
+      p->read = p->line_start;
+      if (GS_DUMP_LINES && this->debug)
+        this->debug->println("<<| Skipped uninteresting long line");
+      return GS_UNKNOWN_RESPONSE;
+    }
+    p->skip_line = false;
+
+    GSResponse res = processResponseLine(p->buf + p->line_start, p->read - p->line_start, p->connect_cid);
+    // When we get a GS_LINK_LOST, we're apparently not associated
+    // when we thought we would be. Call processDisassciation() to fix
+    // that.
+    if (res == GS_LINK_LOST)
+      processDisassociation();
+
+    if (p->keep_data && !p->callback && !p->dropped_data && res == GS_UNKNOWN_RESPONSE) {
+      // Unknown response, so it's probably actual data that the
+      // caller will want to have. Leave it in the buffer, and
+      // terminate it with \r\n.
+      if (p->read < p->size) p->buf[p->read++] = '\r';
+      if (p->read < p->size) p->buf[p->read++] = '\n';
+      p->line_start = p->read;
+    } else {
+      // If we have a callback, pass any unknown response to it
+      if (p->keep_data && p->callback && res == GS_UNKNOWN_RESPONSE)
+        p->callback(&p->buf[p->line_start], p->read - p->line_start, p->data);
+
+      // Remove the line from the buffer since we either handled it
+      // already, or we're not interested in the data
+      p->read = p->line_start;
+
+      if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
+        // All other responses indicate the end of the reply
+        return res;
+      }
+    }
+  } else {
+    if (p->read < p->size) {
+      p->buf[p->read++] = c;
+    } else if ((p->read - p->line_start) >= MAX_RESPONSE_SIZE ) {
+      // The buffer is full. However, the line is too long for a
+      // response, so there is no danger in just discarding the byte.
+      if (p->keep_data && GS_LOG_ERRORS && this->error)
+        dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
+
+      // Make sure we won't try to parse the few bytes we have as a
+      // response.
+      p->skip_line = true;
+      p->dropped_data = true;
+    } else {
+      // The buffer is full, but we can't just discard the byte: It
+      // might be part of the final response we're waiting for.
+      // Instead, drop the last byte of the previous line to make
+      // room, and move any data in the current line accordingly.
+      if (p->line_start > 0) {
+        if (p->keep_data && GS_LOG_ERRORS && this->error)
+          dump_byte(this->error, "Response buffer too small, removed byte: ", p->buf[p->line_start - 1]);
+        memmove(&p->buf[p->line_start - 1], &p->buf[p->line_start], (p->read - p->line_start));
+        p->line_start--;
+        p->buf[p->read - 1] = c;
+      } else {
+        // line_start == 0 should only happen if len <
+        // MAX_RESPONSE_SIZE, but better be safe than sorry.
+        if (p->keep_data && GS_LOG_ERRORS && this->error)
+          dump_byte(this->error, "Response buffer tiny? Dropped byte: ", c);
+      }
+
+      // Once we threw away a byte of data, don't store any new ones
+      // (to make sure the returned data is cleanly truncated instead
+      // of having gaps).
+      p->dropped_data = true;
+    }
+  }
+  return GS_UNKNOWN_RESPONSE;
+}
+
+GSCore::GSResponse GSCore::parseField(ResponseParser *p, uint8_t c)
+{
+  if (c == '\r' || c == '\n') {
+    // Skip empty lines, like parseResponse()
+    if (p->line_len == 0)
+      return GS_UNKNOWN_RESPONSE;
+
+    GSResponse res = GS_UNKNOWN_RESPONSE;
+    if (p->line_len <= MAX_RESPONSE_SIZE) {
+      // Short lines are kept whole in buf, since they could be the
+      // final response
+      res = processResponseLine(p->buf, p->read, p->connect_cid);
+      if (res == GS_LINK_LOST)
+        processDisassociation();
+
+      if (res == GS_UNKNOWN_RESPONSE) {
+        // Just data, so split it into fields after all
+        uint8_t line[MAX_RESPONSE_SIZE];
+        uint8_t len = p->read;
+        memcpy(line, p->buf, len);
+        p->read = 0;
+        p->line_len = MAX_RESPONSE_SIZE + 1;
+        for (uint8_t i = 0; i < len; ++i)
+          addFieldByte(p, line[i]);
+      }
+    }
+
+    if (res == GS_UNKNOWN_RESPONSE)
+      finishField(p, true);
+
+    p->read = 0;
+    p->line_len = 0;
+    p->field = 0;
+    p->quoted = p->space_pending = false;
+
+    if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS)
+      return res;
+    return GS_UNKNOWN_RESPONSE;
+  }
+
+  if (p->line_len < MAX_RESPONSE_SIZE) {
+    p->buf[p->read++] = c;
+    p->line_len++;
+    return GS_UNKNOWN_RESPONSE;
+  }
+
+  if (p->line_len == MAX_RESPONSE_SIZE) {
+    // Too long for a response, so start splitting the bytes kept so
+    // far into fields
+    uint8_t line[MAX_RESPONSE_SIZE];
+    memcpy(line, p->buf, MAX_RESPONSE_SIZE);
+    p->read = 0;
+    p->line_len++;
+    for (uint8_t i = 0; i < MAX_RESPONSE_SIZE; ++i)
+      addFieldByte(p, line[i]);
+  }
+  addFieldByte(p, c);
+  return GS_UNKNOWN_RESPONSE;
+}
+
+void GSCore::addFieldByte(ResponseParser *p, uint8_t c)
+{
+  if (!p->quoted && c && strchr(p->separators, c)) {
+    if (c == ' ') {
+      // Runs of spaces are a single separator, and a line might end in
+      // spaces, so only finish the field on the next byte
+      if (p->read)
+        p->space_pending = true;
+    } else {
+      p->space_pending = false;
+      finishField(p, false);
+    }
+    return;
+  }
+
+  if (p->space_pending) {
+    p->space_pending = false;
+    finishField(p, false);
+  }
+
+  if (c == '"')
+    p->quoted = !p->quoted;
+
+  // Strip leading spaces
+  if (c == ' ' && p->read == 0)
+    return;
+
+  if (p->read < p->size)
+    p->buf[p->read++] = c;
+}
+
+void GSCore::finishField(ResponseParser *p, bool last)
+{
+  uint8_t len = p->read;
+  while (len && p->buf[len - 1] == ' ')
+    --len;
+  p->field_callback(p->buf, len, p->field, last, p->data);
+  p->read = 0;
+  p->field++;
+}
+
 GSCore::GSResponse GSCore::readResponse(uint8_t *buf, uint16_t* len, cid_t *connect_cid) {
   return readResponseInternal(buf, len, connect_cid, true, NULL, NULL);
 }
@@ -605,8 +1854,22 @@ GSCore::GSResponse GSCore::readResponse(line_callback_t callback, void *data, ci
   return readResponseInternal(buf, &len, connect_cid, true, callback, data);
 }
 
+GSCore::GSResponse GSCore::readResponse(const char *separators, field_callback_t callback, void *data, cid_t *connect_cid)
+{
+  uint8_t buf[MAX_FIELD_SIZE];
+  ResponseParser parser;
+  initResponseParser(&parser, buf, sizeof(buf), connect_cid, true, NULL, data);
+  parser.field_callback = callback;
+  parser.separators = separators;
+  parser.line_len = 0;
+  parser.field = 0;
+  parser.quoted = parser.space_pending = false;
+  return readResponseInternal(&parser);
+}
+
 bool GSCore::readDataResponse()
 {
+  IrqGuard guard(*this);
   unsigned long start = millis();
   while(true) {
     int c = readRaw();
@@ -619,6 +1882,7 @@ bool GSCore::readDataResponse()
           this->error->println("Data response timeout");
         // On a response timeout, our state will be (and probably stay)
         // wrong. Flag an unrecoverable error.
+        STATS_ADD(response_timeouts, 1);
         this->unrecoverableError = true;
         return false;
       }
@@ -628,11 +1892,14 @@ bool GSCore::readDataResponse()
     if (this->rx_state == GS_RX_ESC && c == 'O') {
       if (GS_DUMP_LINES && this->debug)
         this->debug->println("<<| Read data OK response");
+      trace(GS_TRACE_DATA, TRACE_RX_DATA_OK, INVALID_CID, 0);
       this->rx_state = GS_RX_IDLE;
       return true;
     } else if (this->rx_state == GS_RX_ESC && c == 'F') {
       if (GS_DUMP_LINES && this->debug)
         this->debug->println("<<| Read data FAIL response");
+      trace(GS_TRACE_DATA, TRACE_RX_DATA_FAIL, INVALID_CID, 0);
+      STATS_ADD(data_fail_replies, 1);
       this->rx_state = GS_RX_IDLE;
       return false;
     } else {
@@ -642,20 +1909,87 @@ bool GSCore::readDataResponse()
 }
 
 
-uint8_t GSCore::transferSpi(uint8_t out)
+volatile uint8_t GSCore::spi_bus_claims = 0;
+
+void GSCore::releaseSpiBus()
 {
-  // Note that we need to toggle SS for every byte, otherwise the module
-  // will ignore subsequent bytes and return 0xff
-  digitalWrite(this->ss_pin, LOW);
-  uint8_t in = SPI.transfer(out);
-  digitalWrite(this->ss_pin, HIGH);
+  if (--spi_bus_claims != 0)
+    return;
+
+  // Serve any data ready interrupts that fired while the bus was
+  // claimed. Instances that are busy will drain themselves when done.
+  for (uint8_t slot = 0; slot < MAX_RX_INTERRUPTS; ++slot) {
+    GSCore *gs = rx_irq_instances[slot];
+    if (gs && gs->rx_irq_pending && gs->busy == 0)
+      gs->drainModule();
+  }
+}
+
+void GSCore::beginSpiBurst()
+{
+  claimSpiBus();
+  #ifdef SPI_HAS_TRANSACTION
+  SPI.beginTransaction(this->spi_settings);
+  #endif
+}
+
+void GSCore::endSpiBurst()
+{
+  #ifdef SPI_HAS_TRANSACTION
+  SPI.endTransaction();
+  #endif
+  releaseSpiBus();
+}
+
+uint8_t GSCore::transferSpi(uint8_t *buf, uint8_t len)
+{
+  uint8_t out[SPI_BLOCK_SIZE];
+  if (GS_DUMP_SPI)
+    memcpy(out, buf, len);
+
+  // The bus is only held for a single block, so other devices can use
+  // it in between.
+  beginSpiBurst();
+  uint8_t done;
+  if (GS_SPI_HOLD_SS) {
+    digitalWrite(this->ss_pin, LOW);
+    SPI.transfer(buf, len);
+    digitalWrite(this->ss_pin, HIGH);
+    done = len;
+  } else {
+    // Note that we need to toggle SS for every byte, otherwise the
+    // module will ignore subsequent bytes and return 0xff
+    SSPin ss(this->ss_pin);
+    bool esc = this->spi_prev_was_esc;
+    done = 0;
+    while (done < len) {
+      uint8_t tx = buf[done];
+      ss.low();
+      uint8_t rx = SPI.transfer(tx);
+      ss.high();
+      buf[done++] = rx;
+
+      // Stop directly after an XOFF, but never halfway an escape
+      // sequence we're sending.
+      if (esc)
+        esc = false;
+      else if (rx == SPI_SPECIAL_ESC)
+        esc = true;
+      else if (rx == SPI_SPECIAL_XOFF && tx != SPI_SPECIAL_ESC)
+        break;
+    }
+  }
+  endSpiBurst();
+
   if (GS_DUMP_SPI && this->debug) {
-    if (in != SPI_SPECIAL_IDLE || out != SPI_SPECIAL_IDLE) {
-      dump_byte(this->debug, "SPI: >> ", out, false);
-      dump_byte(this->debug, " << ", in);
+    for (uint8_t i = 0; i < done; ++i) {
+      if (buf[i] != SPI_SPECIAL_IDLE || out[i] != SPI_SPECIAL_IDLE) {
+        dump_byte(this->debug, "SPI: >> ", out[i], false);
+        dump_byte(this->debug, " << ", buf[i]);
+      }
     }
   }
-  return in;
+  return done;
 }
 
 void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
@@ -667,29 +2001,68 @@ void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
       for (uint16_t i = 0; i < len; ++i)
         dump_byte(this->debug, ">= ", buf[i]);
     }
-    this->serial->write(buf, len);
-  } else if (this->ss_pin) {
+    if (this->cts_pin == INVALID_PIN) {
+      this->serial->write(buf, len);
+      return;
+    }
+
+    // Check CTS for every block instead of once, to not overrun the
+    // module when it raises RTS halfway
+    while (len) {
+      // On timeout, just send anyway, the module might have
+      // recovered without us noticing
+      waitForCts();
+      uint8_t n = len < UART_BLOCK_SIZE ? len : UART_BLOCK_SIZE;
+      this->serial->write(buf, n);
+      buf += n;
+      len -= n;
+    }
+  } else if (this->ss_pin != INVALID_PIN) {
+    // Bytes that readRaw() already received must be processed before
+    // any bytes we receive while writing.
+    flushSpiRx();
+
+    uint8_t block[SPI_BLOCK_SIZE];
+    // Number of (stuffed) bytes at the start of block that still need
+    // to be sent
+    uint8_t pending = 0;
     uint16_t tries = 1024; // max 1k per loop
-    while (len && tries > 0) {
+    while ((len || pending) && tries > 0) {
       if (this->unrecoverableError)
         return;
       if (this->spi_xoff) {
         // Module sent XOFF, so send IDLE bytes until it reports it has
         // buffer space again.
         tries--;
-        processIncoming(processSpiSpecial(transferSpi(SPI_SPECIAL_IDLE)));
-      } else {
+        STATS_ADD(xoff_stalls, 1);
+        uint8_t c = SPI_SPECIAL_IDLE;
+        transferSpi(&c, 1);
+        processIncoming(&c, processSpiSpecial(&c, 1));
+        continue;
+      }
+
+      // Fill up the block, stuffing special bytes. The -1 makes sure
+      // an escaped byte always fits.
+      uint8_t n = pending;
+      while (len && n < sizeof(block) - 1) {
         if (GS_DUMP_BYTES && this->debug)
           dump_byte(this->debug, ">= ", *buf);
         if (isSpiSpecial(*buf)) {
-          processIncoming(processSpiSpecial(transferSpi(SPI_SPECIAL_ESC)));
-          processIncoming(processSpiSpecial(transferSpi(*buf ^ SPI_ESC_XOR)));
+          block[n++] = SPI_SPECIAL_ESC;
+          block[n++] = *buf ^ SPI_ESC_XOR;
         } else {
-          processIncoming(processSpiSpecial(transferSpi(*buf)));
+          block[n++] = *buf;
         }
         buf++;
         len--;
       }
+
+      uint8_t sent = transferSpi(block, n);
+      pending = n - sent;
+      // The first sent bytes of block now contain the received bytes,
+      // process them before moving the unsent bytes to the front.
+      processIncoming(block, processSpiSpecial(block, sent));
+      memmove(block, block + sent, pending);
     }
   }
 }
@@ -700,16 +2073,26 @@ int GSCore::readRaw()
   if (this->unrecoverableError)
     return -1;
   if (this->serial) {
+    if (readLimit() == 0)
+      return -1;
     c = this->serial->read();
     if (GS_DUMP_BYTES && this->debug)
       dump_byte(this->debug, "<= ", c);
   } else if (this->ss_pin != INVALID_PIN) {
+    // Return any data left over from a previous block transfer first
+    if (this->spi_rx_pos < this->spi_rx_len)
+      return this->spi_rx_buf[this->spi_rx_pos++];
 
     // When the data ready pin (GPIO28) is low, there is no point in
     // trying to read, we'll read idle bytes for sure.
     if (this->data_ready_pin != INVALID_PIN && !digitalRead(this->data_ready_pin))
       return -1;
 
+    // Leave data in the module when there is no room for it
+    uint16_t limit = readLimit();
+    if (limit == 0)
+      return -1;
+
     int tries;
     if (this->data_ready_pin != INVALID_PIN) {
       // If the data ready pin is high, the documentation says we should
@@ -724,7 +2107,7 @@ int GSCore::readRaw()
       // goes high, we first have to chew away 63 idle bytes before we
       // get the real data. Using 64 tries should thus be a useful
       // value.
-      tries = 64;
+      tries = SPI_FULL_POLL;
     } else {
       // When we do not have a data ready pin available, we'll have to
       // resort to polling. However, because of those 63 idle bytes,
@@ -738,42 +2121,287 @@ int GSCore::readRaw()
       // However, this can introduce a lot of overhead and since
       // it's unlikely that new data is available when there wasn't any
       // a few microseconds ago, we should be smart about when to do a
-      // full poll.
+      // full poll. How often that happens is decided by
+      // adaptPollInterval() below.
       uint16_t new_time = micros();
       uint16_t diff = new_time - this->spi_poll_time;
-      if (diff < MINIMUM_POLL_INTERVAL) {
+      uint16_t interval = this->spi_poll_interval;
+      if (diff < interval) {
         // We recently did polling, so no need to do a full poll.
         // However, we'll always read at least one byte, so that when we
         // get called continously, new data can arrive before
-        // MINIMUM_POLL_INTERVAL has passed.
+        // the poll interval has passed.
         tries = 1;
 
-        // Update the the poll timestamp. even though we didn't do a
-        // full poll now, we read 1/64th of a full poll, so progress the
-        // timestamp by that amount (taking care to not progress it past
-        // the current timestamp).
-        if (diff < MINIMUM_POLL_INTERVAL / 64)
-          this->spi_poll_time = new_time;
-        else
-          this->spi_poll_time += (MINIMUM_POLL_INTERVAL / 64);
+        // Update the the poll timestamp. even though we didn't do a
+        // full poll now, we read 1/64th of a full poll, so progress the
+        // timestamp by that amount (taking care to not progress it past
+        // the current timestamp).
+        if (diff < interval / SPI_FULL_POLL)
+          this->spi_poll_time = new_time;
+        else
+          this->spi_poll_time += (interval / SPI_FULL_POLL);
+      } else {
+        // We haven't done enough polling recently, so do a full poll
+        // now.
+        tries = SPI_FULL_POLL;
+        this->spi_poll_time = new_time;
+        STATS_ADD(spi_full_polls, 1);
+      }
+    }
+    bool full_poll = (tries == SPI_FULL_POLL);
+
+    // Send blocks of idle bytes until we receive some real data. Once
+    // data starts flowing, the rest of the block likely contains data
+    // as well, which is kept in spi_rx_buf for subsequent calls.
+    this->spi_rx_pos = this->spi_rx_len = 0;
+    do {
+      uint8_t n = tries < SPI_BLOCK_SIZE ? tries : SPI_BLOCK_SIZE;
+      if (n > limit)
+        n = limit;
+      memset(this->spi_rx_buf, SPI_SPECIAL_IDLE, n);
+      uint8_t got = transferSpi(this->spi_rx_buf, n);
+      tries -= got;
+      this->spi_rx_len = processSpiSpecial(this->spi_rx_buf, got);
+      STATS_ADD(spi_idle_bytes, got - this->spi_rx_len);
+    } while (this->spi_rx_len == 0 && tries > 0 && !this->unrecoverableError);
+
+    if (this->data_ready_pin == INVALID_PIN)
+      adaptPollInterval(full_poll, this->spi_rx_len != 0);
+
+    if (this->spi_rx_len == 0)
+      return -1;
+    c = this->spi_rx_buf[this->spi_rx_pos++];
+  } else {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Begin() not called!");
+    return -1;
+  }
+  return c;
+}
+
+uint16_t GSCore::writeRawNonBlocking(const uint8_t *buf, uint16_t len)
+{
+  if (this->unrecoverableError)
+    return 0;
+
+  if (this->ss_pin == INVALID_PIN) {
+    if (this->cts_pin == INVALID_PIN) {
+      writeRaw(buf, len);
+      return len;
+    }
+
+    // Check CTS for every block and stop as soon as the module raises
+    // RTS, instead of letting writeRaw() wait for it
+    uint16_t done = 0;
+    while (done < len) {
+      if (digitalRead(this->cts_pin) == HIGH) {
+        STATS_ADD(cts_stalls, 1);
+        break;
+      }
+      uint8_t n = len - done < UART_BLOCK_SIZE ? len - done : UART_BLOCK_SIZE;
+      writeRaw(buf + done, n);
+      done += n;
+    }
+    return done;
+  }
+
+  // Bytes that readRaw() already received must be processed before
+  // any bytes we receive while writing.
+  flushSpiRx();
+
+  if (this->spi_xoff) {
+    // Send a single IDLE byte to see if the module sent XON, but do
+    // not wait for it.
+    STATS_ADD(xoff_stalls, 1);
+    uint8_t c = SPI_SPECIAL_IDLE;
+    transferSpi(&c, 1);
+    processIncoming(&c, processSpiSpecial(&c, 1));
+  }
+
+  uint8_t block[SPI_BLOCK_SIZE];
+  uint16_t done = 0;
+  while (done < len && !this->spi_xoff && !this->unrecoverableError) {
+    // Fill up the block, stuffing special bytes. The -1 makes sure
+    // an escaped byte always fits.
+    uint16_t start = done;
+    uint8_t n = 0;
+    while (done < len && n < sizeof(block) - 1) {
+      if (isSpiSpecial(buf[done])) {
+        block[n++] = SPI_SPECIAL_ESC;
+        block[n++] = buf[done] ^ SPI_ESC_XOR;
       } else {
-        // We haven't done enough polling recently, so do a full poll
-        // now.
-        tries = 64;
-        this->spi_poll_time = new_time;
+        block[n++] = buf[done];
       }
+      done++;
     }
 
-    do {
-      c = processSpiSpecial(transferSpi(SPI_SPECIAL_IDLE));
-    } while (c == -1 && --tries > 0);
+    uint8_t sent = transferSpi(block, n);
+    // transferSpi() never stops halfway an escaped byte, so every
+    // unsent byte except for escapes is a byte of buf to retry later.
+    for (uint8_t i = sent; i < n; ++i) {
+      if (block[i] != SPI_SPECIAL_ESC)
+        done--;
+    }
+    if (GS_DUMP_BYTES && this->debug) {
+      for (uint16_t i = start; i < done; ++i)
+        dump_byte(this->debug, ">= ", buf[i]);
+    }
+    processIncoming(block, processSpiSpecial(block, sent));
+  }
+  return done;
+}
+
+uint16_t GSCore::readLimit()
+{
+  if (!this->rx_lossless || this->response_pending || this->tx_state == GS_TX_WAIT_ACK) {
+    // While a reply is expected, it must be read even if that means
+    // dropping data, so let the module send freely.
+    setRts(false);
+    return 0xffff;
+  }
+
+  // Data read from the frame at the tail is normally only released
+  // when the frame is finished, so release it now to not stall on a
+  // frame that is bigger than rx_data.
+  releaseReadData();
+
+  // Every byte read adds at most one data byte to rx_data, or less
+  // than two bytes when it is part of a frame header. Additionally,
+  // the first byte can complete a header started earlier. Reading up
+  // to this limit thus never needs to drop data.
+  uint16_t free = rxFree();
+  uint16_t limit = free > MAX_RX_HEADER_SIZE ? (free - MAX_RX_HEADER_SIZE) / 2 : 0;
+
+  // Stop the module before running completely out of room, since
+  // bytes already underway will still arrive.
+  setRts(limit < RTS_THRESHOLD);
+  if (limit == 0)
+    STATS_ADD(rx_backpressure, 1);
+  return limit;
+}
+
+void GSCore::setRts(bool stop)
+{
+  if (this->rts_pin == INVALID_PIN || stop == this->rts_stopped)
+    return;
+  // RTS is active low
+  digitalWrite(this->rts_pin, stop ? HIGH : LOW);
+  this->rts_stopped = stop;
+}
+
+void GSCore::adaptPollInterval(bool full_poll, bool got_data)
+{
+  if (got_data) {
+    // Data is flowing, so more is likely to follow soon
+    if (this->spi_poll_interval != this->spi_poll_min) {
+      this->spi_poll_interval = this->spi_poll_min;
+      STATS_ADD(spi_poll_speedups, 1);
+    }
+  } else if (full_poll) {
+    // A full poll found nothing, so back off
+    STATS_ADD(spi_idle_polls, 1);
+    if (this->spi_poll_interval < this->spi_poll_max) {
+      if (this->spi_poll_interval > this->spi_poll_max / 2)
+        this->spi_poll_interval = this->spi_poll_max;
+      else
+        this->spi_poll_interval *= 2;
+      STATS_ADD(spi_poll_backoffs, 1);
+    }
+  }
+#if GS_STATS
+  this->stats.spi_poll_interval = this->spi_poll_interval;
+#endif
+}
+
+uint16_t GSCore::readRaw(uint8_t *buf, uint16_t len)
+{
+  if (this->unrecoverableError)
+    return 0;
+  if (this->serial) {
+    int avail = this->serial->available();
+    if (avail <= 0)
+      return 0;
+    if (len > avail)
+      len = avail;
+    uint16_t limit = readLimit();
+    if (len > limit)
+      len = limit;
+    // Since these bytes are available, this does not wait.
+    len = this->serial->readBytes(buf, len);
+    if (GS_DUMP_BYTES && this->debug) {
+      for (uint16_t i = 0; i < len; ++i)
+        dump_byte(this->debug, "<= ", buf[i]);
+    }
+    return len;
   } else {
-    if (GS_LOG_ERRORS && this->error)
-      this->error->println("Begin() not called!");
-    return -1;
+    uint16_t read = 0;
+    while (read < len) {
+      int c = readRaw();
+      if (c == -1)
+        break;
+      buf[read++] = c;
+      // Don't start a new transfer when the previous one is used up
+      if (this->spi_rx_pos == this->spi_rx_len)
+        break;
+    }
+    return read;
+  }
+}
+
+/*******************************************************
+ * Methods for tracing
+ *******************************************************/
+
+#if GS_TRACE
+void GSCore::addTraceRecord(TraceEvent event, cid_t cid, uint16_t length)
+{
+  uint8_t pos;
+  if (this->trace_len < GS_TRACE_SIZE) {
+    pos = (this->trace_first + this->trace_len++) % GS_TRACE_SIZE;
+  } else {
+    // Overwrite the oldest record
+    pos = this->trace_first;
+    this->trace_first = (this->trace_first + 1) % GS_TRACE_SIZE;
+    this->trace_lost++;
+  }
+  TraceRecord &record = this->trace_ring[pos];
+  record.time = micros();
+  record.event = event;
+  record.cid = cid;
+  record.length = length;
+}
+
+void GSCore::dumpTrace(Print *out)
+{
+  IrqGuard guard(*this);
+  // "GSTRACE " + 8 + 1 + 2 + 1 + 2 + 1 + 4
+  char line[8 + 8 + 1 + 2 + 1 + 2 + 1 + 4];
+  if (this->trace_lost) {
+    out->print("GSTRACE lost ");
+    out->println(this->trace_lost);
+    this->trace_lost = 0;
+  }
+
+  memcpy(line, "GSTRACE ", 8);
+  while (this->trace_len) {
+    const TraceRecord &record = this->trace_ring[this->trace_first];
+    uint8_t len = 8;
+    len += formatNumber(line + len, record.time, 16, 8);
+    line[len++] = ' ';
+    len += formatNumber(line + len, record.event, 16, 2);
+    line[len++] = ' ';
+    len += formatNumber(line + len, record.cid, 16, 2);
+    line[len++] = ' ';
+    len += formatNumber(line + len, record.length, 16, 4);
+    out->write((const uint8_t*)line, len);
+    out->println();
+
+    this->trace_first = (this->trace_first + 1) % GS_TRACE_SIZE;
+    this->trace_len--;
   }
-  return c;
 }
+#endif
 
 /*******************************************************
  * Helper methods
@@ -806,6 +2434,114 @@ bool GSCore::parseIpAddress(IPAddress *ip, const char *str, uint16_t len)
   return true;
 }
 
+uint8_t GSCore::formatIpAddress(char *buf, const IPAddress &ip)
+{
+  uint8_t len = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (i)
+      buf[len++] = '.';
+    len += formatNumber(buf + len, ip[i]);
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+uint8_t GSCore::formatNumber(char *buf, uint32_t value, uint8_t base, uint8_t width)
+{
+  // Collect digits in reverse, then copy them out in the right order
+  char digits[32];
+  uint8_t count = 0;
+  do {
+    uint8_t digit = value % base;
+    digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= base;
+  } while (value);
+
+  uint8_t len = 0;
+  while (width > count) {
+    buf[len++] = '0';
+    width--;
+  }
+  while (count)
+    buf[len++] = digits[--count];
+  return len;
+}
+
+size_t GSCore::formatString(char *buf, size_t size, const char *fmt, va_list args)
+{
+  size_t len = 0;
+  // Append a single character, if it fits. len keeps counting, so the
+  // full length can be returned.
+  #define PUT(c) do { if (len + 1 < size) buf[len] = (c); len++; } while(0)
+
+  for (const char *p = fmt; *p; ++p) {
+    if (*p != '%') {
+      PUT(*p);
+      continue;
+    }
+
+    ++p;
+    uint8_t width = 0;
+    bool is_long = false;
+    while (*p >= '0' && *p <= '9')
+      width = width * 10 + (*p++ - '0');
+    if (width > 32)
+      width = 32;
+    if (*p == 'l') {
+      is_long = true;
+      ++p;
+    }
+
+    char num[34]; // 32 binary digits plus a sign
+    uint8_t numlen = 0;
+    switch (*p) {
+      case 's': {
+        const char *s = va_arg(args, const char *);
+        while (*s)
+          PUT(*s++);
+        continue;
+      }
+      case 'c':
+        PUT((char)va_arg(args, int));
+        continue;
+      case 'd':
+      case 'i': {
+        long value = is_long ? va_arg(args, long) : va_arg(args, int);
+        uint32_t magnitude = value;
+        if (value < 0) {
+          num[numlen++] = '-';
+          magnitude = -magnitude;
+          if (width)
+            width--;
+        }
+        numlen += formatNumber(num + numlen, magnitude, 10, width);
+        break;
+      }
+      case 'u':
+      case 'x': {
+        uint32_t value = is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+        numlen = formatNumber(num, value, *p == 'x' ? 16 : 10, width);
+        break;
+      }
+      case '%':
+        PUT('%');
+        continue;
+      default:
+        // Unsupported conversion, give up
+        if (size)
+          buf[len < size ? len : size - 1] = '\0';
+        return len;
+    }
+    for (uint8_t i = 0; i < numlen; ++i)
+      PUT(num[i]);
+  }
+  #undef PUT
+
+  if (size)
+    buf[len < size ? len : size - 1] = '\0';
+  return len;
+}
+
 /*******************************************************
  * Internal helper methods
  *******************************************************/
@@ -852,9 +2588,13 @@ int GSCore::processSpiSpecial(uint8_t c)
       case SPI_SPECIAL_IDLE:
         break;
       case SPI_SPECIAL_XOFF:
+        if (!this->spi_xoff)
+          trace(GS_TRACE_SPI, TRACE_SPI_XOFF, INVALID_CID, 0);
         this->spi_xoff = true;
         break;
       case SPI_SPECIAL_XON:
+        if (this->spi_xoff)
+          trace(GS_TRACE_SPI, TRACE_SPI_XON, INVALID_CID, 0);
         this->spi_xoff = false;
         break;
       case SPI_SPECIAL_ESC:
@@ -886,6 +2626,25 @@ bool GSCore::isSpiSpecial(uint8_t c)
   }
 }
 
+uint8_t GSCore::processSpiSpecial(uint8_t *buf, uint8_t len)
+{
+  uint8_t out = 0;
+  for (uint8_t i = 0; i < len; ++i) {
+    int c = processSpiSpecial(buf[i]);
+    if (c >= 0)
+      buf[out++] = c;
+  }
+  return out;
+}
+
+void GSCore::flushSpiRx()
+{
+  // Note that processIncoming might (indirectly) call readRaw, so
+  // update spi_rx_pos before processing every byte.
+  while (this->spi_rx_pos < this->spi_rx_len)
+    processIncoming(this->spi_rx_buf[this->spi_rx_pos++]);
+}
+
 bool GSCore::processIncoming(int c)
 {
   if (c < 0)
@@ -896,6 +2655,14 @@ bool GSCore::processIncoming(int c)
       if (c == 0x1b) {
         // Escape character, incoming data
         this->rx_state = GS_RX_ESC;
+      } else if (this->command_sent && !this->commands->done) {
+        // Part of the reply to a command sent by submitCommand()
+        GSResponse res = parseResponse(&this->command_parser, c);
+        if (res != GS_UNKNOWN_RESPONSE) {
+          // loop() takes care of the rest
+          this->commands->response = res;
+          this->commands->done = true;
+        }
       } else {
         // Don't log \r\n, since the synchronous response parsing
         // often leaves a \n behind. Only log in VERBOSE, since some
@@ -908,9 +2675,31 @@ bool GSCore::processIncoming(int c)
       break;
 
     case GS_RX_ESC:
-      // Note: <Esc>O and <Esc>F are handled in readDataResponse, since
-      // they should never be received asynchronously
+      // Note: <Esc>O and <Esc>F in reply to writeData() are handled in
+      // readDataResponse, only replies for tx_queue end up here.
       switch (c) {
+        case 'O':
+        case 'F':
+          this->rx_state = GS_RX_IDLE;
+          if (this->tx_state != GS_TX_WAIT_ACK) {
+            if (GS_LOG_ERRORS && this->error)
+              this->error->println("Unexpected data response");
+            break;
+          }
+          if (c == 'O') {
+            if (GS_DUMP_LINES && this->debug)
+              this->debug->println("<<| Read data OK response");
+            trace(GS_TRACE_DATA, TRACE_RX_DATA_OK, INVALID_CID, 0);
+            this->tx_state = GS_TX_ACKED;
+          } else {
+            if (GS_DUMP_LINES && this->debug)
+              this->debug->println("<<| Read data FAIL response");
+            trace(GS_TRACE_DATA, TRACE_RX_DATA_FAIL, INVALID_CID, 0);
+            STATS_ADD(data_fail_replies, 1);
+            this->tx_state = GS_TX_FAILED;
+          }
+          break;
+
         case 'Z':
           // Incoming TCP client/server or UDP client data
           // <Esc>Z<CID><Data Length xxxx 4 ascii char><data>
@@ -973,9 +2762,12 @@ bool GSCore::processIncoming(int c)
                 this->debug->print(this->head_frame.length);
                 this->debug->println(" bytes");
               }
+              trace(GS_TRACE_DATA, this->head_frame.udp_server ? TRACE_RX_UDP_FRAME : TRACE_RX_FRAME, this->head_frame.cid, this->head_frame.length);
               // Store the frame header and prepare to read data
               bufferFrameHeader(&this->head_frame);
               this->rx_state = GS_RX_BULK;
+              if (this->head_frame.length == 0)
+                headFrameComplete();
             } else {
               if (GS_LOG_ERRORS && this->error) {
                 this->error->print("Invalid escape sequence: <ESC>Z");
@@ -1045,9 +2837,12 @@ bool GSCore::processIncoming(int c)
                 this->debug->println(" bytes");
               }
 
+              trace(GS_TRACE_DATA, this->head_frame.udp_server ? TRACE_RX_UDP_FRAME : TRACE_RX_FRAME, this->head_frame.cid, this->head_frame.length);
               // Store the frame header and prepare to read data
               bufferFrameHeader(&this->head_frame);
               this->rx_state = GS_RX_BULK;
+              if (this->head_frame.length == 0)
+                headFrameComplete();
             } else {
               if (GS_LOG_ERRORS && this->error) {
                 this->error->print("Invalid escape sequence: <ESC>y");
@@ -1093,6 +2888,7 @@ bool GSCore::processIncoming(int c)
               this->debug->write(this->rx_async, this->rx_async_len);
               this->debug->println();
             }
+            trace(GS_TRACE_ASYNC, TRACE_RX_ASYNC, this->rx_async_subtype, this->rx_async_len);
             if (!processAsync()) {
               if (GS_LOG_ERRORS && this->error) {
                 this->error->print("Unknown async reponse: subtype=");
@@ -1114,114 +2910,375 @@ bool GSCore::processIncoming(int c)
       break;
 
     case GS_RX_BULK:
-      bufferIncomingData(c);
+    {
+      uint8_t b = c;
+      bufferIncomingData(&b, 1);
       if(--this->head_frame.length == 0)
-        this->rx_state = GS_RX_IDLE;
+        headFrameComplete();
       break;
+    }
   }
   return true;
 }
 
-void GSCore::bufferIncomingData(uint8_t c)
+void GSCore::processIncoming(const uint8_t *buf, uint16_t len)
 {
-  rx_data_index_t next_head = (this->rx_data_head + 1) % sizeof(this->rx_data);
-  if (next_head == this->rx_data_tail)
-    dropData(1);
-
-  this->rx_data[this->rx_data_head] = c;
-  this->rx_data_head = next_head;
+  while (len) {
+    if (this->rx_state == GS_RX_BULK && this->head_frame.length) {
+      // Copy a run of data bytes at once
+      uint16_t n = len < this->head_frame.length ? len : this->head_frame.length;
+      bufferIncomingData(buf, n);
+      buf += n;
+      len -= n;
+      this->head_frame.length -= n;
+      if (this->head_frame.length == 0)
+        headFrameComplete();
+    } else {
+      processIncoming(*buf++);
+      --len;
+    }
+  }
 }
 
-void GSCore::bufferFrameHeader(const RXFrame *frame)
+uint16_t GSCore::readAndProcessBlock()
 {
-  if (this->rx_data_head == this->rx_data_tail) {
-    // Ringbuffer is empty, so this frame becomes the tail_frame
-    // directly.
-    this->tail_frame = this->head_frame;
+  // In transparent mode, data is read by the application only
+  if (this->transparent)
+    return 0;
+
+  if (this->serial) {
+    uint8_t buf[UART_BLOCK_SIZE];
+    uint16_t len = readRaw(buf, sizeof(buf));
+    processIncoming(buf, len);
+    return len;
   } else {
-    // There is a previous frame in the ringbuffer, so put in the
-    // frame info in the ringbuffer as well.
-    if ( this->rx_data_head > sizeof(this->rx_data) - sizeof(*frame)) {
-      // The RXFrame structure doesn't fit in the ringbuffer
-      // consecutively. Skip a few bytes to skip back to the start.
-      // But if we don't have room to do that, we'll have to drop bytes
-      // from the tail to make room.
-      if (this->rx_data_tail > this->rx_data_head)
-        dropData(this->rx_data_tail - this->rx_data_tail);
-      if (this->rx_data_tail == 0)
-        dropData(1);
+    // Let readRaw() do a transfer when needed and then process the
+    // received bytes directly from spi_rx_buf
+    int c = readRaw();
+    if (c == -1)
+      return 0;
+    uint16_t len = 1 + this->spi_rx_len - this->spi_rx_pos;
+    processIncoming(c);
+    flushSpiRx();
+    return len;
+  }
+}
+
+void GSCore::bufferIncomingData(const uint8_t *buf, uint16_t len)
+{
+  // The header for this frame did not fit, so drop its data as well
+  if (this->head_header == RX_NO_FRAME)
+    return;
 
-      this->rx_data_head = 0;
+  if (rxFree() < len)
+    dropData(len);
+
+  uint16_t free = rxFree();
+  if (len > free) {
+    // Not even dropping other data made enough room, so drop the
+    // excess bytes
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("rx_data is full, dropped ");
+      this->error->print(len - free);
+      this->error->print(" incoming bytes for cid ");
+      this->error->println(this->head_frame.cid);
+    }
+    this->connections[this->head_frame.cid].error = true;
+    trace(GS_TRACE_DATA, TRACE_RX_DROPPED, this->head_frame.cid, len - free);
+    STATS_ADD(rx_dropped, len - free);
+    len = free;
+  }
+
+  // Copy the data, wrapping around the end of rx_data at most once
+  uint16_t first = rxSize() - this->rx_data_head;
+  if (first > len)
+    first = len;
+  memcpy(&this->rx_data[this->rx_data_head], buf, first);
+  memcpy(&this->rx_data[0], buf + first, len - first);
+  this->rx_data_head = rxIndex(this->rx_data_head + len);
+
+  // Update the length in the frame header
+  RXHeader header;
+  loadFrameHeader(this->head_header, &header);
+  header.length += len;
+  storeFrameHeader(this->head_header, &header);
+
+  STATS_ADD(rx_bytes[header.cid], len);
+  updateHighWater();
+}
+
+void GSCore::bufferFrameHeader(const RXFrame *frame)
+{
+  RXHeader header;
+  header.cid = frame->cid;
+  header.flags = frame->udp_server ? RX_FLAG_UDP_SERVER : 0;
+  // The header size must not change once data is stored behind it, so
+  // decide based on the full length of the frame.
+  if (frame->length > RX_SHORT_LENGTH_MAX)
+    header.flags |= RX_FLAG_LONG;
+  header.length = 0;
+  header.ip = frame->ip;
+  header.port = frame->port;
+
+  // Make sure there's enough space
+  uint8_t size = rxHeaderSize(header.flags);
+  if (rxFree() < size && !dropData(size)) {
+    // Not even dropping data made enough room, so drop this entire
+    // frame instead, since storing the header would overwrite other
+    // frames.
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("rx_data is full, dropped frame of ");
+      this->error->print(frame->length);
+      this->error->print(" bytes for cid ");
+      this->error->println(frame->cid);
     }
+    this->connections[frame->cid].error = true;
+    trace(GS_TRACE_DATA, TRACE_RX_DROPPED, frame->cid, frame->length);
+    STATS_ADD(rx_dropped, frame->length);
+    this->head_header = RX_NO_FRAME;
+    return;
+  }
+
+  // Copy the frame header
+  this->head_header = this->rx_data_head;
+  storeFrameHeader(this->head_header, &header);
+  this->rx_data_head = rxIndex(this->rx_data_head + size);
+  STATS_ADD(rx_frames[frame->cid], 1);
+  updateHighWater();
+
+  // If there are no older frames for this cid, this becomes the
+  // current frame for it.
+  RXCidState &state = this->rx_cids[frame->cid];
+  if (state.frame == RX_NO_FRAME) {
+    state.frame = this->head_header;
+    state.read = 0;
+  }
+}
+
+void GSCore::loadFrameHeader(rx_data_index_t pos, RXHeader *header)
+{
+  uint8_t packed[MAX_RX_HEADER_SIZE];
+  packed[0] = this->rx_data[pos];
+  uint8_t size = rxHeaderSize(packed[0]);
+  for (uint8_t i = 1; i < size; ++i)
+    packed[i] = this->rx_data[rxIndex(pos + i)];
+
+  header->cid = packed[0] & MAX_CID;
+  header->flags = packed[0] & (RX_FLAG_UDP_SERVER | RX_FLAG_DONE | RX_FLAG_LONG);
+  uint8_t n = 2;
+  if (header->flags & RX_FLAG_LONG)
+    header->length = packed[1] | (uint16_t)packed[n++] << 8;
+  else
+    header->length = packed[1] | ((packed[0] & RX_PACKED_LENGTH_BIT8) ? 0x100 : 0);
 
-    // Make sure there's enough space
-    uint8_t free = (this->rx_data_tail - this->rx_data_head - 1) % sizeof(this->rx_data);
-    if (free < sizeof(*frame))
-      dropData(sizeof(*frame) - free);
+  if (header->flags & RX_FLAG_UDP_SERVER) {
+    memcpy(&header->ip, &packed[n], sizeof(header->ip));
+    memcpy(&header->port, &packed[n + sizeof(header->ip)], sizeof(header->port));
+  } else {
+    header->ip = 0;
+    header->port = 0;
+  }
+}
 
-    // Copy the frame header
-    memcpy(&this->rx_data[this->rx_data_head], frame, sizeof(*frame));
-    this->rx_data_head += sizeof(*frame);
+void GSCore::storeFrameHeader(rx_data_index_t pos, const RXHeader *header)
+{
+  uint8_t packed[MAX_RX_HEADER_SIZE];
+  packed[0] = header->cid | header->flags;
+  packed[1] = header->length;
+  uint8_t n = 2;
+  if (header->flags & RX_FLAG_LONG)
+    packed[n++] = header->length >> 8;
+  else if (header->length & 0x100)
+    packed[0] |= RX_PACKED_LENGTH_BIT8;
+
+  if (header->flags & RX_FLAG_UDP_SERVER) {
+    memcpy(&packed[n], &header->ip, sizeof(header->ip));
+    memcpy(&packed[n + sizeof(header->ip)], &header->port, sizeof(header->port));
+    n += RX_HEADER_ADDRESS_SIZE;
   }
+
+  // The header can wrap around the end of rx_data
+  for (uint8_t i = 0; i < n; ++i)
+    this->rx_data[rxIndex(pos + i)] = packed[i];
+}
+
+uint16_t GSCore::bufferedData(cid_t cid)
+{
+  const RXCidState &state = this->rx_cids[cid];
+  if (state.frame == RX_NO_FRAME)
+    return 0;
+
+  RXHeader header;
+  loadFrameHeader(state.frame, &header);
+  return header.length - state.read;
+}
+
+uint16_t GSCore::bufferedBlock(cid_t cid, const uint8_t **buf)
+{
+  const RXCidState &state = this->rx_cids[cid];
+  if (state.frame == RX_NO_FRAME)
+    return 0;
+
+  RXHeader header;
+  loadFrameHeader(state.frame, &header);
+  // Return the data up to the end of the frame, or the end of rx_data,
+  // whichever comes first
+  rx_data_index_t start = rxIndex(frameData(state.frame, &header) + state.read);
+  uint16_t len = header.length - state.read;
+  if (len > rxSize() - start)
+    len = rxSize() - start;
+  *buf = &this->rx_data[start];
+  return len;
+}
+
+void GSCore::headFrameComplete()
+{
+  this->rx_state = GS_RX_IDLE;
+  this->head_header = RX_NO_FRAME;
 }
 
-void GSCore::loadFrameHeader(RXFrame* frame)
+void GSCore::finishFrame(cid_t cid)
 {
-  if (sizeof(this->rx_data) - this->rx_data_tail < sizeof(*frame)) {
-    // The RXFrame structure didn't fit in the ringbuffer
-    // consecutively. Skip a few bytes to skip back to the start
-    this->rx_data_tail = 0;
+  RXCidState &state = this->rx_cids[cid];
+
+  // Mark the frame as done, so its space can be reclaimed
+  RXHeader header;
+  loadFrameHeader(state.frame, &header);
+  header.flags |= RX_FLAG_DONE;
+  storeFrameHeader(state.frame, &header);
+
+  // Look for the next frame for this cid. Any frames after the current
+  // one can never be done already, so no need to check that.
+  rx_data_index_t pos = nextFrame(state.frame, &header);
+  state.frame = RX_NO_FRAME;
+  state.read = 0;
+  while (pos != this->rx_data_head) {
+    loadFrameHeader(pos, &header);
+    if (header.cid == cid) {
+      state.frame = pos;
+      break;
+    }
+    pos = nextFrame(pos, &header);
+  }
+
+  // Release the space of any done frames at the tail of the buffer
+  while (this->rx_data_tail != this->rx_data_head) {
+    loadFrameHeader(this->rx_data_tail, &header);
+    if (!(header.flags & RX_FLAG_DONE))
+      break;
+    this->rx_data_tail = nextFrame(this->rx_data_tail, &header);
   }
-  memcpy(frame, &this->rx_data[this->rx_data_tail], sizeof(*frame));
-  this->rx_data_tail += sizeof(*frame);
 }
 
 GSCore::RXFrame GSCore::getFrameHeader(cid_t cid)
 {
-  if (this->tail_frame.length == 0) {
-    if (this->rx_data_tail != this->rx_data_head) {
-      // The current frame is empty, but there is still data in rx_data.
-      // Load the next frame.
-     loadFrameHeader(&this->tail_frame);
-    } else {
-      // The buffer is empty. See if we can read more data from the
-      // module.
-      while (this->tail_frame.length == 0) {
-        // Don't block
-        if (!processIncoming(readRaw()))
-          return RXFrame();
+  IrqGuard guard(*this);
+  RXFrame frame = RXFrame();
+  if (cid > MAX_CID && cid != ANY_CID)
+    return frame;
+
+  // The oldest frame in the buffer is never done, so for ANY_CID, just
+  // use that.
+  rx_data_index_t pos;
+  if (cid == ANY_CID)
+    pos = (this->rx_data_tail != this->rx_data_head) ? this->rx_data_tail : RX_NO_FRAME;
+  else
+    pos = this->rx_cids[cid].frame;
+
+  if (pos == RX_NO_FRAME) {
+    // Nothing buffered for this cid. See if we can read more data from
+    // the module (unless the data ready interrupt already takes care
+    // of that). Any frames for other cids are buffered along the way,
+    // so they can be read independently later.
+    uint16_t tries = 1024; // max 1k per loop
+    while (this->rx_irq_slot == INVALID_PIN && tries-- > 0) {
+      // Don't block
+      if (!readAndProcessBlock())
+        return frame;
+
+      if (cid == ANY_CID && this->rx_data_tail != this->rx_data_head) {
+        pos = this->rx_data_tail;
+        break;
+      } else if (cid != ANY_CID && this->rx_cids[cid].frame != RX_NO_FRAME) {
+        pos = this->rx_cids[cid].frame;
+        break;
       }
     }
+    if (pos == RX_NO_FRAME)
+      return frame;
   }
 
-  if (cid == ANY_CID || this->tail_frame.cid == cid)
-    return this->tail_frame;
-  else
-    return RXFrame();
+  return frameAt(pos);
+}
+
+GSCore::RXFrame GSCore::frameAt(rx_data_index_t pos)
+{
+  RXFrame frame;
+  RXHeader header;
+  loadFrameHeader(pos, &header);
+  frame.udp_server = header.flags & RX_FLAG_UDP_SERVER;
+  frame.cid = header.cid;
+  frame.length = header.length - this->rx_cids[header.cid].read;
+  // If the module is still sending this frame, include the bytes not
+  // received yet
+  if (pos == this->head_header)
+    frame.length += this->head_frame.length;
+  frame.ip = header.ip;
+  frame.port = header.port;
+  return frame;
 }
 
-int GSCore::getData()
+int GSCore::getData(cid_t cid)
 {
-  if (this->rx_data_tail != this->rx_data_head) {
+  RXCidState &state = this->rx_cids[cid];
+  if (state.frame == RX_NO_FRAME)
+    return -1;
+
+  RXHeader header;
+  loadFrameHeader(state.frame, &header);
+  int c;
+  if (state.read < header.length) {
     // There is data in the buffer, read it
-    int c = this->rx_data[this->rx_data_tail];
-    this->rx_data_tail = (this->rx_data_tail + 1) % sizeof(this->rx_data);
-    this->tail_frame.length--;
-    return c;
-  } else {
+    c = this->rx_data[rxIndex(frameData(state.frame, &header) + state.read)];
+    state.read++;
+    resumeDrain();
+  } else if (state.frame == this->head_header) {
     // No data buffered, try reading from the module directly
-    int c = readRaw();
-    if (c >= 0) {
-      this->tail_frame.length--;
-      if(--this->head_frame.length == 0)
-        this->rx_state = GS_RX_IDLE;
-    }
-    return c;
+    c = readRaw();
+    if (c < 0)
+      return c;
+    if (--this->head_frame.length == 0)
+      headFrameComplete();
+  } else {
+    return -1;
   }
+
+  if (state.read == header.length && state.frame != this->head_header)
+    finishFrame(cid);
+  return c;
 }
 
 void GSCore::readAndProcessAsync()
 {
+  // In transparent mode, data is read by the application only
+  if (this->transparent)
+    return;
+
+  IrqGuard guard(*this);
+  if (this->serial) {
+    // A UART cannot be paused and its receive buffer is tiny, so just
+    // read and process everything that is available in blocks, which
+    // buffers any data received.
+    int16_t tries = 1024; // max 1k per loop
+    while (tries > 0) {
+      uint16_t len = readAndProcessBlock();
+      if (!len)
+        break;
+      tries -= len;
+    }
+    return;
+  }
+
   // Read and process bytes until:
   //  - There are no more bytes to read.
   //  - We end up in a data packet (which we don't want to read all the
@@ -1235,6 +3292,10 @@ void GSCore::readAndProcessAsync()
     switch (this->rx_state) {
       case GS_RX_ESC_Z:
       case GS_RX_BULK:
+        // While waiting for the reply to a command, buffer data to
+        // get at the reply behind it.
+        if (this->command_sent)
+          continue;
         return;
       default:
         continue;
@@ -1242,17 +3303,78 @@ void GSCore::readAndProcessAsync()
   }
 }
 
-void GSCore::dropData(uint8_t num_bytes) {
-  while(num_bytes--) {
-    cid_t cid;
-    if (readData(&cid) >= 0) {
+bool GSCore::dropData(uint16_t num_bytes)
+{
+  uint16_t free;
+  while ((free = rxFree()) < num_bytes) {
+    if (this->rx_data_tail == this->rx_data_head)
+      return false;
+
+    // The frame at the tail is never done, so it must be the current
+    // frame for its cid. Other connections keep their data.
+    RXHeader header;
+    loadFrameHeader(this->rx_data_tail, &header);
+    RXCidState &state = this->rx_cids[header.cid];
+
+    if (state.read == 0) {
+      // Nothing to reclaim, so drop unread bytes from this frame
+      uint16_t drop = num_bytes - free;
+      if (drop > header.length)
+        drop = header.length;
+      if (drop == 0) {
+        // Only the header of the frame being received is left, nothing
+        // more we can do.
+        if (state.frame == this->head_header)
+          return false;
+
+        // An empty frame (which can never be read), just finish it
+        finishFrame(header.cid);
+        continue;
+      }
+
       if (GS_LOG_ERRORS && this->error) {
-        this->error->print("rx_data is full, dropped byte for cid ");
-        this->error->println(cid);
+        this->error->print("rx_data is full, dropped ");
+        this->error->print(drop);
+        this->error->print(" bytes for cid ");
+        this->error->println(header.cid);
+      }
+      this->connections[header.cid].error = true;
+      trace(GS_TRACE_DATA, TRACE_RX_DROPPED, header.cid, drop);
+      STATS_ADD(rx_dropped, drop);
+      state.read = drop;
+
+      if (state.read == header.length && state.frame != this->head_header) {
+        finishFrame(header.cid);
+        continue;
       }
-      this->connections[cid].error = true;
     }
+
+    releaseReadData();
   }
+  return true;
+}
+
+void GSCore::releaseReadData()
+{
+  if (this->rx_data_tail == this->rx_data_head)
+    return;
+
+  RXHeader header;
+  loadFrameHeader(this->rx_data_tail, &header);
+  RXCidState &state = this->rx_cids[header.cid];
+  if (state.read == 0)
+    return;
+
+  // Move the header forward to just before the unread data, which
+  // releases the space of the data read already.
+  rx_data_index_t pos = rxIndex(this->rx_data_tail + state.read);
+  header.length -= state.read;
+  storeFrameHeader(pos, &header);
+  if (this->head_header == this->rx_data_tail)
+    this->head_header = pos;
+  this->rx_data_tail = pos;
+  state.frame = pos;
+  state.read = 0;
 }
 
 GSCore::GSResponse GSCore::processResponseLine(const uint8_t* buf, uint8_t len, cid_t *connect_cid)
@@ -1274,6 +3396,7 @@ GSCore::GSResponse GSCore::processResponseLine(const uint8_t* buf, uint8_t len,
     this->debug->write(buf, len);
     this->debug->println();
   }
+  trace(GS_TRACE_LINES, TRACE_RX_LINE, INVALID_CID, len);
 
   // In non-verbose mode, command responses are an (string containing a)
   // number from "0" to "18"
@@ -1449,9 +3572,36 @@ bool GSCore::processAsync()
         return true;
       } else {
         // Incoming connection on a TCP server
-        // CONNECT <server CID> <new CID> <ip> <port>,
-        // TODO
-        return false;
+        // CONNECT <server CID> <new CID> <ip> <port>
+        cid_t server_cid;
+        if (arg_len < 10 || args[2] != ' ' || args[4] != ' ')
+          return false;
+        if (!parseNumber(&server_cid, &args[1], 1, 16) || !parseNumber(&cid, &args[3], 1, 16))
+          return false;
+
+        const uint8_t *ip_start = &args[5];
+        const uint8_t *end = args + arg_len;
+        const uint8_t *space = (const uint8_t*)memchr(ip_start, ' ', end - ip_start);
+        IPAddress ip;
+        uint16_t port;
+        if (!space || !parseIpAddress(&ip, (const char*)ip_start, space - ip_start))
+          return false;
+        if (!parseNumber(&port, space + 1, end - space - 1, 10))
+          return false;
+
+        processConnect(cid, ip, port, this->connections[server_cid].local_port, false);
+        this->connections[cid].server_cid = server_cid;
+
+        // A cid is only queued once, drop any stale entry from a
+        // previous connection
+        for (uint8_t i = 0; i < this->accept_len; ++i) {
+          if (this->accept_queue[i] == cid) {
+            removeAccepted(i);
+            break;
+          }
+        }
+        this->accept_queue[this->accept_len++] = cid;
+        return true;
       }
     case GS_ASYNC_SOCK_FAIL:
     case GS_ASYNC_ECIDCLOSE:
@@ -1511,10 +3661,17 @@ bool GSCore::processAsync()
           if (this->initializing)
             return true;
 
-          // TODO: Reset our state to match the hardware. Also make sure
-          // to stop waiting for a reply to a command, since it will never
-          // come.
-          return false;
+          // The module lost its association and all settings that
+          // were not stored in its profile, so make sure the next
+          // setters and associate() actually send their commands again.
+          if (GS_LOG_ERRORS && this->error)
+            this->error->println(F("Module reset unexpectedly"));
+          forgetConfig(NULL);
+          processDisassociation();
+
+          // TODO: Make sure to stop waiting for a reply to a command,
+          // since it will never come.
+          return true;
 
         case GS_ASYNC_NWCONN_SUCCESS:
           // This means that the Network Connection Manager has
@@ -1568,6 +3725,8 @@ void GSCore::processDisassociation()
     this->events |= EVENT_DISASSOCIATED;
 
   this->associated = false;
+  this->associated_ssid = 0;
+  this->disassociations++;
   for (cid_t cid = 0; cid <= MAX_CID; ++cid) {
     if (this->connections[cid].connected) {
       this->connections[cid].error = true;
@@ -1590,9 +3749,15 @@ void GSCore::processConnect(cid_t cid, uint32_t remote_ip, uint16_t remote_port,
     this->events |= EVENT_NCM_CONNECTED;
   }
 
+  // Handlers belong to the previous connection using this cid
+  memset(&this->handlers[cid], 0, sizeof(this->handlers[cid]));
+  this->disconnect_events &= ~(1 << cid);
+
   this->connections[cid].remote_ip = remote_ip;
   this->connections[cid].remote_port = remote_port;
   this->connections[cid].local_port = local_port;
+  this->connections[cid].server_cid = INVALID_CID;
+  this->connections[cid].parked = false;
   this->connections[cid].error = false;
   this->connections[cid].connected = true;
 }
@@ -1604,6 +3769,8 @@ void GSCore::processDisconnect(cid_t cid)
 
   this->connections[cid].connected = false;
   this->connections[cid].ssl = false;
+  if (this->handlers[cid].onData || this->handlers[cid].onDisconnect)
+    this->disconnect_events |= (1 << cid);
   if (cid == this->ncm_auto_cid) {
     this->ncm_auto_cid = INVALID_CID;
     // If there is still an unprocessed connect event, just cancel that.
@@ -1614,6 +3781,26 @@ void GSCore::processDisconnect(cid_t cid)
   }
 }
 
+GSCore::cid_t GSCore::acceptConnection(cid_t server_cid)
+{
+  IrqGuard guard(*this);
+  readAndProcessAsync();
+  for (uint8_t i = 0; i < this->accept_len; ++i) {
+    cid_t cid = this->accept_queue[i];
+    if (this->connections[cid].server_cid == server_cid) {
+      removeAccepted(i);
+      return cid;
+    }
+  }
+  return INVALID_CID;
+}
+
+void GSCore::removeAccepted(uint8_t i)
+{
+  memmove(&this->accept_queue[i], &this->accept_queue[i + 1], this->accept_len - i - 1);
+  this->accept_len--;
+}
+
 /*******************************************************
  * Static helper methods
  *******************************************************/
@@ -28,8 +28,10 @@
 #define GS_CORE_H
 
 #include <stdint.h>
+#include <stdarg.h>
 #include <Stream.h>
 #include <IPAddress.h>
+#include <SPI.h>
 
 // NOTE: In addition to enable output here, an output target should also
 // be supplied at runtime by calling the setLogOutput method.
@@ -52,6 +54,94 @@ const bool GS_DUMP_BYTES = false;
 // received.
 const bool GS_DUMP_SPI = false;
 
+// By default, SS is toggled for every single SPI byte, since the module
+// ignores subsequent bytes otherwise. When the module firmware accepts
+// multiple bytes per SS assertion, enable this to transfer whole blocks
+// using SPI.transfer(buf, len) instead. Note that XOFF can then only be
+// honoured at block boundaries, so up to SPI_BLOCK_SIZE bytes might be
+// sent after the module sends XOFF.
+const bool GS_SPI_HOLD_SS = false;
+
+// Keep performance counters, see GSCore::getStats(). Unlike the above,
+// this is a preprocessor define (which can also be set from the
+// compiler commandline), so the counters do not take up any RAM or
+// code when disabled.
+#ifndef GS_STATS
+#define GS_STATS 0
+#endif
+
+// Query the module's state in begin(), so an MCU-only reset can pick
+// up an existing association and skip configuration commands that
+// would change nothing (see GSCore::writeConfigCommand()). Costs a
+// few commands in begin() and 4 * GSCore::MAX_CONFIG_ENTRIES bytes of
+// RAM, like GS_STATS this can also be set from the compiler
+// commandline.
+#ifndef GS_WARM_START
+#define GS_WARM_START 1
+#endif
+
+// Record events into a binary trace ring in RAM, see
+// GSCore::dumpTrace(). Adding a record takes just a few instructions,
+// so unlike the text dumps above this hardly changes timing. Set to a
+// combination of the categories below, like GS_STATS this can also be
+// set from the compiler commandline.
+#define GS_TRACE_DATA  0x01 // Data frames written and read
+#define GS_TRACE_LINES 0x02 // Commands written and response lines read
+#define GS_TRACE_ASYNC 0x04 // Async messages read
+#define GS_TRACE_SPI   0x08 // SPI flow control
+#ifndef GS_TRACE
+#define GS_TRACE 0
+#endif
+
+// Number of records in the trace ring (8 bytes each)
+#ifndef GS_TRACE_SIZE
+#define GS_TRACE_SIZE 32
+#endif
+
+// Number of names kept in the DNS cache of GSModule::dnsLookup() (about
+// 40 bytes of RAM each). 0 removes the cache completely.
+#ifndef GS_DNS_CACHE_SIZE
+#define GS_DNS_CACHE_SIZE 4
+#endif
+
+// Maximum number of connections in the GSModule connection pool (about
+// 8 bytes of RAM each). 0 removes the pool completely.
+#ifndef GS_POOL_SIZE
+#define GS_POOL_SIZE 4
+#endif
+
+// Size of the outgoing packet buffer shared by GSUdpServer instances
+// created without their own buffer. This limits the size of packets
+// they can send, at most 1400 (GSCore::MAX_DATA_FRAME_SIZE). The buffer
+// is left out by the linker when no such server is created.
+#ifndef GS_UDP_TX_SIZE
+#define GS_UDP_TX_SIZE 1400
+#endif
+
+/**
+ * A piece of data for writing a frame from multiple buffers with
+ * GSCore::writeData(), without copying them together first.
+ *
+ * For example:
+ *
+ *   GSChunk chunks[] = {
+ *     {header, sizeof(header)},
+ *     {payload, len},
+ *     {trailer, sizeof(trailer)},
+ *   };
+ *   gs.writeData(cid, chunks, 3);
+ */
+struct GSChunk {
+  const uint8_t *buf;
+  uint16_t len;
+  /**
+   * Set when buf points into program memory (e.g. a PROGMEM array).
+   * Only relevant on architectures that have a separate address space
+   * for it, like AVR.
+   */
+  bool progmem;
+};
+
 /**
  * This class allows talking to a Gainspan Serial2Wifi module. It's
  * intended for the GS1011MIPS module, but might also work with other
@@ -77,9 +167,19 @@ public:
   /** Biggest valid CID */
   static const uint8_t MAX_CID = 0xf;
 
+  /**
+   * The maximum number of data bytes in a single frame. According to
+   * SERIAL-TO-WIFI ADAPTER APPLICATION PROGRAMMING GUIDE, section 3.4.1
+   * ("Bulk data Tx and Rx").
+   */
+  static const uint16_t MAX_DATA_FRAME_SIZE = 1400;
+
   /** Value to indicate "no pin" */
   static const uint8_t INVALID_PIN = 0xff;
 
+  /** How many instances can use a data ready interrupt at the same time */
+  static const uint8_t MAX_RX_INTERRUPTS = 2;
+
   /**
    * How many milliseconds to wait for a a response? Should be fairly
    * big, since the AT+WA command might take quite a bit of time
@@ -87,6 +187,26 @@ public:
    */
   static const unsigned long RESPONSE_TIMEOUT = 20 * 1000;
 
+  /**
+   * While waiting for the startup banner, send an AT command this
+   * often (in milliseconds). After an MCU-only reset the module is
+   * still running and will not print a banner, but it does answer.
+   */
+  static const uint16_t STARTUP_PROBE_INTERVAL = 250;
+
+  /**
+   * After the banner (or a reply to a probe) is received, wait until
+   * the module has been quiet for this many milliseconds before
+   * sending commands, so no leftovers are mistaken for a reply.
+   */
+  static const uint8_t STARTUP_QUIET_TIME = 20;
+
+  /**
+   * Number of settings reported by the module in begin() that are
+   * remembered for writeConfigCommand().
+   */
+  static const uint8_t MAX_CONFIG_ENTRIES = 24;
+
   /**
    * A buffer of this size should fit every line of data in a response.
    * Since it's data, it's hard to predict how much is needed, but it's
@@ -96,6 +216,12 @@ public:
    */
   static const uint8_t MAX_DATA_LINE_SIZE = 128;
 
+  /**
+   * Commands longer than this (excluding the trailing "\r\n") are
+   * truncated by writeCommand().
+   */
+  static const uint8_t MAX_COMMAND_SIZE = 125;
+
 /*******************************************************
  * Event handlers
  *******************************************************/
@@ -124,8 +250,39 @@ public:
  * Methods for setting up the module
  *******************************************************/
 
+  /**
+   * Create a new instance, using a statically allocated buffer of
+   * DEFAULT_RX_DATA_SIZE bytes for received data. Since this buffer is
+   * shared, only a single instance should be created this way.
+   */
   GSCore();
 
+  /**
+   * Create a new instance, using the given buffer to store received
+   * data until the application reads it. Its size must be a power of
+   * two between MIN_RX_DATA_SIZE and MAX_RX_DATA_SIZE, which is checked
+   * at compile time. A bigger buffer makes it less likely that data is
+   * dropped when the application does not read fast enough.
+   *
+   * For example:
+   *
+   *   uint8_t rx_buf[2048];
+   *   GSModule gs(rx_buf);
+   */
+  template <size_t N>
+  GSCore(uint8_t (&rx_buf)[N]) : GSCore(rx_buf, N) {
+    static_assert((N & (N - 1)) == 0, "rx buffer size is not a power of two");
+    static_assert(N >= MIN_RX_DATA_SIZE, "rx buffer is too small");
+    static_assert(N <= MAX_RX_DATA_SIZE, "rx buffer is too big");
+  }
+
+  /** Size of the receive buffer used by the default constructor */
+  static const uint16_t DEFAULT_RX_DATA_SIZE = 512;
+  /** Minimum size of a receive buffer */
+  static const uint16_t MIN_RX_DATA_SIZE = 64;
+  /** Maximum size of a receive buffer */
+  static const uint16_t MAX_RX_DATA_SIZE = 16384;
+
   /**
    * Set up this library to talk over a UART specified by the given
    * stream.
@@ -147,8 +304,21 @@ public:
    *                    this pin. This is not recommended, as it adds
    *                    extra delays and latencies and is not documented
    *                    to work by Gainspan.
+   * @param rx_interrupt When true, an interrupt is attached to the
+   *                    data_ready pin, which reads any pending data
+   *                    from the module into the receive buffer as
+   *                    soon as it becomes available (so without
+   *                    waiting for the sketch to poll). This only works
+   *                    when data_ready supports interrupts (see
+   *                    digitalPinToInterrupt()) and at most
+   *                    MAX_RX_INTERRUPTS instances can use it.
+   *
+   *                    Note that in this mode, all error and debug
+   *                    output might be generated from within the
+   *                    interrupt handler, and readRaw() and
+   *                    writeRaw() should not be called directly.
    */
-  bool begin(uint8_t ss, uint8_t data_read = INVALID_PIN);
+  bool begin(uint8_t ss, uint8_t data_read = INVALID_PIN, bool rx_interrupt = false);
 
   /**
    * Clean up this library (for example to switch from UART to SPI).
@@ -169,6 +339,135 @@ public:
    */
   void loop();
 
+  /** Default minimum interval between full SPI polls, in microseconds */
+  static const uint16_t DEFAULT_MIN_POLL_INTERVAL = 1000;
+  /** Default maximum interval between full SPI polls, in microseconds */
+  static const uint16_t DEFAULT_MAX_POLL_INTERVAL = 32000;
+
+  /**
+   * Configure how often the module is polled over SPI when no data
+   * ready pin is available. Without that pin, checking that no data is
+   * available takes a "full poll" of 64 SPI bytes (since the module
+   * sends that many idle bytes first). Such a full poll is done at most
+   * once per interval, other calls only read a single byte.
+   *
+   * The interval resets to min_interval whenever data is received,
+   * and doubles after every full poll without data, up to
+   * max_interval. A low minimum reduces latency during bursts, a high
+   * maximum wastes less time when idle.
+   *
+   * @param min_interval  The interval in microseconds while data is
+   *                      flowing.
+   * @param max_interval  The interval in microseconds when idle. Should
+   *                      be at least min_interval.
+   */
+  void setSpiPollInterval(uint16_t min_interval, uint16_t max_interval)
+  {
+    this->spi_poll_min = min_interval;
+    this->spi_poll_max = max_interval < min_interval ? min_interval : max_interval;
+    this->spi_poll_interval = min_interval;
+  }
+
+#ifdef SPI_HAS_TRANSACTION
+  /**
+   * Default SPI clock, in Hz. This is the SPI_CLOCK_DIV8 speed on a
+   * 16Mhz board, which the examples have always used.
+   */
+  static const uint32_t DEFAULT_SPI_CLOCK = 2000000;
+
+  /**
+   * Configure the SPI settings (clock, bit order and mode) used for
+   * this module. Every SPI burst to the module is done inside its own
+   * SPI transaction using these settings, so each module (and every
+   * other device on the bus) can run at its own highest stable clock.
+   * This means SPI.setClockDivider() no longer has any effect for this
+   * library. Can be called before or after begin().
+   */
+  void setSpiSettings(const SPISettings &settings)
+  {
+    this->spi_settings = settings;
+  }
+#endif
+
+  /**
+   * Claim the SPI bus on behalf of some other SPI device. Until the
+   * matching releaseSpiBus() call, the data ready interrupts of all
+   * GSCore instances only remember that data is pending, which is then
+   * read as soon as the bus is released. Calls can be nested.
+   *
+   * This library claims the bus itself for every SPI burst (of at most
+   * SPI_BLOCK_SIZE bytes) rather than for every byte or for a complete
+   * command, so multiple modules and other devices can interleave
+   * their transfers: a module whose interrupt fired during another
+   * burst is served directly after that burst.
+   *
+   * This is only needed around drivers that do not use
+   * SPI.beginTransaction(), since those that do are already protected
+   * through SPI.usingInterrupt().
+   */
+  static void claimSpiBus() { ++spi_bus_claims; }
+
+  /**
+   * Release the SPI bus claimed by claimSpiBus() and read any data
+   * that became pending while it was claimed.
+   */
+  static void releaseSpiBus();
+
+  /**
+   * Enable or disable lossless receive mode.
+   *
+   * By default, when rx_data is full, the oldest unread data is dropped
+   * to make room and the connection that lost data gets its error flag
+   * set. In lossless mode, this library instead stops reading from the
+   * module when rx_data gets full, so data stays in the module's buffer
+   * until the application has read enough data to free up room.
+   *
+   * Note that this means that data for one connection can only be read
+   * once data in front of it (for any connection) has been read, so the
+   * application should read from all connections.
+   *
+   * Flow control is still not perfect: While waiting for a reply to a
+   * command, all data in front of the reply must be read and is dropped
+   * when it does not fit. Similarly, data that the module sends over
+   * SPI while data is being written cannot be refused.
+   *
+   * With a UART, this needs hardware flow control to stop the module
+   * from sending (see setRtsPin()), otherwise data would be lost in
+   * the UART's receive buffer instead.
+   *
+   * Data held back in the module is only read again when room frees
+   * up by reading or skipping data, or from loop(). With the data ready
+   * interrupt, reading data resumes draining the module by itself, but
+   * asynchronous events (like disconnects) queued behind the data are
+   * still only handled once they are read, so the sketch should keep
+   * calling loop() regularly in this mode.
+   */
+  void setLossless(bool enable) { this->rx_lossless = enable; }
+
+  /**
+   * Set the pin connected to the module's CTS pin, to stop the module
+   * from sending data over a UART in lossless mode. The module must
+   * have hardware flow control enabled for this to work.
+   *
+   * @param pin   The pin, or INVALID_PIN to not use RTS. Will be
+   *              configured as an output pin automatically.
+   */
+  void setRtsPin(uint8_t pin);
+
+  /**
+   * Set the pin connected to the module's RTS pin, so writes over a
+   * UART wait while the module cannot take more data. The module must
+   * have hardware flow control enabled for this to work (see
+   * GSModule::setBaudRate()).
+   *
+   * Since the UART itself buffers some data, the module might still
+   * receive a few bytes after raising RTS, which it can handle.
+   *
+   * @param pin   The pin, or INVALID_PIN to not use CTS. Will be
+   *              configured as an input pin automatically.
+   */
+  void setCtsPin(uint8_t pin);
+
   /**
    * Set the target for error and debug output. Pass NULL to disable
    * (which is also the default).
@@ -197,18 +496,66 @@ public:
   };
 
   /**
-   * Get info about the current frame (or, after reading the last byte of a
-   * frame, the next frame), without blocking.
+   * Get info about the current frame for the given cid (or, after
+   * reading the last byte of a frame, the next frame), without
+   * blocking. Frames for other cids that are received in the meanwhile
+   * are buffered, so they can be read later.
    *
    * @param cid    The cid the caller is interested in.
    *
-   * @returns a pointer to the current frame if a frame was available
-   * and it contains data for the given cid (or cid is CID_ANY), or
-   * an empty frame (length == 0) when no frame is available or it is
-   * for the wrong cid.
+   * @returns the current frame if a frame was available for the given
+   * cid (or the oldest frame when cid is CID_ANY), or an empty frame
+   * (length == 0) when no frame is available. The length returned
+   * is the number of bytes left to read from the frame.
    */
   RXFrame getFrameHeader(cid_t cid);
 
+  /**
+   * Handler called by loop() when data is available for a connection.
+   *
+   * @param data    The data passed to setConnectionHandlers()
+   * @param cid     The cid data is available for
+   * @param frame   The current frame for the cid, like returned by
+   *                getFrameHeader()
+   */
+  typedef void (*data_handler_t)(void *data, cid_t cid, const RXFrame &frame);
+
+  /**
+   * Handler called by loop() when a connection was closed (for any
+   * reason, including explicit disconnection).
+   *
+   * @param data    The data passed to setConnectionHandlers()
+   * @param cid     The cid that was closed
+   */
+  typedef void (*disconnect_handler_t)(void *data, cid_t cid);
+
+  /**
+   * Set handlers for a single connection, so the application does not
+   * need to poll every connection for data.
+   *
+   * On every call to loop(), onData is called for each connection that
+   * has a frame buffered (or, without a data ready interrupt, that the
+   * module started sending). The handler can read the frame right away
+   * using readData(), borrowData() or discardFrame(), which reads any
+   * part of the frame still in the module directly. Data left unread is
+   * offered again on the next loop().
+   *
+   * onDisconnect is called once the connection is closed and all data
+   * was offered to onData. After that, or when the cid is used for a
+   * new connection, the handlers are removed.
+   *
+   * @param cid           The connection to set handlers for.
+   * @param onData        Called when data is available, can be NULL.
+   * @param onDisconnect  Called after disconnection, can be NULL.
+   * @param data          Passed to the handlers.
+   *
+   * @returns false when the cid is invalid or not connected.
+   */
+  bool setConnectionHandlers(cid_t cid, data_handler_t onData, disconnect_handler_t onDisconnect, void *data = NULL);
+
+  /** Remove any handlers set for the given cid. */
+  void clearConnectionHandlers(cid_t cid);
+
   /**
    * Read a single byte of data for the given cid, without removing it
    * from the buffer.
@@ -223,10 +570,10 @@ public:
   /**
    * Read a single byte of data for the given cid.
    *
-   * Be careful when polling this method for data. If data is available
-   * for another cid, then calling readData will _never_ return a data
-   * byte, not until you read all the data for that other cid (no matter
-   * how long you wait).
+   * Each cid is read independently, so this returns data even when
+   * older data for another cid is still waiting in the buffer. If the
+   * buffer fills up, data is dropped from the connection with the
+   * oldest unread data (which gets its error flag set).
    *
    * @param cid The cid to read data for. Can be an invalid cid, will
    *            return -1 then.
@@ -259,6 +606,65 @@ public:
    */
   int readData(cid_t *cid);
 
+  /**
+   * Skip up to len bytes of data, without blocking. This is a lot
+   * faster than reading and ignoring the data, since buffered data is
+   * skipped at once and data still in the module is not buffered.
+   *
+   * @param cid    The cid to skip data for. Can be an invalid cid, will
+   *               return 0 then.
+   * @param len    The maximum number of bytes to skip.
+   *
+   * @returns the number of bytes skipped.
+   *
+   * @see the notes for readData(cid_t), which also apply here.
+   */
+  uint16_t skipData(cid_t cid, uint16_t len);
+
+  /**
+   * Skip the rest of the current frame for the given cid, without
+   * blocking.
+   *
+   * @param cid    The cid to skip data for. Can be an invalid cid, will
+   *               return false then.
+   *
+   * @returns true when the rest of the frame was skipped, false when no
+   * frame was available or not all of its data was available yet.
+   */
+  bool discardFrame(cid_t cid);
+
+  /**
+   * Get direct access to data for the given cid, without copying it.
+   * This returns a pointer into the receive buffer and the number of
+   * bytes that can be read from it. That is the longest contiguous
+   * block, which never extends beyond the current frame, so calling
+   * this again after consumeData() can return more data.
+   *
+   * The pointer is only valid until the next call to consumeData() or
+   * any other method that reads data from the module. When the data
+   * ready interrupt is used, data that is left unconsumed for too long
+   * might be dropped if the buffer fills up and the connection's error
+   * flag is set.
+   *
+   * @param cid    The cid to read data for. Can be an invalid cid, will
+   *               return 0 then.
+   * @param buf    A pointer to the data is returned through this
+   *               pointer.
+   *
+   * @returns the number of bytes available at *buf, or 0 if no data is
+   * available.
+   */
+  uint16_t borrowData(cid_t cid, const uint8_t **buf);
+
+  /**
+   * Remove data previously returned by borrowData() from the buffer.
+   *
+   * @param cid  The cid passed to borrowData().
+   * @param len  The number of bytes to remove. Should not be more than
+   *             borrowData() returned.
+   */
+  void consumeData(cid_t cid, uint16_t len);
+
   /**
    * @returns the cid for which data can be read, or INVALID_CID if no
    * data is currently avaiable.
@@ -302,6 +708,163 @@ public:
    */
   bool writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len);
 
+  /**
+   * Write connection data for the given cid from multiple buffers, as
+   * a single frame.
+   *
+   * @param cid         The cid to write data to. Can be an invalid
+   *                    cid, will return false then.
+   * @param chunks      The buffers to send, in order.
+   * @param num_chunks  The number of chunks.
+   *
+   * @returns whether the data could be succesfully written. Always
+   * false when the total length is more than MAX_DATA_FRAME_SIZE.
+   */
+  bool writeData(cid_t cid, const GSChunk *chunks, uint8_t num_chunks);
+
+  /**
+   * Write a packet for the given UDP server cid from multiple buffers.
+   *
+   * @param cid         The cid to write data to. Can be an invalid
+   *                    cid, will return false then.
+   * @param ip          The IP address to send the packet to
+   * @param port        The port to send the packet to
+   * @param chunks      The buffers to send, in order.
+   * @param num_chunks  The number of chunks.
+   *
+   * @returns whether the data could be succesfully written. Always
+   * false when the total length is more than MAX_DATA_FRAME_SIZE.
+   */
+  bool writeData(cid_t cid, IPAddress ip, uint16_t port, const GSChunk *chunks, uint8_t num_chunks);
+
+  /**
+   * Called by writeBulkData() to produce the next bytes to send.
+   *
+   * @param buf    The buffer to write the data into.
+   * @param len    The number of bytes needed.
+   * @param data   The data pointer passed to writeBulkData().
+   *
+   * @returns the number of bytes written into buf, at most len. When
+   * this returns less, it is called again for the rest. Returning 0
+   * aborts the transfer.
+   */
+  typedef uint16_t (*bulk_callback_t)(uint8_t *buf, uint16_t len, void *data);
+
+  /**
+   * Statistics about a transfer done by writeBulkData().
+   */
+  struct BulkResult {
+    /** Number of data bytes sent */
+    uint32_t bytes;
+    /** Number of frames sent */
+    uint16_t frames;
+    /** Duration of the transfer, in milliseconds */
+    unsigned long duration;
+
+    /** @returns the achieved throughput, in bytes per second */
+    uint32_t throughput() { return duration ? (uint64_t)bytes * 1000 / duration : 0; }
+  };
+
+  /**
+   * Write a large amount of connection data for the given cid, fetching
+   * the data from a callback a frame at a time.
+   *
+   * This is faster than repeated writeData() calls, since the module
+   * only needs the frame length after it acknowledged the start of the
+   * frame. Each frame is started before its data is available, so
+   * producing the data (e.g. reading it from flash) overlaps with
+   * waiting for the module. The callback should not talk to the module.
+   *
+   * For a UDP client connection, every frame is a separate packet.
+   *
+   * @param cid       The cid to write data to. Can be an invalid cid,
+   *                  will return false then.
+   * @param len       The total number of bytes to send.
+   * @param callback  Called to fill buf with the data of each frame.
+   * @param data      Passed to callback.
+   * @param buf       Buffer to hold a frame, its size determines the
+   *                  frame size (up to MAX_DATA_FRAME_SIZE).
+   * @param size      The size of buf.
+   * @param result    When not NULL, filled with the number of bytes
+   *                  and frames sent and the time it took.
+   *
+   * @returns true when all len bytes were sent.
+   */
+  bool writeBulkData(cid_t cid, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result = NULL);
+
+  /**
+   * Write a batch of packets for the given UDP server cid, all to the
+   * same destination, like writeBulkData() above. Every frame is a
+   * separate packet.
+   */
+  bool writeBulkData(cid_t cid, IPAddress ip, uint16_t port, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result = NULL);
+
+  /**
+   * Set the buffer used to queue data written using queueData(). Its
+   * size must be a power of two between MIN_TX_QUEUE_SIZE and
+   * MAX_TX_QUEUE_SIZE, which is checked at compile time. Any data
+   * still queued when changing the buffer is sent first.
+   *
+   * For example:
+   *
+   *   uint8_t tx_buf[1024];
+   *   gs.setTxQueue(tx_buf);
+   */
+  template <size_t N>
+  void setTxQueue(uint8_t (&tx_buf)[N]) {
+    static_assert((N & (N - 1)) == 0, "tx queue size is not a power of two");
+    static_assert(N >= MIN_TX_QUEUE_SIZE, "tx queue is too small");
+    static_assert(N <= MAX_TX_QUEUE_SIZE, "tx queue is too big");
+    setTxQueue(tx_buf, N);
+  }
+
+  /** Minimum size of a tx queue buffer */
+  static const uint16_t MIN_TX_QUEUE_SIZE = 16;
+  /** Maximum size of a tx queue buffer */
+  static const uint16_t MAX_TX_QUEUE_SIZE = 0x8000;
+
+  /**
+   * @returns true when a tx queue buffer was set using setTxQueue().
+   */
+  bool hasTxQueue() { return this->tx_queue != NULL; }
+
+  /**
+   * Queue connection data for the given cid, without waiting for the
+   * module. The data is copied into the tx queue and sent from loop(),
+   * a bit at a time whenever the module is ready for it, so a
+   * congested connection does not stall the sketch or other
+   * connections. Consecutive writes for the same cid are combined
+   * into a single frame where possible.
+   *
+   * Data queued for a cid is sent before data written afterwards using
+   * writeData(), since that first sends everything in the queue. When
+   * the module refuses a queued frame, its data is discarded and the
+   * error flag for the connection is set.
+   *
+   * This only supports TCP and UDP client connections, UDP server
+   * packets must be written using writeData().
+   *
+   * @param cid    The cid to write data to. Can be an invalid cid, will
+   *               return 0 then.
+   * @param buf    The data to send.
+   * @param len    The number of bytes to send.
+   *
+   * @returns the number of bytes that fit in the queue, which can be
+   * less than len (or 0 when no tx queue was set).
+   */
+  uint16_t queueData(cid_t cid, const uint8_t *buf, uint16_t len);
+
+  /**
+   * @returns the number of bytes that queueData() can accept for a new
+   * frame right now.
+   */
+  uint16_t txQueueFree();
+
+  /**
+   * Wait until all data queued using queueData() has been sent.
+   */
+  void flushTxQueue();
+
 /*******************************************************
  * Methods for getting connection info
  *******************************************************/
@@ -311,6 +874,11 @@ public:
     bool connected : 1;
     /** Is this connection an SSL socket */
     bool ssl : 1;
+    /**
+     * Is this connection idle in the connection pool? See
+     * GSModule::parkConnection().
+     */
+    bool parked : 1;
     /**
      * When true, an error has occurred and data was likely lost (e.g., buffer
      * overflow or connection error). The connection might still be
@@ -323,6 +891,11 @@ public:
     uint16_t local_port;
     /** Remote port number. 0 means unknown. */
     uint16_t remote_port;
+    /**
+     * For connections accepted by a TCP server, the cid of the server.
+     * INVALID_CID otherwise.
+     */
+    cid_t server_cid;
   };
 
   /**
@@ -351,6 +924,45 @@ public:
     return this->ncm_auto_cid;
   }
 
+  /**
+   * Take the oldest connection accepted by the given TCP server cid
+   * that was not taken yet. This does not send any commands, incoming
+   * connections are queued as the module reports them.
+   *
+   * @returns the cid of the connection, or INVALID_CID if there is
+   * none.
+   */
+  cid_t acceptConnection(cid_t server_cid);
+
+  /**
+   * Leave transparent data mode (see GSModule::enterTransparentMode())
+   * by sending the +++ escape sequence, returning to command mode. The
+   * connection stays open, so GSModule::enterTransparentMode() can
+   * resume it later.
+   *
+   * The module only recognizes the escape sequence with
+   * TRANSPARENT_GUARD_TIME milliseconds without data before and after
+   * it, so this takes a while. Any data received before the escape
+   * sequence is dropped.
+   *
+   * Sending any command in transparent mode calls this first, so
+   * commands never end up in the data stream.
+   *
+   * @returns true when the module is in command mode after this call.
+   */
+  bool leaveTransparentMode();
+
+  /**
+   * Returns wether transparent data mode is active. While it is, all
+   * data written and read with writeRaw() and readRaw() goes to the
+   * transparent connection, writeData() fails and queued data and
+   * commands are kept until transparent mode is left.
+   */
+  bool isTransparent() { return this->transparent; }
+
+  /** Silence needed around the +++ escape sequence, in milliseconds */
+  static const uint16_t TRANSPARENT_GUARD_TIME = 1000;
+
   /**
    * Returns wether we're currently associated to a wireless network.
    */
@@ -360,6 +972,149 @@ public:
     return this->associated;
   }
 
+/*******************************************************
+ * Methods for getting performance counters
+ *******************************************************/
+
+  /**
+   * Performance counters, to see what happens in the low level code.
+   * They are only kept when GS_STATS is enabled.
+   */
+  struct Stats {
+    /** Data bytes and frames written, per cid */
+    uint32_t tx_bytes[MAX_CID + 1];
+    uint32_t tx_frames[MAX_CID + 1];
+    /** Data bytes and frames received and buffered, per cid */
+    uint32_t rx_bytes[MAX_CID + 1];
+    uint32_t rx_frames[MAX_CID + 1];
+    /**
+     * SPI bytes read by readRaw() that did not contain any data (i.e.
+     * idle bytes and other special bytes).
+     */
+    uint32_t spi_idle_bytes;
+    /** Full SPI polls done without a data ready pin */
+    uint32_t spi_full_polls;
+    /** Full SPI polls that did not find any data */
+    uint32_t spi_idle_polls;
+    /** Times the SPI poll interval was increased, because of idle polls */
+    uint32_t spi_poll_backoffs;
+    /** Times the SPI poll interval was reset to the minimum, because of data */
+    uint32_t spi_poll_speedups;
+    /** The current SPI poll interval, in microseconds */
+    uint16_t spi_poll_interval;
+    /** Idle bytes sent by writeRaw() while waiting for XOFF to clear */
+    uint32_t xoff_stalls;
+    /** UART writes that had to wait for the module to lower RTS */
+    uint32_t cts_stalls;
+    /**
+     * Received bytes that were dropped, because rx_data was full. This
+     * includes both buffered bytes evicted to make room and incoming
+     * bytes that did not fit.
+     */
+    uint32_t rx_dropped;
+    /** Reads refused in lossless mode, because rx_data was full */
+    uint32_t rx_backpressure;
+    /** The maximum number of bytes used in rx_data at the same time */
+    uint16_t rx_high_water;
+    /**
+     * Number of data frames that could not be written, because the
+     * module did not acknowledge them.
+     */
+    uint16_t data_response_failures;
+    /** Number of <ESC>F replies received */
+    uint16_t data_fail_replies;
+    /** Number of times the module did not reply in time */
+    uint16_t response_timeouts;
+    /** Calls to queueData() that did not fit completely in the tx queue */
+    uint32_t tx_queue_full;
+    /** Config commands not sent, because the setting was unchanged */
+    uint16_t config_skipped;
+  };
+
+#if GS_STATS
+  /**
+   * Returns a copy of the current performance counters.
+   */
+  Stats getStats()
+  {
+    IrqGuard guard(*this);
+    return this->stats;
+  }
+
+  /**
+   * Reset all performance counters to zero.
+   */
+  void resetStats()
+  {
+    IrqGuard guard(*this);
+    memset(&this->stats, 0, sizeof(this->stats));
+  }
+#endif
+
+/*******************************************************
+ * Methods for tracing
+ *******************************************************/
+
+  /**
+   * Events stored in the trace ring. The values are part of the trace
+   * output format, so only add new values at the end.
+   */
+  enum TraceEvent {
+    /** Data frame written, with cid and length */
+    TRACE_TX_FRAME = 1,
+    /** UDP server data frame written, with cid and length */
+    TRACE_TX_UDP_FRAME = 2,
+    /** Command written, with length */
+    TRACE_TX_COMMAND = 3,
+    /** Data frame header read, with cid and length */
+    TRACE_RX_FRAME = 4,
+    /** UDP server data frame header read, with cid and length */
+    TRACE_RX_UDP_FRAME = 5,
+    /** <ESC>O reply read */
+    TRACE_RX_DATA_OK = 6,
+    /** <ESC>F reply read */
+    TRACE_RX_DATA_FAIL = 7,
+    /** Response line read, with length */
+    TRACE_RX_LINE = 8,
+    /** Async message read, with subtype (in the cid field) and length */
+    TRACE_RX_ASYNC = 9,
+    /** SPI XOFF received */
+    TRACE_SPI_XOFF = 10,
+    /** SPI XON received */
+    TRACE_SPI_XON = 11,
+    /** Received data dropped because rx_data was full, with cid and length */
+    TRACE_RX_DROPPED = 12,
+  };
+
+  /** A single record in the trace ring */
+  struct TraceRecord {
+    /** micros() when the event happened */
+    uint32_t time;
+    /** A TraceEvent value */
+    uint8_t event;
+    uint8_t cid;
+    uint16_t length;
+  };
+
+#if GS_TRACE
+  /**
+   * Write all records in the trace ring to the given output, oldest
+   * first, and clear the ring. Every record is written as a line of
+   * hex numbers:
+   *
+   *   GSTRACE <time> <event> <cid> <length>
+   *
+   * Records that were overwritten before being dumped are reported
+   * as:
+   *
+   *   GSTRACE lost <count>
+   *
+   * Other output can be mixed in, extras/host/tracedecode turns these
+   * lines back into the text that GS_DUMP_LINES prints.
+   */
+  void dumpTrace(Print *out);
+#endif
+
 /*******************************************************
  * Methods for writing commands / reading replies
  *******************************************************/
@@ -419,6 +1174,27 @@ public:
    */
   bool writeCommandCheckOk(const char *fmt, ...);
 
+  /**
+   * Like writeCommandCheckOk(), but for commands that only change a
+   * setting, of the form "AT<name>=<value>". When the module is known
+   * to already have this exact value (because it was reported by
+   * AT&V in begin(), or set through this method before), the command
+   * is not sent at all and true is returned.
+   *
+   * Values are compared by hash, to keep RAM usage low. Settings that
+   * the module does not report (like passphrases) are always sent
+   * the first time after begin().
+   */
+  bool writeConfigCommand(const char *fmt, ...);
+
+  /**
+   * Forget the value of the given setting (a prefix of a config
+   * command, like "AT+NCMAUTO"), so the next writeConfigCommand() for
+   * it is always sent. Pass NULL to forget all settings, which should
+   * be done when a profile is loaded.
+   */
+  void forgetConfig(const char *name);
+
   /**
    * Read a single reply from the module.
    *
@@ -487,29 +1263,146 @@ public:
   GSResponse readResponse(line_callback_t callback, void *data, cid_t *connect_cid = NULL);
 
   /**
-   * Read a single data response (e.g. <Esc>O or <Esc>F in response to a
-   * data transmission escape sequence).
+   * Called by readResponse() for every field in a line of data.
    *
-   * @returns true when <Esc>O (OK) is received, false when <Esc>F
-   * (FAILURE) is received or no reponse is received within a timeout.
+   * @param buf      The contents of the field, not NUL-terminated.
+   *                 Fields longer than MAX_FIELD_SIZE are truncated.
+   * @param len      The length of the field.
+   * @param field    The index of the field within its line.
+   * @param last     Set for the last field in a line.
+   * @param data     The data pointer passed to readResponse().
    */
-  bool readDataResponse();
+  typedef void (*field_callback_t)(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data);
 
   /**
-   * Write a raw sequence of bytes.
+   * Read a single reply from the module and call the given callback for
+   * every field in every line of data, as the data comes in. Unlike the
+   * line-based readResponse(), this needs no buffer for the entire
+   * line, so lines of any length can be processed.
    *
-   * You should not normally use this method, instead use either
-   * writeCommand() or writeData().
+   * Fields are separated by any of the given separator characters.
+   * Leading and trailing spaces are stripped from each field. When
+   * space is a separator, runs of spaces count as a single separator. Separators between double
+   * quotes are ignored, the quotes themselves are kept in the field.
+   *
+   * @param separators     The characters that separate fields.
+   * @param callback       This function is called for every field.
+   * @param data           This argument is passed to the callback every
+   *                       time.
+   * @param connect_cid    See the other readResponse() versions.
+   *
+   * Within the callback, no new commands should be sent to the module.
    */
-  void writeRaw(const uint8_t *buf, uint16_t len);
+  GSResponse readResponse(const char *separators, field_callback_t callback, void *data, cid_t *connect_cid = NULL);
+
+  /** Fields longer than this are truncated by readResponse() */
+  static const uint8_t MAX_FIELD_SIZE = 64;
 
   /**
-   * Reads a single byte from the module, or returns -1 when no byte is available.
-   *
-   * You should not normally use this method, instead use either
-   * readResponse() or readData().
+   * State for a command sent using submitCommand(). The caller owns
+   * this struct and must keep it around (and unmodified) until the
+   * command completed.
    */
-  int readRaw();
+  struct PendingCommand {
+    /**
+     * Called for every line of data in the response (e.g., that doesn't
+     * look like a known response), or NULL. Can be called from any
+     * GSCore method that reads from the module. Should not send
+     * commands.
+     */
+    line_callback_t line_callback = NULL;
+    /**
+     * Called when the command completed, or NULL. Called from loop()
+     * (or when sending a synchronous command), so it is safe to submit
+     * new commands from here.
+     */
+    void (*done_callback)(PendingCommand *cmd, void *data) = NULL;
+    /** Passed to both callbacks */
+    void *data = NULL;
+
+    /** Set to true once the command completed (e.g., for polling) */
+    bool done = true;
+    /** The final response, only valid when done is true */
+    GSResponse response = GS_UNKNOWN_RESPONSE;
+    /** The cid from a "CONNECT <CID>" response, or INVALID_CID */
+    cid_t connect_cid = INVALID_CID;
+
+    /** The next command in the queue */
+    PendingCommand *next = NULL;
+    /** Length of the command in buf */
+    uint8_t len = 0;
+    /**
+     * Holds the command until it is sent, then serves as the buffer for
+     * parsing the response.
+     */
+    uint8_t buf[MAX_DATA_LINE_SIZE];
+  };
+
+  /**
+   * Queue a command to be sent to the module, without waiting for the
+   * reply. Commands are sent one by one from loop(), which also reads
+   * and parses the replies a bit at a time, so loop() should be called
+   * often. Connection data received while a command is pending is
+   * buffered and can be read as normal.
+   *
+   * When a synchronous command is sent (e.g. using writeCommand())
+   * while commands are pending, it first waits for all pending commands
+   * to complete. end() aborts all pending commands, completing them with
+   * GS_UNRECOVERABLE_ERROR.
+   *
+   * Accepts a format string and arguments like printf, the trailing
+   * \r\n is added automatically.
+   *
+   * @param cmd   The state for the command. The callbacks and data
+   *              should be set by the caller, the other fields are
+   *              initialized by this method. Should not be pending
+   *              already.
+   *
+   * @returns true when the command was queued, false when it did not
+   * fit in cmd->buf or is still pending.
+   */
+  bool submitCommand(PendingCommand *cmd, const char *fmt, ...);
+
+  /**
+   * @returns true when commands submitted using submitCommand() are
+   * still pending.
+   */
+  bool commandsPending() { return this->commands != NULL; }
+
+  /**
+   * Read a single data response (e.g. <Esc>O or <Esc>F in response to a
+   * data transmission escape sequence).
+   *
+   * @returns true when <Esc>O (OK) is received, false when <Esc>F
+   * (FAILURE) is received or no reponse is received within a timeout.
+   */
+  bool readDataResponse();
+
+  /**
+   * Write a raw sequence of bytes.
+   *
+   * You should not normally use this method, instead use either
+   * writeCommand() or writeData().
+   */
+  void writeRaw(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Reads a single byte from the module, or returns -1 when no byte is available.
+   *
+   * You should not normally use this method, instead use either
+   * readResponse() or readData().
+   */
+  int readRaw();
+
+  /**
+   * Reads up to len bytes from the module, without blocking.
+   *
+   * You should not normally use this method, instead use either
+   * readResponse() or readData().
+   *
+   * @returns the number of bytes read.
+   */
+  uint16_t readRaw(uint8_t *buf, uint16_t len);
 
 /*******************************************************
  * Helper methods
@@ -528,6 +1421,51 @@ public:
    */
   static bool parseIpAddress(IPAddress *ip, const char *str, uint16_t len = 0);
 
+  /**
+   * Size of a buffer that can hold any ip address written by
+   * formatIpAddress(), including the trailing 0.
+   */
+  static const uint8_t IP_STRING_SIZE = 16;
+
+  /**
+   * Write an ip address in dotted quad notation, followed by a trailing
+   * 0.
+   *
+   * @param buf    The buffer to write to, which must be at least
+   *               IP_STRING_SIZE bytes.
+   * @param ip     The address to write.
+   * @returns the number of characters written, excluding the trailing
+   *          0.
+   */
+  static uint8_t formatIpAddress(char *buf, const IPAddress &ip);
+
+  /**
+   * Write a number, without a trailing 0.
+   *
+   * @param buf    The buffer to write to, which must be big enough to
+   *               hold all digits (or width bytes, if that is more).
+   * @param value  The number to write.
+   * @param base   The base to use (2 - 16). Digits above 9 are written
+   *               in lowercase.
+   * @param width  The minimum number of digits to write, padding with
+   *               zeroes when needed.
+   * @returns the number of characters written.
+   */
+  static uint8_t formatNumber(char *buf, uint32_t value, uint8_t base = 10, uint8_t width = 0);
+
+  /**
+   * A minimal vsnprintf replacement, which only supports the
+   * conversions used for commands: %s, %c, %d, %i, %u and %x (with an
+   * optional l length modifier and 0-padded width) and %%.
+   *
+   * Like vsnprintf, this writes at most size - 1 characters and a
+   * trailing 0.
+   *
+   * @returns the number of characters the complete result would be,
+   *          excluding the trailing 0.
+   */
+  static size_t formatString(char *buf, size_t size, const char *fmt, va_list args);
+
 /*******************************************************
  * Internal helper methods
  *******************************************************/
@@ -558,6 +1496,59 @@ protected:
    */
   bool _begin();
 
+  /**
+   * While an instance of this class exists, the data ready interrupt
+   * does not touch the module or any of our state, but only remembers
+   * that data is pending. That data is read when the last IrqGuard goes
+   * away. All public methods that touch the module or the receive
+   * buffer should create one.
+   */
+  class IrqGuard {
+  public:
+    IrqGuard(GSCore &gs) : gs(gs) { ++gs.busy; }
+    ~IrqGuard() { if (--gs.busy == 0 && gs.rx_irq_pending) gs.drainModule(); }
+  private:
+    GSCore &gs;
+  };
+
+  /**
+   * Attach the data ready interrupt for this instance.
+   *
+   * @returns true when succesful, false when the data ready pin does
+   *          not support interrupts or all slots are taken.
+   */
+  bool attachRxInterrupt();
+
+  /**
+   * Detach the data ready interrupt, if it was attached.
+   */
+  void detachRxInterrupt();
+
+  /**
+   * Called by the data ready interrupt.
+   */
+  void handleRxInterrupt();
+
+  /**
+   * Read all data available from the module into the receive buffer.
+   * Does nothing while a command reply is expected, since that should
+   * be read by readResponse instead, or while the SPI bus is claimed
+   * (see claimSpiBus()).
+   */
+  void drainModule();
+
+  /**
+   * Called after data was consumed from rx_data. In lossless mode,
+   * makes sure that data left in the module because rx_data was full
+   * is drained again once the caller is done.
+   */
+  void resumeDrain();
+
+  /** The instance using each of the data ready interrupt slots */
+  static GSCore *rx_irq_instances[MAX_RX_INTERRUPTS];
+  static void rxInterrupt0();
+  static void rxInterrupt1();
+
   /**
    * Processes special characters in the given byte, as received through
    * SPI. Returns the original byte, or -1 when there is none.
@@ -571,9 +1562,43 @@ protected:
   bool isSpiSpecial(uint8_t c);
 
   /**
-   * Send and receive a single SPI byte.
+   * Send and receive a block of SPI bytes. Every byte in buf is sent
+   * and replaced by the byte received in its place.
+   *
+   * When the module sends XOFF, the transfer stops early (but never
+   * halfway an escape sequence), so no further data is sent to a module
+   * that has no room for it.
+   *
+   * @returns the number of bytes actually transferred. Any bytes after
+   *          that are still in buf unmodified.
    */
-  uint8_t transferSpi(uint8_t c);
+  uint8_t transferSpi(uint8_t *buf, uint8_t len);
+
+  /**
+   * Claim the bus and start an SPI transaction for a single burst
+   * to the module.
+   */
+  void beginSpiBurst();
+
+  /**
+   * End the SPI transaction started by beginSpiBurst() and release the
+   * bus again, serving any other instances that were waiting for it.
+   */
+  void endSpiBurst();
+
+  /**
+   * Un-escape a block of bytes received through SPI in-place, removing
+   * any special characters (after processing them).
+   *
+   * @returns the number of data bytes left in buf.
+   */
+  uint8_t processSpiSpecial(uint8_t *buf, uint8_t len);
+
+  /**
+   * Pass any bytes still in spi_rx_buf to processIncoming, so data
+   * received later can be processed without reordering.
+   */
+  void flushSpiRx();
 
   /**
    * Processes an incoming byte read from the module.
@@ -586,9 +1611,22 @@ protected:
   bool processIncoming(int c);
 
   /**
-   * Put an incoming data byte into rx_data.
+   * Processes a block of incoming bytes read from the module.
    */
-  void bufferIncomingData(uint8_t c);
+  void processIncoming(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Put incoming data bytes for head_frame into rx_data.
+   */
+  void bufferIncomingData(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Read a block of bytes from the module and process them, without
+   * blocking.
+   *
+   * @returns the number of bytes processed.
+   */
+  uint16_t readAndProcessBlock();
 
   /**
    * Puts a frame header into rx_data.
@@ -596,18 +1634,171 @@ protected:
   void bufferFrameHeader(const RXFrame *frame);
 
   /**
-   * Loads a frame header from rx_data. Should not be called when
-   * rx_data is empty.
+   * Create a new instance using the given buffer for received data.
+   * The size must be a power of two.
    */
-  void loadFrameHeader(RXFrame *frame);
+  GSCore(uint8_t *rx_buf, uint16_t rx_size);
 
   /**
-   * Get the next data byte, without blocking. The frame is loaded
-   * either from rx_data or by querying the module.
+   * Header of a frame in rx_data. It is stored in front of the data of
+   * every frame in a packed form of RX_HEADER_SIZE bytes, followed by
+   * the address for UDP server frames only:
+   *
+   *   byte 0:        cid in the lower four bits, combined with the
+   *                  RX_FLAG_* values. For short frames, bit 7 is bit 8
+   *                  of the length.
+   *   byte 1:        lower 8 bits of the length
+   *   byte 2:        for long frames only, upper 8 bits of the length
+   *   4 + 2 bytes:   for UDP server frames only, ip and port
+   *
+   * Like the data, the packed header can wrap around the end of
+   * rx_data.
+   */
+  struct RXHeader {
+    cid_t cid;
+    /** Combination of RX_FLAG_* values */
+    uint8_t flags;
+    /** The number of data bytes stored behind this header */
+    uint16_t length;
+    /* IP address for UDP server frames only */
+    uint32_t ip;
+    /* Port for UDP server frames only */
+    uint16_t port;
+  };
+
+  /** Set in RXHeader::flags for UDP server frames */
+  static const uint8_t RX_FLAG_UDP_SERVER = 0x10;
+  /** Set in RXHeader::flags when all data of a frame was read */
+  static const uint8_t RX_FLAG_DONE = 0x20;
+  /**
+   * Set in RXHeader::flags when the length is stored in two bytes, for
+   * frames longer than RX_SHORT_LENGTH_MAX. Fixed when the frame is
+   * created, so the header size does not change.
+   */
+  static const uint8_t RX_FLAG_LONG = 0x40;
+  /** Bit 8 of the length of a short frame, in the packed header only */
+  static const uint8_t RX_PACKED_LENGTH_BIT8 = 0x80;
+  /** The longest frame that can use a short header */
+  static const uint16_t RX_SHORT_LENGTH_MAX = 0x1ff;
+  /** The size of the address in a packed UDP server header */
+  static const uint8_t RX_HEADER_ADDRESS_SIZE = sizeof(uint32_t) + sizeof(uint16_t);
+  /** The biggest size of a packed header */
+  static const uint8_t MAX_RX_HEADER_SIZE = 3 + RX_HEADER_ADDRESS_SIZE;
+
+  /**
+   * @returns the size of the packed header in rx_data.
+   */
+  static uint8_t rxHeaderSize(uint8_t flags) {
+    return 2 + ((flags & RX_FLAG_LONG) ? 1 : 0) + ((flags & RX_FLAG_UDP_SERVER) ? RX_HEADER_ADDRESS_SIZE : 0);
+  }
+
+  typedef uint16_t rx_data_index_t;
+  /** Value for rx_data indices that do not point to a frame */
+  static const rx_data_index_t RX_NO_FRAME = 0xffff;
+
+  /**
+   * Wrap an (overflowing) offset into rx_data.
+   */
+  rx_data_index_t rxIndex(uint16_t i) { return i & this->rx_data_mask; }
+
+  /**
+   * @returns the size of rx_data.
+   */
+  uint16_t rxSize() { return this->rx_data_mask + 1; }
+
+  /**
+   * @returns the number of bytes that can be written into rx_data.
+   */
+  uint16_t rxFree() { return rxIndex(this->rx_data_tail - this->rx_data_head - 1); }
+
+  /**
+   * Update the rx_high_water performance counter, if enabled.
+   */
+  void updateHighWater() {
+#if GS_STATS
+    uint16_t used = rxSize() - 1 - rxFree();
+    if (used > this->stats.rx_high_water)
+      this->stats.rx_high_water = used;
+#endif
+  }
+
+  /**
+   * Add a record to the trace ring, if the given GS_TRACE_* category
+   * is enabled.
+   */
+  void trace(uint8_t category, TraceEvent event, cid_t cid, uint16_t length) {
+#if GS_TRACE
+    if (GS_TRACE & category)
+      addTraceRecord(event, cid, length);
+#endif
+  }
+
+#if GS_TRACE
+  void addTraceRecord(TraceEvent event, cid_t cid, uint16_t length);
+#endif
+
+  /**
+   * @returns the offset of the header following the given header.
+   */
+  rx_data_index_t nextFrame(rx_data_index_t pos, const RXHeader *header) { return rxIndex(frameData(pos, header) + header->length); }
+
+  /**
+   * @returns the offset of the first data byte of the given frame.
+   */
+  rx_data_index_t frameData(rx_data_index_t pos, const RXHeader *header) { return rxIndex(pos + rxHeaderSize(header->flags)); }
+
+  /**
+   * Loads a frame header from the given offset in rx_data.
+   */
+  void loadFrameHeader(rx_data_index_t pos, RXHeader *header);
+
+  /**
+   * Stores a frame header at the given offset in rx_data.
+   */
+  void storeFrameHeader(rx_data_index_t pos, const RXHeader *header);
+
+  /**
+   * @returns the number of bytes in rx_data that can be read for the
+   * given (valid) cid without involving the module.
+   */
+  uint16_t bufferedData(cid_t cid);
+
+  /**
+   * Get the next contiguous block of data in rx_data for the given
+   * (valid) cid, without involving the module.
+   *
+   * @returns the number of bytes available at *buf.
+   */
+  uint16_t bufferedBlock(cid_t cid, const uint8_t **buf);
+
+  /**
+   * Called when the last byte of the frame the module is sending was
+   * received.
+   */
+  void headFrameComplete();
+
+  /**
+   * Called when the current frame for the given cid is fully read.
+   * Marks it as done, finds the next frame for the cid and releases the
+   * space for done frames at the tail of rx_data.
+   */
+  void finishFrame(cid_t cid);
+
+  /**
+   * Get the next data byte for the given (valid) cid, without
+   * blocking. The data is read either from rx_data or, if the module is
+   * still sending the current frame for this cid, from the module
+   * directly.
    *
    * @returns the data byte, or -1 when no data is available.
    */
-  int getData();
+  int getData(cid_t cid);
+
+  /**
+   * Implementation of readData(cid_t, uint8_t*, size_t) and skipData().
+   * When buf is NULL, data is skipped instead of read.
+   */
+  size_t readOrSkipData(cid_t cid, uint8_t *buf, size_t size);
 
   /**
    * Read and process any async responses available.
@@ -615,10 +1806,20 @@ protected:
   void readAndProcessAsync();
 
   /**
-   * Drop a byte from the tail of rx_data, to make room for incoming
-   * data and mark the affected cid as broken.
+   * Make room for at least num_bytes in rx_data for incoming data. This
+   * first releases space of data already read, and then drops unread
+   * data from the oldest frame(s), marking the affected cids as broken.
+   *
+   * @returns true when enough space is available, false when not even
+   * dropping data could free up enough space.
    */
-  void dropData(uint8_t num_bytes);
+  bool dropData(uint16_t num_bytes);
+
+  /**
+   * Release the space of data already read from the frame at the tail
+   * of rx_data, by moving its header forward.
+   */
+  void releaseReadData();
 
   /**
    * Internal version of readResponse.
@@ -641,6 +1842,101 @@ protected:
    */
   GSResponse readResponseInternal(uint8_t *buf, uint16_t *len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data);
 
+  /** State for parsing a response a byte at a time */
+  struct ResponseParser {
+    uint8_t *buf;
+    uint16_t size;
+    uint16_t read;
+    uint16_t line_start;
+    bool dropped_data;
+    bool skip_line;
+    bool keep_data;
+    cid_t *connect_cid;
+    line_callback_t callback;
+    void *data;
+
+    // When set, lines are split into fields by parseField() instead,
+    // using buf for the current field
+    field_callback_t field_callback;
+    const char *separators;
+    /** Length of the current line, up to MAX_RESPONSE_SIZE + 1 */
+    uint8_t line_len;
+    /** Index of the current field in the line */
+    uint8_t field;
+    /** Is the current field inside double quotes? */
+    bool quoted;
+    /** Was the current field followed by a space separator? */
+    bool space_pending;
+  };
+
+  /**
+   * Read a reply using the given parser, taking care of the data ready
+   * interrupt bookkeeping.
+   */
+  GSResponse readResponseInternal(ResponseParser *parser);
+
+  /**
+   * Does the actual reading for readResponseInternal.
+   */
+  GSResponse readResponseLines(ResponseParser *parser);
+
+  /**
+   * parseResponse() for a parser with a field_callback.
+   */
+  GSResponse parseField(ResponseParser *parser, uint8_t c);
+
+  /**
+   * Add a byte to the current field in parseField(), passing the field
+   * to the callback when it is complete.
+   */
+  void addFieldByte(ResponseParser *parser, uint8_t c);
+
+  /** Pass the current field to the callback and start a new one */
+  void finishField(ResponseParser *parser, bool last);
+
+  /**
+   * Prepare a parser for reading a new response.
+   *
+   * @see readResponseInternal for the parameters.
+   */
+  void initResponseParser(ResponseParser *parser, uint8_t *buf, uint16_t size, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data);
+
+  /**
+   * Parse a single byte of response (e.g., not connection data or an
+   * async response).
+   *
+   * @returns the code for the final response line once it is complete,
+   * or GS_UNKNOWN_RESPONSE when the response is not complete yet.
+   * parser->read is the amount of data kept in the buffer.
+   */
+  GSResponse parseResponse(ResponseParser *parser, uint8_t c);
+
+  /**
+   * Format a command into the given buffer, including the trailing
+   * \r\n.
+   *
+   * @returns the length of the command, or 0 when it did not fit.
+   */
+  uint8_t formatCommand(uint8_t *buf, uint8_t size, const char *fmt, va_list args);
+
+  /**
+   * Send the next command from the queue when possible, check for
+   * timeouts and call the done callback for a completed command.
+   */
+  void processCommands();
+
+  /**
+   * Block until all commands submitted using submitCommand() are
+   * completed.
+   */
+  void waitForCommands();
+
+  /**
+   * Complete all pending commands with the given response, without
+   * waiting for the module.
+   */
+  void abortCommands(GSResponse res);
+
   /**
    * Look at the given response line and find out what kind of reponse
    * it is.
@@ -729,23 +2025,71 @@ protected:
    */
   static const uint8_t MAX_ASYNC_RESPONSE_SIZE = 27;
 
-  // TODO: How big should this buffer be?
-  static const uint16_t RX_DATA_BUF_SIZE = 512;
-
   /** The serial port to use, in serial mode */
   Stream *serial = NULL;
   /** The slave select pin to use, in SPI mode */
   uint8_t ss_pin = INVALID_PIN;
   /** The data_ready pin to use, in SPI mode */
   uint8_t data_ready_pin = INVALID_PIN;
+#ifdef SPI_HAS_TRANSACTION
+  /** The SPI settings used for every burst, see setSpiSettings() */
+  SPISettings spi_settings = SPISettings(DEFAULT_SPI_CLOCK, MSBFIRST, SPI_MODE0);
+#endif
+  /**
+   * Number of claims on the SPI bus, by claimSpiBus() or by an SPI
+   * burst in progress. Shared by all instances.
+   */
+  static volatile uint8_t spi_bus_claims;
   /** When true, the module has sent xoff */
   bool spi_xoff;
   /** When true, the previous SPI byte was an escape character */
   bool spi_prev_was_esc;
 
+  /**
+   * The maximum number of bytes exchanged with the module in a single
+   * SPI block transfer.
+   */
+  static const uint8_t SPI_BLOCK_SIZE = 16;
+
+  /**
+   * Data bytes (already un-escaped) received by readRaw() in a block
+   * transfer, but not returned yet.
+   */
+  uint8_t spi_rx_buf[SPI_BLOCK_SIZE];
+  /** How many bytes readAndProcessBlock() reads at once from a UART */
+  static const uint8_t UART_BLOCK_SIZE = 32;
+  /** Number of bytes in spi_rx_buf */
+  uint8_t spi_rx_len;
+  /** Offset of the next byte in spi_rx_buf to return */
+  uint8_t spi_rx_pos;
+
   /** True when inside begin() */
   bool initializing = false;
 
+  /**
+   * The data ready interrupt slot used by this instance, or
+   * INVALID_PIN when not using the interrupt.
+   */
+  uint8_t rx_irq_slot = INVALID_PIN;
+  /** Number of IrqGuard instances currently alive */
+  volatile uint8_t busy = 0;
+  /** Set when the data ready interrupt triggered while busy */
+  volatile bool rx_irq_pending = false;
+  /**
+   * Set after writing a command, until its reply has been read. While
+   * set, the data ready interrupt leaves the data in the module.
+   */
+  volatile bool response_pending = false;
+
+  /** Commands submitted using submitCommand(), oldest first */
+  PendingCommand *commands = NULL;
+  /** Was the oldest command in commands sent already? */
+  bool command_sent = false;
+  /** When the oldest command in commands was sent (in millis) */
+  unsigned long command_start;
+  /** Parser for the reply to the oldest command in commands */
+  ResponseParser command_parser;
+
   /**
    * When no data_ready pin is available, this is the (lower 16 bits of)
    * the microseconds timestamp when the last poll was done.
@@ -754,10 +2098,208 @@ protected:
 
   /**
    * When no data_ready pin is available, we need to poll. Make sure
-   * that when readRaw() will stall for the full 64-byte poll at most
-   * once during this this number of microseconds (and if readRaw() is
-   * called often, it should never stall at all). */
-  static const uint16_t MINIMUM_POLL_INTERVAL = 10000;
+   * that readRaw() will stall for a full poll at most once during
+   * this number of microseconds (and if readRaw() is called often, it
+   * should never stall at all). This changes between spi_poll_min and
+   * spi_poll_max, depending on traffic.
+   */
+  uint16_t spi_poll_interval;
+  uint16_t spi_poll_min = DEFAULT_MIN_POLL_INTERVAL;
+  uint16_t spi_poll_max = DEFAULT_MAX_POLL_INTERVAL;
+
+  /**
+   * The number of bytes to read before concluding the module has no
+   * data, since it fills up its SPI buffer with 63 idle bytes when idle.
+   */
+  static const uint8_t SPI_FULL_POLL = 64;
+
+  /** Is lossless receive mode enabled? */
+  bool rx_lossless = false;
+
+  /** The pin connected to the module's CTS pin, or INVALID_PIN */
+  uint8_t rts_pin = INVALID_PIN;
+  /** Is rts_pin currently telling the module to stop? */
+  bool rts_stopped = false;
+  /** The pin connected to the module's RTS pin, or INVALID_PIN */
+  uint8_t cts_pin = INVALID_PIN;
+
+  /** Is transparent data mode active? */
+  bool transparent = false;
+  /**
+   * Was transparent mode left with the connection still open, so it
+   * can be resumed with ATO?
+   */
+  bool transparent_suspended = false;
+
+  /**
+   * Wait until cts_pin allows sending, if it is set.
+   *
+   * @returns false when the module did not allow sending within
+   *          RESPONSE_TIMEOUT.
+   */
+  bool waitForCts();
+
+  /**
+   * Check that the module answers an AT command within
+   * LINK_PROBE_TIMEOUT milliseconds, trying a few times. Any data
+   * received in the meanwhile is discarded, so this should only be
+   * used when no data is expected (e.g. after changing the baud rate).
+   */
+  bool probeLink();
+
+  /** How long probeLink() waits for a reply, in milliseconds */
+  static const uint16_t LINK_PROBE_TIMEOUT = 100;
+  /** How many times probeLink() sends a probe */
+  static const uint8_t LINK_PROBE_TRIES = 3;
+
+  /**
+   * Read and drop everything the module sends for the given number of
+   * milliseconds.
+   */
+  void discardRaw(uint16_t time);
+
+  /**
+   * When fewer bytes than this can be read in lossless mode, rts_pin
+   * tells the module to stop sending.
+   */
+  static const uint8_t RTS_THRESHOLD = 2 * UART_BLOCK_SIZE;
+
+  /**
+   * In lossless mode, calculate how many bytes can be read from the
+   * module without having to drop data and update rts_pin.
+   *
+   * @returns the number of bytes, or 0xffff when reading is not
+   *          limited.
+   */
+  uint16_t readLimit();
+
+  /**
+   * Tell the module (not) to stop sending, if rts_pin is set.
+   */
+  void setRts(bool stop);
+
+  /**
+   * Header stored in tx_queue in front of the data of every frame.
+   */
+  struct TXHeader {
+    cid_t cid;
+    /** The number of data bytes stored behind this header */
+    uint16_t length;
+  };
+
+  enum TXState {
+    /** No frame is being sent */
+    GS_TX_IDLE,
+    /** Sending <ESC>Z<cid> for the frame at the tail of tx_queue */
+    GS_TX_PREFIX,
+    /** Sent <ESC>Z<cid>, waiting for <ESC>O or <ESC>F */
+    GS_TX_WAIT_ACK,
+    /** Received <ESC>O for the frame at the tail of tx_queue */
+    GS_TX_ACKED,
+    /** Received <ESC>F for the frame at the tail of tx_queue */
+    GS_TX_FAILED,
+    /** Sending the data of the frame at the tail of tx_queue */
+    GS_TX_SENDING,
+  };
+
+  /**
+   * Buffer for data written using queueData(), containing a sequence of
+   * frames, each a TXHeader followed by data. The oldest frame starts
+   * at tx_queue_tail, new data is added at tx_queue_head. NULL when no
+   * queue is used.
+   */
+  uint8_t *tx_queue = NULL;
+  /** Size of tx_queue minus one, for efficient wrapping */
+  uint16_t tx_queue_mask = 0;
+  uint16_t tx_queue_head = 0;
+  uint16_t tx_queue_tail = 0;
+  /** Offset of the newest frame header in tx_queue */
+  uint16_t tx_queue_last = 0;
+  /** State of the frame at tx_queue_tail */
+  TXState tx_state = GS_TX_IDLE;
+  /**
+   * Number of bytes of the oldest frame sent already. In GS_TX_PREFIX,
+   * this counts bytes of <ESC>Z<cid>, in GS_TX_SENDING this counts the
+   * length digits and data.
+   */
+  uint16_t tx_sent = 0;
+  /** When the oldest frame was started (in millis) */
+  unsigned long tx_start;
+
+  void setTxQueue(uint8_t *tx_buf, uint16_t tx_size);
+
+  /** Wrap an (overflowing) offset into tx_queue. */
+  uint16_t txIndex(uint16_t i) { return i & this->tx_queue_mask; }
+
+  /** Copy data into tx_queue at the given offset, wrapping as needed */
+  void copyToTxQueue(uint16_t pos, const void *buf, uint16_t len);
+
+  /** Copy data out of tx_queue at the given offset, wrapping as needed */
+  void copyFromTxQueue(uint16_t pos, void *buf, uint16_t len);
+
+  /**
+   * Make progress sending the frames in tx_queue, without waiting for
+   * the module. Called from loop().
+   *
+   * @param start   When false, only the frame already being sent is
+   *                continued.
+   */
+  void processTxQueue(bool start = true);
+
+  /**
+   * Wait until the frame currently being sent from tx_queue (if any) is
+   * complete, so something else can be written to the module.
+   */
+  void finishTxFrame();
+
+  /**
+   * Size of a buffer that can hold any frame header written by
+   * formatFrameHeader().
+   */
+  static const uint8_t MAX_FRAME_HEADER_SIZE = 3 + IP_STRING_SIZE + 6 + 5;
+
+  /**
+   * Write the escape sequence that starts a data frame.
+   *
+   * @param buf   The buffer to write to, at least MAX_FRAME_HEADER_SIZE
+   *              bytes.
+   * @param ip    The destination for a UDP server frame, or NULL for a
+   *              normal frame.
+   *
+   * @returns the number of bytes written. The first three bytes
+   * (<ESC>Z<cid> or <ESC>Y<cid>) must be acknowledged by the module
+   * before sending the rest.
+   */
+  static uint8_t formatFrameHeader(uint8_t *buf, cid_t cid, const IPAddress *ip, uint16_t port, uint16_t len);
+
+  bool writeBulkData(cid_t cid, const IPAddress *ip, uint16_t port, uint32_t len, bulk_callback_t callback, void *data, uint8_t *buf, uint16_t size, BulkResult *result);
+
+  /**
+   * @returns the total length of the given chunks, or 0xffff when that
+   * does not fit.
+   */
+  static uint16_t chunksLength(const GSChunk *chunks, uint8_t num_chunks);
+
+  /**
+   * Write the data of all given chunks using writeRaw().
+   */
+  void writeChunks(const GSChunk *chunks, uint8_t num_chunks);
+
+  /**
+   * Write as many bytes as the module accepts right now, without
+   * waiting for XON (SPI) or CTS (UART). With a UART without a CTS
+   * pin, this writes all bytes.
+   *
+   * @returns the number of bytes written.
+   */
+  uint16_t writeRawNonBlocking(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Update spi_poll_interval after a poll without a data ready pin:
+   * reset it to the minimum when data was received and back off
+   * exponentially after every full poll that found nothing.
+   */
+  void adaptPollInterval(bool full_poll, bool got_data);
 
   /**
    * Buffer for an (incomplete) asynchronous response, received while no
@@ -778,8 +2320,12 @@ protected:
    * (e.g., when we can't return this connection data to the
    * application).
    */
-  uint8_t rx_data[RX_DATA_BUF_SIZE];
-  typedef uint16_t rx_data_index_t;
+  uint8_t *rx_data;
+  /**
+   * The size of rx_data minus one. Since the size is a power of two,
+   * ANDing with this wraps an offset into rx_data.
+   */
+  rx_data_index_t rx_data_mask;
 
   /** Current state for the data stream read from the module */
   RXState rx_state;
@@ -797,23 +2343,152 @@ protected:
   RXFrame head_frame;
 
   /**
-   * Data for the frame currently being read from the data buffer.
-   * Length indicates the number of bytes left to read from the data
-   * buffer.
+   * The offset into rx_data of the header for head_frame, or
+   * RX_NO_FRAME when no frame is being received.
    */
-  RXFrame tail_frame;
+  rx_data_index_t head_header = RX_NO_FRAME;
+
+  /** Read state for a single cid */
+  struct RXCidState {
+    /**
+     * The offset into rx_data of the header of the oldest frame for
+     * this cid that was not completely read, or RX_NO_FRAME.
+     */
+    rx_data_index_t frame;
+    /** The number of data bytes behind that header already read. */
+    uint16_t read;
+  };
+
+  /** Read state for each cid. */
+  RXCidState rx_cids[MAX_CID + 1];
 
   ConnectionInfo connections[MAX_CID + 1];
 
+#if GS_STATS
+  Stats stats;
+#endif
+
+#if GS_TRACE
+  /** The trace ring */
+  TraceRecord trace_ring[GS_TRACE_SIZE];
+  /** Index of the oldest record in trace_ring */
+  uint8_t trace_first;
+  /** Number of records in trace_ring */
+  uint8_t trace_len;
+  /** Number of records overwritten since the last dump */
+  uint16_t trace_lost;
+#endif
+
   /**
    * The cid of the automatic connection created by the network
    * connection manager, if known.
    */
   uint8_t ncm_auto_cid;
 
+  /**
+   * Connections accepted by TCP servers but not taken by
+   * acceptConnection() yet, oldest first. Every cid is in here at most
+   * once, so this never overflows.
+   */
+  cid_t accept_queue[MAX_CID + 1];
+  /** Number of cids in accept_queue */
+  uint8_t accept_len = 0;
+
+  /** Handlers set through setConnectionHandlers() */
+  struct ConnectionHandlers {
+    data_handler_t onData;
+    disconnect_handler_t onDisconnect;
+    void *data;
+  };
+
+  ConnectionHandlers handlers[MAX_CID + 1];
+  /**
+   * Bitmask of cids that were disconnected, but whose onDisconnect
+   * handler was not called yet.
+   */
+  uint16_t disconnect_events = 0;
+
+  static_assert(MAX_CID < 16, "disconnect_events is too small");
+
+  /**
+   * Call the connection handlers for any buffered data and
+   * disconnections, from loop().
+   */
+  void dispatchConnectionHandlers();
+
+  /**
+   * Get info about the frame with its header at the given position.
+   */
+  RXFrame frameAt(rx_data_index_t pos);
+
+  /**
+   * Remove the entry at the given index from accept_queue.
+   */
+  void removeAccepted(uint8_t i);
+
   /** Are we associated? */
   uint8_t associated;
 
+#if GS_WARM_START
+  struct ConfigEntry {
+    /** Hash of the setting name, including the leading + */
+    uint16_t name;
+    /**
+     * Hash of the value. This uses the full 32 bits, since a collision
+     * would cause a changed value to not be sent.
+     */
+    uint32_t value;
+  };
+
+  /** Settings with known values, see writeConfigCommand() */
+  ConfigEntry config[MAX_CONFIG_ENTRIES];
+  /** Number of entries in config */
+  uint8_t config_len = 0;
+
+  /**
+   * Find the setting with the given name hash.
+   *
+   * @returns the entry, or NULL if the value is unknown.
+   */
+  ConfigEntry *findConfig(uint16_t name);
+
+  /**
+   * Remember the value of the setting in the given "<name>=<value>"
+   * string (without the leading "AT").
+   */
+  void storeConfig(const char *setting, uint8_t len);
+
+  /**
+   * Find the name and value hashes for the given "<name>=<value>"
+   * string.
+   *
+   * @returns false if there is no '=' in the string.
+   */
+  static bool hashConfig(const char *setting, uint8_t len, uint16_t *name, uint32_t *value);
+
+  /**
+   * Field callbacks for the AT+NSTAT=? and AT&V queries in _begin().
+   */
+  static void parseStatusField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data);
+  static void parseConfigField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data);
+#endif // GS_WARM_START
+
+  /** Hash of the SSID we are associated to, if associated */
+  uint32_t associated_ssid = 0;
+
+  /**
+   * Hash a string. Used to remember configuration without having to
+   * store all of it.
+   */
+  static uint32_t hash(const char *buf, uint8_t len);
+
+  /**
+   * Incremented on every disassociation, so subclasses can tell
+   * whether state they cached (like DNS results) is from the current
+   * association.
+   */
+  uint8_t disassociations = 0;
+
   /** This byte is sent when there is no real data */
   static const uint8_t SPI_SPECIAL_IDLE = 0xf5;
   /** Indicates the buffer is full and no further data should be sent */
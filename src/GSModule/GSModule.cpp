@@ -24,16 +24,22 @@
  * SOFTWARE.
  */
 
+#include <Arduino.h>
 #include "GSModule.h"
 #include "util.h"
 
 GSCore::cid_t GSModule::connectTcp(const IPAddress& ip, uint16_t port)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  writeCommand("AT+NCTCP=%s,%d", buf, port);
+  char buf[IP_STRING_SIZE];
+  formatIpAddress(buf, ip);
   cid_t cid = INVALID_CID;
-  if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
+  GSResponse res;
+  do {
+    writeCommand("AT+NCTCP=%s,%d", buf, port);
+    res = readResponse(&cid);
+  } while (makeRoomForCid(res));
+
+  if (res != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
   processConnect(cid, ip, port, 0, false);
@@ -43,11 +49,16 @@ GSCore::cid_t GSModule::connectTcp(const IPAddress& ip, uint16_t port)
 
 GSCore::cid_t GSModule::connectUdp(const IPAddress& ip, uint16_t port, uint16_t local_port)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  writeCommand("AT+NCUDP=%s,%d", buf, port);
+  char buf[IP_STRING_SIZE];
+  formatIpAddress(buf, ip);
   cid_t cid = INVALID_CID;
-  if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
+  GSResponse res;
+  do {
+    writeCommand("AT+NCUDP=%s,%d", buf, port);
+    res = readResponse(&cid);
+  } while (makeRoomForCid(res));
+
+  if (res != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
   processConnect(cid, ip, port, local_port, false);
@@ -55,11 +66,33 @@ GSCore::cid_t GSModule::connectUdp(const IPAddress& ip, uint16_t port, uint16_t
   return cid;
 }
 
+GSCore::cid_t GSModule::listenTcp(uint16_t port)
+{
+  cid_t cid = INVALID_CID;
+  GSResponse res;
+  do {
+    writeCommand("AT+NSTCP=%u", port);
+    res = readResponse(&cid);
+  } while (makeRoomForCid(res));
+
+  if (res != GS_SUCCESS || cid > MAX_CID)
+    return INVALID_CID;
+
+  processConnect(cid, 0, 0, port, false);
+
+  return cid;
+}
+
 GSCore::cid_t GSModule::listenUdp(uint16_t port)
 {
-  writeCommand("AT+NSUDP=%u",port);
   cid_t cid = INVALID_CID;
-  if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
+  GSResponse res;
+  do {
+    writeCommand("AT+NSUDP=%u",port);
+    res = readResponse(&cid);
+  } while (makeRoomForCid(res));
+
+  if (res != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
 
   processConnect(cid, 0, 0, port, false);
@@ -67,11 +100,76 @@ GSCore::cid_t GSModule::listenUdp(uint16_t port)
   return cid;
 }
 
+const uint32_t GSModule::BAUD_RATES[] = {921600, 460800, 230400, 115200, 57600, 38400, 19200, 9600};
+
+bool GSModule::beginBaudRateChange(Stream &serial, uint32_t baud)
+{
+  if (&serial != this->serial)
+    return false;
+
+  // Don't leave queued data behind at the old baud rate
+  flushTxQueue();
+
+  if (this->rts_pin != INVALID_PIN && !writeCommandCheckOk("AT&K1"))
+    return false;
+
+  // The module replies at the old baud rate and then switches
+  if (!writeCommandCheckOk("ATB=%lu", (unsigned long)baud))
+    return false;
+
+  serial.flush();
+  delay(BAUD_SWITCH_DELAY);
+  return true;
+}
+
+bool GSModule::finishBaudRateChange(int8_t save_profile)
+{
+  if (!probeLink())
+    return false;
+
+  if (save_profile >= 0 && !saveProfile(save_profile)) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println(F("Failed to save baud rate"));
+  }
+  return true;
+}
+
+void GSModule::abortBaudRateChange(uint32_t baud)
+{
+  char buf[16] = "ATB=";
+  uint8_t len = 4 + formatNumber(buf + 4, baud);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  // The module might just not be able to talk back, so it might
+  // still understand us. Send twice, in case the first is garbled.
+  for (uint8_t i = 0; i < 2; ++i) {
+    writeRaw((const uint8_t*)buf, len);
+    this->serial->flush();
+    delay(BAUD_SWITCH_DELAY);
+  }
+}
+
+void GSModule::checkBaudRateAborted()
+{
+  if (!probeLink() && GS_LOG_ERRORS && this->error)
+    this->error->println(F("Module lost after baud rate change"));
+}
+
 bool GSModule::associate(const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
 {
+  // When already associated to this network (e.g. after an MCU-only
+  // reset), associating again would only drop the connection for a
+  // while. Only a hash of the SSID is kept, so a different SSID with
+  // the same 32-bit hash (very unlikely) would be wrongly skipped.
+  uint32_t ssid_hash = hash(ssid, strlen(ssid));
+  if (this->associated && this->associated_ssid == ssid_hash && !bssid && !channel)
+    return true;
+
   bool ok = writeCommandCheckOk("AT+WA=\"%s\",%s,%d,%d", ssid, bssid ?: "", channel, best_rssi);
-  if (ok)
+  if (ok) {
     processAssociation();
+    this->associated_ssid = ssid_hash;
+  }
   return ok;
 }
 
@@ -86,48 +184,174 @@ bool GSModule::disassociate()
 bool GSModule::setDhcp(bool enable, const char *hostname)
 {
   if (hostname)
-    return writeCommandCheckOk("AT+NDHCP=%d,\"%s\"", enable, hostname);
+    return writeConfigCommand("AT+NDHCP=%d,\"%s\"", enable, hostname);
   else
-    return writeCommandCheckOk("AT+NDHCP=%d", enable);
+    return writeConfigCommand("AT+NDHCP=%d", enable);
 }
 
 bool GSModule::setStaticIp(const IPAddress& ip, const IPAddress& netmask, const IPAddress& gateway)
 {
-  uint8_t ip_buf[16], nm_buf[16], gw_buf[16];
-  snprintf((char*)ip_buf, sizeof(ip_buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  snprintf((char*)nm_buf, sizeof(nm_buf), "%d.%d.%d.%d", netmask[0], netmask[1], netmask[2], netmask[3]);
-  snprintf((char*)gw_buf, sizeof(gw_buf), "%d.%d.%d.%d", gateway[0], gateway[1], gateway[2], gateway[3]);
-  return writeCommandCheckOk("AT+NSET=%s,%s,%s", ip_buf, nm_buf, gw_buf);
+  char ip_buf[IP_STRING_SIZE], nm_buf[IP_STRING_SIZE], gw_buf[IP_STRING_SIZE];
+  formatIpAddress(ip_buf, ip);
+  formatIpAddress(nm_buf, netmask);
+  formatIpAddress(gw_buf, gateway);
+  return writeConfigCommand("AT+NSET=%s,%s,%s", ip_buf, nm_buf, gw_buf);
 }
 
 bool GSModule::setDns(const IPAddress& dns1, const IPAddress& dns2)
 {
-  uint8_t buf1[16], buf2[16];
-  snprintf((char*)buf1, sizeof(buf1), "%d.%d.%d.%d", dns1[0], dns1[1], dns1[2], dns1[3]);
-  snprintf((char*)buf2, sizeof(buf2), "%d.%d.%d.%d", dns2[0], dns2[1], dns2[2], dns2[3]);
+  char buf1[IP_STRING_SIZE], buf2[IP_STRING_SIZE];
+  formatIpAddress(buf1, dns1);
+  formatIpAddress(buf2, dns2);
 
-  return writeCommandCheckOk("AT+DNSSET=%s,%s", buf1, buf2);
+  return writeConfigCommand("AT+DNSSET=%s,%s", buf1, buf2);
 }
 
 bool GSModule::setDns(const IPAddress& dns)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", dns[0], dns[1], dns[2], dns[3]);
+  char buf[IP_STRING_SIZE];
+  formatIpAddress(buf, dns);
 
-  return writeCommandCheckOk("AT+DNSSET=%s", buf);
+  return writeConfigCommand("AT+DNSSET=%s", buf);
 }
 
 bool GSModule::disconnect(cid_t cid)
 {
   if (cid > MAX_CID)
     return false;
-  return writeCommandCheckOk("AT+NCLOSE=%x", cid);
+  // Don't rely on the module sending a DISCONNECT message for
+  // connections we close ourselves
+  bool ok = writeCommandCheckOk("AT+NCLOSE=%x", cid);
+  if (ok)
+    processDisconnect(cid);
+  return ok;
+}
+
+void GSModule::setConnectionPool(uint8_t size, unsigned long idle_timeout)
+{
+#if GS_POOL_SIZE
+  if (size > MAX_POOL_SIZE)
+    size = MAX_POOL_SIZE;
+
+  this->pool_size = size;
+  this->pool_idle_timeout = idle_timeout;
+  while (this->pool_len > size)
+    closePooled(0);
+#endif
+}
+
+bool GSModule::parkConnection(cid_t cid, const char *certname)
+{
+#if GS_POOL_SIZE
+  if (!this->pool_size || cid > MAX_CID)
+    return false;
+
+  closeIdleConnections();
+
+  const ConnectionInfo &info = this->connections[cid];
+  if (!info.connected || info.error || info.server_cid != INVALID_CID)
+    return false;
+
+  if (this->pool_len == this->pool_size)
+    closePooled(0);
+
+  // Nobody is going to read any data still buffered
+  skipData(cid, 0xffff);
+  this->connections[cid].parked = true;
+
+  PooledConnection &entry = this->pool[this->pool_len++];
+  entry.cid = cid;
+  entry.certname = certname;
+  entry.time = millis();
+  return true;
+#else
+  return false;
+#endif
+}
+
+GSCore::cid_t GSModule::reuseConnection(const IPAddress& ip, uint16_t port, const char *certname)
+{
+#if GS_POOL_SIZE
+  closeIdleConnections();
+
+  // Prefer the most recently used connection, it is the least likely
+  // to have been closed by the other side in the meanwhile
+  for (uint8_t i = this->pool_len; i-- > 0;) {
+    PooledConnection &entry = this->pool[i];
+    const ConnectionInfo &info = this->connections[entry.cid];
+    if (info.remote_ip != (uint32_t)ip || info.remote_port != port)
+      continue;
+    if (certname ? !entry.certname || strcmp(certname, entry.certname) : entry.certname != NULL)
+      continue;
+
+    cid_t cid = entry.cid;
+    removePooled(i);
+    this->connections[cid].parked = false;
+    // Drop anything received while parked
+    skipData(cid, 0xffff);
+    return cid;
+  }
+#endif
+  return INVALID_CID;
+}
+
+void GSModule::closeIdleConnections(bool all)
+{
+#if GS_POOL_SIZE
+  // Process any pending disconnects first
+  readAndProcessAsync();
+
+  unsigned long now = millis();
+  for (uint8_t i = this->pool_len; i-- > 0;) {
+    PooledConnection &entry = this->pool[i];
+    const ConnectionInfo &info = this->connections[entry.cid];
+    if (!info.connected || !info.parked) {
+      // Closed by the other side, or the cid was reused already
+      skipData(entry.cid, 0xffff);
+      removePooled(i);
+    } else if (all || info.error || now - entry.time >= this->pool_idle_timeout) {
+      // A connection that lost data while parked cannot be reused, but
+      // is still open in the module, so close it properly
+      closePooled(i);
+    }
+  }
+#endif
+}
+
+#if GS_POOL_SIZE
+void GSModule::closePooled(uint8_t i)
+{
+  cid_t cid = this->pool[i].cid;
+  removePooled(i);
+  this->connections[cid].parked = false;
+  disconnect(cid);
+  skipData(cid, 0xffff);
+}
+
+void GSModule::removePooled(uint8_t i)
+{
+  this->pool_len--;
+  memmove(&this->pool[i], &this->pool[i + 1], (this->pool_len - i) * sizeof(*this->pool));
+}
+#endif
+
+bool GSModule::makeRoomForCid(GSResponse res)
+{
+#if GS_POOL_SIZE
+  if (res != GS_ENOCID || !this->pool_len)
+    return false;
+
+  closePooled(0);
+  return true;
+#else
+  return false;
+#endif
 }
 
 bool GSModule::timeSync(const IPAddress& server, uint32_t interval, uint8_t timeout)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", server[0], server[1], server[2], server[3]);
+  char buf[IP_STRING_SIZE];
+  formatIpAddress(buf, server);
 
   // First, send the command without an interval, to force a sync now
   if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,0", buf, timeout))
@@ -135,7 +359,7 @@ bool GSModule::timeSync(const IPAddress& server, uint32_t interval, uint8_t time
 
   if (interval) {
     // Then, schedule periodic syncs if requested
-    if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,1,%d", buf, timeout, interval))
+    if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,1,%lu", buf, timeout, (unsigned long)interval))
       return false;
   }
   return true;
@@ -150,15 +374,118 @@ static void parse_ip_response(const uint8_t *buf, uint16_t len, void *data)
     *ip = INADDR_NONE;
 }
 
+/**
+ * Returns true when name is four dot-separated groups of digits.
+ * parseIpAddress() also accepts partial addresses like "10.1", which
+ * could be valid hostnames instead.
+ */
+static bool is_dotted_quad(const char *name)
+{
+  uint8_t dots = 0;
+  bool digit = false;
+  for (const char *p = name; *p; ++p) {
+    if (*p == '.') {
+      if (!digit || ++dots > 3)
+        return false;
+      digit = false;
+    } else if (*p >= '0' && *p <= '9') {
+      digit = true;
+    } else {
+      return false;
+    }
+  }
+  return dots == 3 && digit;
+}
+
 IPAddress GSModule::dnsLookup(const char *name)
 {
   IPAddress result = INADDR_NONE;
+  if (is_dotted_quad(name) && parseIpAddress(&result, name, strlen(name)))
+    return result;
+
+  DnsCacheEntry *entry = findDnsCacheEntry(name);
+  if (entry)
+    return entry->ip;
+
   writeCommand("AT+DNSLOOKUP=%s", name);
-  if (readResponse(parse_ip_response, &result) != GS_SUCCESS)
+  GSResponse res = readResponse(parse_ip_response, &result);
+  if (res == GS_SUCCESS && (uint32_t)result != 0) {
+    addDnsCacheEntry(name, result);
+  } else {
+    // Only cache an explicit failure from the module, not timeouts or
+    // other problems talking to it
+    if (res == GS_FAILURE || res == GS_SUCCESS)
+      addDnsCacheEntry(name, 0);
     result = INADDR_NONE;
+  }
   return result;
 }
 
+void GSModule::clearDnsCache()
+{
+#if GS_DNS_CACHE_SIZE
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; ++i)
+    this->dns_cache[i].name[0] = '\0';
+#endif
+}
+
+GSModule::DnsCacheEntry *GSModule::findDnsCacheEntry(const char *name)
+{
+#if GS_DNS_CACHE_SIZE
+  if (this->dns_cache_disassociations != this->disassociations) {
+    clearDnsCache();
+    this->dns_cache_disassociations = this->disassociations;
+  }
+
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; ++i) {
+    DnsCacheEntry &entry = this->dns_cache[i];
+    if (!entry.name[0])
+      continue;
+
+    unsigned long ttl = entry.ip ? this->dns_ttl : this->dns_negative_ttl;
+    if (now - entry.time >= ttl) {
+      entry.name[0] = '\0';
+      continue;
+    }
+
+    if (strcmp(entry.name, name) == 0)
+      return &entry;
+  }
+#endif
+  return NULL;
+}
+
+void GSModule::addDnsCacheEntry(const char *name, uint32_t ip)
+{
+#if GS_DNS_CACHE_SIZE
+  if (!(ip ? this->dns_ttl : this->dns_negative_ttl))
+    return;
+
+  size_t len = strlen(name);
+  if (len >= MAX_DNS_NAME_SIZE)
+    return;
+
+  // Use an empty entry, or replace the oldest one. findDnsCacheEntry
+  // was called just before, so expired entries are empty already.
+  DnsCacheEntry *entry = &this->dns_cache[0];
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; ++i) {
+    DnsCacheEntry &e = this->dns_cache[i];
+    if (!e.name[0]) {
+      entry = &e;
+      break;
+    }
+    if (now - e.time > now - entry->time)
+      entry = &e;
+  }
+
+  memcpy(entry->name, name, len + 1);
+  entry->ip = ip;
+  entry->time = now;
+#endif
+}
+
 bool GSModule::enableTls(cid_t cid, const char *certname)
 {
   if (cid > MAX_CID)
@@ -174,40 +501,242 @@ bool GSModule::enableTls(cid_t cid, const char *certname)
   }
 }
 
-bool GSModule::addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+bool GSModule::beginAddCert(const char *certname, bool to_flash, uint16_t len)
+{
   if (!writeCommandCheckOk("AT+TCERTADD=%s,0,%d,%d", certname, len, !to_flash))
     return false;
 
   const uint8_t escape[] = {0x1b, 'W'};
   writeRaw(escape, sizeof(escape));
-  writeRaw(buf, len);
+  return true;
+}
+
+bool GSModule::addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+  GSChunk chunk = {buf, len, false};
+  return addCert(certname, to_flash, &chunk, 1);
+}
+
+bool GSModule::addCert_P(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+  GSChunk chunk = {buf, len, true};
+  return addCert(certname, to_flash, &chunk, 1);
+}
+
+bool GSModule::addCert(const char *certname, bool to_flash, const GSChunk *chunks, uint8_t num_chunks) {
+  // Prevent the data ready interrupt from reading the reply between
+  // sending the certificate and calling readResponse
+  IrqGuard guard(*this);
+  if (!beginAddCert(certname, to_flash, chunksLength(chunks, num_chunks)))
+    return false;
+
+  writeChunks(chunks, num_chunks);
   return readResponse() == GS_SUCCESS;
 }
 
+bool GSModule::addCert(const char *certname, bool to_flash, uint16_t len, bulk_callback_t callback, void *data) {
+  IrqGuard guard(*this);
+  if (!beginAddCert(certname, to_flash, len))
+    return false;
+
+  uint8_t block[CERT_BLOCK_SIZE];
+  uint16_t done = 0;
+  while (done < len) {
+    uint16_t n = len - done;
+    if (n > sizeof(block))
+      n = sizeof(block);
+    n = callback(block, n, data);
+    if (!n)
+      break;
+    writeRaw(block, n);
+    done += n;
+  }
+
+  if (done == len)
+    return readResponse() == GS_SUCCESS;
+
+  // The module still expects the rest of the certificate, so send
+  // padding and then remove the broken certificate again
+  memset(block, 0, sizeof(block));
+  while (done < len) {
+    uint16_t n = len - done;
+    if (n > sizeof(block))
+      n = sizeof(block);
+    writeRaw(block, n);
+    done += n;
+  }
+  if (readResponse() == GS_SUCCESS)
+    delCert(certname);
+  if (GS_LOG_ERRORS && this->error)
+    this->error->println(F("Certificate upload aborted"));
+  return false;
+}
+
+uint16_t GSModule::readCertStream(uint8_t *buf, uint16_t len, void *data)
+{
+  return ((Stream*)data)->readBytes((char*)buf, len);
+}
+
+bool GSModule::addCert(const char *certname, bool to_flash, Stream &stream, uint16_t len) {
+  return addCert(certname, to_flash, len, readCertStream, &stream);
+}
+
 bool GSModule::setAutoConnectClient(const IPAddress &ip, uint16_t port, Protocol protocol)
 {
-  char buf[16];
-  snprintf(buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  char buf[IP_STRING_SIZE];
+  formatIpAddress(buf, ip);
 
   return setAutoConnectClient(buf, port, protocol);
 }
 
 bool GSModule::setAutoConnectClient(const char *host, uint16_t port, Protocol protocol)
 {
-  return writeCommandCheckOk("AT+NAUTO=0,%d,%s,%d", protocol, host, port);
+  return writeConfigCommand("AT+NAUTO=0,%d,%s,%d", protocol, host, port);
 }
 
 bool GSModule::setAutoConnectServer(uint16_t port, Protocol protocol)
 {
-  return writeCommandCheckOk("AT+NAUTO=1,%d,,%d", protocol, port);
+  return writeConfigCommand("AT+NAUTO=1,%d,,%d", protocol, port);
 }
 
 bool GSModule::setNcm(bool enabled, bool associate_only, bool remember, NCMMode mode)
 {
-  bool res = writeCommandCheckOk("AT+NCMAUTO=%d,%d,%d,%d", mode, enabled, !associate_only, !remember);
+  // Only skip starting the NCM when it is configured the same and
+  // still associated. Otherwise, it might have given up already.
+  if (!enabled || !this->associated)
+    forgetConfig("AT+NCMAUTO");
+  bool res = writeConfigCommand("AT+NCMAUTO=%d,%d,%d,%d", mode, enabled, !associate_only, !remember);
   if (!enabled && res)
     processDisassociation();
   return res;
 }
 
+bool GSModule::enterTransparentMode()
+{
+  if (this->transparent)
+    return true;
+
+  GSResponse res = GS_FAILURE;
+  cid_t cid = INVALID_CID;
+  if (this->transparent_suspended) {
+    // Resume the existing connection. This fails when it was closed in
+    // the meanwhile, then just set up a new one.
+    writeCommand("ATO");
+    res = readResponse();
+    this->transparent_suspended = false;
+    if (res == GS_SUCCESS)
+      cid = this->transparent_cid;
+  }
+
+  if (res != GS_SUCCESS) {
+    // ATA associates first, ATA2 uses the current association
+    bool was_associated = this->associated;
+    writeCommand(was_associated ? "ATA2" : "ATA");
+    res = readResponse(&cid);
+    if (res == GS_SUCCESS && !was_associated)
+      processAssociation();
+    if (res == GS_SUCCESS && cid <= MAX_CID)
+      processConnect(cid, 0, 0, 0, false);
+  }
+
+  if (res != GS_SUCCESS) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println(F("Failed to enter transparent mode"));
+    return false;
+  }
+
+  this->transparent_cid = cid;
+  this->transparent = true;
+  return true;
+}
+
+bool GSModule::scan(scan_callback_t callback, void *data, const char *ssid, uint8_t channel)
+{
+  ScanState state;
+  state.callback = callback;
+  state.data = data;
+  state.valid = true;
+
+  if (!ssid && !channel)
+    writeCommand("AT+WS");
+  else
+    writeCommand("AT+WS=\"%s\",,%d", ssid ?: "", channel);
+  return readResponse(",", parseScanField, &state) == GS_SUCCESS;
+}
+
+void GSModule::parseScanField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data)
+{
+  ScanState *state = (ScanState*)data;
+  ScanResult &r = state->result;
+  const char *str = (const char*)buf;
+
+  // Looks like (after a header line without commas):
+  //   00:1d:c9:00:7d:4e,      GainSpanDemo            , 06,  INFRA , -43 , WPA2-PERSONAL
+  //   No.Of AP Found:1
+  switch (field) {
+    case 0:
+      state->valid = parseMacAddress(r.bssid, buf, len);
+      break;
+    case 1:
+      if (len > MAX_SSID_SIZE)
+        len = MAX_SSID_SIZE;
+      memcpy(r.ssid, buf, len);
+      r.ssid[len] = '\0';
+      break;
+    case 2:
+      if (!parseNumber(&r.channel, buf, len, 10))
+        state->valid = false;
+      break;
+    case 3:
+      r.mode = (len == 5 && strncmp(str, "ADHOC", 5) == 0) ? GS_ADHOC : GS_INFRASTRUCTURE;
+      break;
+    case 4: {
+      uint8_t rssi;
+      if (len >= 2 && str[0] == '-' && parseNumber(&rssi, buf + 1, len - 1, 10) && rssi <= 128)
+        r.rssi = -rssi;
+      else
+        state->valid = false;
+      break;
+    }
+    case 5: {
+      static const struct {
+        const char *name;
+        GSSecurity security;
+      } types[] = {
+        {"NONE", GS_SECURITY_OPEN},
+        {"WEP", GS_SECURITY_WEP},
+        {"WPA-PERSONAL", GS_SECURITY_WPA1_PSK},
+        {"WPA2-PERSONAL", GS_SECURITY_WPA2_PSK},
+        {"WPA-ENTERPRISE", GS_SECURITY_WPA1_ENTERPRISE},
+        {"WPA2-ENTERPRISE", GS_SECURITY_WPA2_ENTERPRISE},
+      };
+      r.security = GS_SECURITY_AUTO;
+      for (uint8_t i = 0; i < sizeof(types) / sizeof(*types); ++i) {
+        if (strlen(types[i].name) == len && strncmp(str, types[i].name, len) == 0)
+          r.security = types[i].security;
+      }
+      break;
+    }
+  }
+
+  if (last) {
+    // Lines with a different number of fields are not results
+    if (field == 5 && state->valid)
+      state->callback(r, state->data);
+    state->valid = true;
+  }
+}
+
+bool GSModule::parseMacAddress(uint8_t *mac, const uint8_t *buf, uint8_t len)
+{
+  if (len != 17)
+    return false;
+
+  for (uint8_t i = 0; i < 6; ++i) {
+    if (i < 5 && buf[i * 3 + 2] != ':')
+      return false;
+    if (!parseNumber(&mac[i], buf + i * 3, 2, 16))
+      return false;
+  }
+  return true;
+}
+
 // vim: set sw=2 sts=2 expandtab:
@@ -40,6 +40,8 @@
  */
 class GSModule : public GSCore {
 public:
+  using GSCore::GSCore;
+
   enum GSAuth {
     GS_AUTH_NONE = 0,
     GS_AUTH_OPEN = 1,
@@ -49,7 +51,7 @@ public:
   /**
    * Set the WEP authentication mode. Set to None for WPA.
    */
-  bool setAuth(GSAuth auth) { return writeCommandCheckOk("AT+WAUTH=%d", auth); }
+  bool setAuth(GSAuth auth) { return writeConfigCommand("AT+WAUTH=%d", auth); }
 
   enum GSSecurity {
     GS_SECURITY_AUTO = 0,
@@ -79,7 +81,7 @@ public:
    */
   bool setSecurity(GSSecurity sec)
   {
-    return writeCommandCheckOk("AT+WSEC=%d", sec);
+    return writeConfigCommand("AT+WSEC=%d", sec);
   }
 
   /**
@@ -87,7 +89,7 @@ public:
    */
   bool setWpaPassphrase(const char *passphrase)
   {
-    return writeCommandCheckOk("AT+WWPA=\"%s\"", passphrase);
+    return writeConfigCommand("AT+WWPA=\"%s\"", passphrase);
   }
 
   /**
@@ -95,7 +97,7 @@ public:
    */
   bool setWepPassphrase(const char *passphrase)
   {
-    return writeCommandCheckOk("AT+WWEP1=%s", passphrase);
+    return writeConfigCommand("AT+WWEP1=%s", passphrase);
   }
 
   /**
@@ -111,7 +113,7 @@ public:
    */
   bool setPskPassphrase(const char *passphrase, const char *ssid)
   {
-    return writeCommandCheckOk("AT+WPAPSK=\"%s\",\"%s\"", ssid, passphrase);
+    return writeConfigCommand("AT+WPAPSK=\"%s\",\"%s\"", ssid, passphrase);
   }
 
   /**
@@ -126,6 +128,11 @@ public:
    *                  use the one with the best rssi, or just use an
    *                  arbitrary one.
    *
+   * When already associated to the same SSID (e.g. because the module
+   * kept its association during an MCU-only reset), and no bssid or
+   * channel is given, nothing is sent. Call disassociate() first to
+   * force a new association.
+   *
    * TODO: Double quotes and backslashes in the passphrase should be
    * backslash-escaped
    */
@@ -187,6 +194,8 @@ public:
    */
   bool loadProfile(uint8_t profile)
   {
+    // Any settings we knew about might have changed now
+    forgetConfig(NULL);
     return writeCommandCheckOk("ATZ%d", profile);
   }
 
@@ -273,7 +282,7 @@ public:
    */
   bool setParam(GSParam param, uint16_t value)
   {
-    return writeCommandCheckOk("ATS%d=%d", param, value);
+    return writeConfigCommand("ATS%d=%d", param, value);
   }
 
   enum GSNcmParam {
@@ -336,7 +345,7 @@ public:
    */
   bool setNcmParam(GSNcmParam param, uint16_t value)
   {
-    return writeCommandCheckOk("AT+NCMAUTOCONF=%d,%d", param, value);
+    return writeConfigCommand("AT+NCMAUTOCONF=%d,%d", param, value);
   }
 
   /**
@@ -369,6 +378,45 @@ public:
    * certificate in (binary) DER format. */
   bool addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len);
 
+  /**
+   * Like addCert(), but the certificate is read from program memory
+   * (e.g. a PROGMEM array), so it does not need to fit in RAM.
+   */
+  bool addCert_P(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Like addCert(), but the certificate is made up of the given
+   * chunks, which can be in RAM or program memory.
+   */
+  bool addCert(const char *certname, bool to_flash, const GSChunk *chunks, uint8_t num_chunks);
+
+  /**
+   * Like addCert(), but the certificate is produced by a callback,
+   * CERT_BLOCK_SIZE bytes at a time. This allows loading certificates
+   * of any size from external storage, without buffering them.
+   *
+   * @param len       The total length of the certificate.
+   * @param callback  Called to produce the next bytes, see
+   *                  bulk_callback_t. When it returns 0 before len
+   *                  bytes were produced, the upload is aborted.
+   * @param data      Passed to the callback.
+   *
+   * @returns true when the module accepted the certificate. When the
+   *          upload was aborted, the partial certificate is removed
+   *          again.
+   */
+  bool addCert(const char *certname, bool to_flash, uint16_t len, bulk_callback_t callback, void *data);
+
+  /**
+   * Like addCert(), but reads len bytes of certificate from the given
+   * stream (e.g. a file on an SD card). The upload is aborted when the
+   * stream times out.
+   */
+  bool addCert(const char *certname, bool to_flash, Stream &stream, uint16_t len);
+
+  /** Block size used for addCert() with a callback or stream */
+  static const uint8_t CERT_BLOCK_SIZE = 32;
+
   /**
    * Remove the certificate with the given name from either the module's
    * flash or RAM (depending on where it is).
@@ -395,12 +443,52 @@ public:
   /**
    * Perform a DNS lookup.
    *
+   * Results are kept in a small cache, so looking up the same name
+   * again does not need a round trip to the module. Successful lookups
+   * are cached for DEFAULT_DNS_TTL milliseconds, names that could not
+   * be resolved for DEFAULT_DNS_NEGATIVE_TTL milliseconds (see
+   * setDnsCacheTtl()). The cache is cleared on disassociation, since
+   * a different network might resolve names differently. Names longer
+   * than MAX_DNS_NAME_SIZE are not cached. Define GS_DNS_CACHE_SIZE to
+   * 0 to leave out the cache.
+   *
+   * If name is already a complete IP address in dotted notation
+   * (e.g. "10.0.0.1", but not "10.1"), it is parsed directly without a
+   * lookup.
+   *
    * @param host     The hostname to look up.
    * @returns The IP address for the given host. If the host was not
    *          found, returns 0.0.0.0.
    */
   IPAddress dnsLookup(const char *name);
 
+  /**
+   * Set how long dnsLookup() results are cached, in milliseconds.
+   * Passing 0 disables caching successful or failed lookups
+   * respectively. Existing entries are not affected until they are
+   * looked up again.
+   */
+  void setDnsCacheTtl(unsigned long ttl, unsigned long negative_ttl) {
+#if GS_DNS_CACHE_SIZE
+    this->dns_ttl = ttl;
+    this->dns_negative_ttl = negative_ttl;
+#endif
+  }
+
+  /**
+   * Remove all entries from the DNS cache.
+   */
+  void clearDnsCache();
+
+  /** Number of names kept in the DNS cache */
+  static const uint8_t DNS_CACHE_SIZE = GS_DNS_CACHE_SIZE;
+  /** Maximum length of a cached name, including the trailing nul */
+  static const uint8_t MAX_DNS_NAME_SIZE = 32;
+  /** Default time to cache successful lookups */
+  static const unsigned long DEFAULT_DNS_TTL = 5 * 60 * 1000UL;
+  /** Default time to cache failed lookups */
+  static const unsigned long DEFAULT_DNS_NEGATIVE_TTL = 30 * 1000UL;
+
   /**
    * Setup a new TCP connection to the given ip and port.
    *
@@ -409,6 +497,15 @@ public:
    */
   cid_t connectTcp(const IPAddress& ip, uint16_t port);
 
+ /**
+  * Setup a listening TCP server on the given port. Incoming
+  * connections can be taken using acceptConnection().
+  *
+  * @returns the cid of the new socket if succesful, INVALID_CID
+  * otherwise.
+  */
+ cid_t listenTcp(uint16_t port);
+
  /**
   * Setup a listening UDP server on the given port.
   *
@@ -438,6 +535,137 @@ public:
    */
   bool disconnect(cid_t cid);
 
+/*******************************************************
+ * Connection pool
+ *******************************************************/
+
+  /**
+   * Keep up to size TCP connections open after they are no longer
+   * used, so a later connection to the same endpoint can skip the
+   * connect and TCP handshake. Connections are parked with
+   * parkConnection() (GSTcpClient::stop() does this automatically) and
+   * taken out of the pool again with reuseConnection() (which
+   * GSTcpClient::connect() tries first).
+   *
+   * Connections that stay parked longer than idle_timeout
+   * milliseconds are closed, but since there is no timer, this only
+   * happens when the pool is used or closeIdleConnections() is called.
+   * When connecting fails because the module has no free cid left,
+   * the oldest parked connection is closed to make room.
+   *
+   * Pass a size of 0 (the default) to disable the pool, which closes
+   * all parked connections. The size is limited to MAX_POOL_SIZE,
+   * define GS_POOL_SIZE to 0 to leave out the pool.
+   */
+  void setConnectionPool(uint8_t size, unsigned long idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT);
+
+  /**
+   * Put a connection in the pool instead of closing it. Any data
+   * received on it until it is reused is dropped. When the pool is
+   * full, the oldest parked connection is closed.
+   *
+   * @param certname  The certificate passed to enableTls(), or NULL
+   *                  for a plain connection. The string must stay
+   *                  valid while the connection is parked.
+   * @returns true when the connection was parked, false when it should
+   *          be closed instead (pool disabled, connection closed or
+   *          in error).
+   */
+  bool parkConnection(cid_t cid, const char *certname = NULL);
+
+  /**
+   * Take a parked connection to the given endpoint out of the pool.
+   * Connections closed by the other side while parked are never
+   * returned.
+   *
+   * @param certname  Only return a TLS connection set up using this
+   *                  certificate, or a plain connection when NULL.
+   * @returns the cid of the connection, or INVALID_CID when there is
+   *          none.
+   */
+  cid_t reuseConnection(const IPAddress& ip, uint16_t port, const char *certname = NULL);
+
+  /**
+   * Close parked connections that have been idle for longer than the
+   * idle timeout, or all of them when all is true.
+   */
+  void closeIdleConnections(bool all = false);
+
+  /** Maximum number of parked connections */
+  static const uint8_t MAX_POOL_SIZE = GS_POOL_SIZE;
+  /** Default idle timeout for setConnectionPool() */
+  static const unsigned long DEFAULT_POOL_IDLE_TIMEOUT = 30 * 1000UL;
+
+/*******************************************************
+ * UART settings
+ *******************************************************/
+
+  /**
+   * Switch the UART to a different baud rate. The module is told to
+   * switch first, then the given serial port (which must be the one
+   * passed to begin()) is reopened at the new baud rate and the link
+   * is checked with an AT command.
+   *
+   * When the module does not answer at the new baud rate, it is told
+   * to switch back (blindly, since its replies cannot be read) and
+   * the serial port is reopened at the current rate again.
+   *
+   * When an RTS pin is set (see setRtsPin()), the module's hardware
+   * flow control is enabled as well. Also set a CTS pin (see
+   * setCtsPin()) to let the module stop us from sending.
+   *
+   * This should be called when no data is being received, since any
+   * data received while checking the link is lost.
+   *
+   * @param serial        The serial port of the module. Needs a
+   *                      begin(baud) method, like HardwareSerial.
+   * @param current       The baud rate serial currently uses.
+   * @param baud          The baud rate to switch to.
+   * @param save_profile  When 0 or 1, save the new settings to the
+   *                      given profile (see saveProfile()), so the
+   *                      module uses them after a reset as well.
+   * @returns true when switched, false when still using the current
+   *          baud rate.
+   */
+  template <typename T>
+  bool setBaudRate(T &serial, uint32_t current, uint32_t baud, int8_t save_profile = -1)
+  {
+    if (!beginBaudRateChange(serial, baud))
+      return false;
+
+    serial.begin(baud);
+    if (finishBaudRateChange(save_profile))
+      return true;
+
+    abortBaudRateChange(current);
+    serial.begin(current);
+    checkBaudRateAborted();
+    return false;
+  }
+
+  /**
+   * Switch to the highest baud rate out of BAUD_RATES that is at most
+   * max and works, trying lower rates when a rate does not work. See
+   * setBaudRate() for the parameters.
+   *
+   * @returns the baud rate used after this call.
+   */
+  template <typename T>
+  uint32_t upgradeBaudRate(T &serial, uint32_t current, uint32_t max = BAUD_RATES[0], int8_t save_profile = -1)
+  {
+    for (uint8_t i = 0; i < sizeof(BAUD_RATES) / sizeof(*BAUD_RATES) && BAUD_RATES[i] > current; ++i) {
+      if (BAUD_RATES[i] <= max && setBaudRate(serial, current, BAUD_RATES[i], save_profile))
+        return BAUD_RATES[i];
+    }
+    return current;
+  }
+
+  /** Baud rates supported by the module, highest first */
+  static const uint32_t BAUD_RATES[8];
+
+  /** Milliseconds to give the module to switch baud rates */
+  static const uint8_t BAUD_SWITCH_DELAY = 10;
+
 /*******************************************************
  * Network connection manager
  *******************************************************/
@@ -466,7 +694,7 @@ public:
    */
   bool setAutoAssociate(const char *ssid, const char *bssid = NULL, int channel = 0, WMode mode = GS_INFRASTRUCTURE)
   {
-    return writeCommandCheckOk("AT+WAUTO=%d,\"%s\",%s,%d", mode, ssid, bssid ?: "", channel);
+    return writeConfigCommand("AT+WAUTO=%d,\"%s\",%s,%d", mode, ssid, bssid ?: "", channel);
   }
 
   enum Protocol {
@@ -549,6 +777,226 @@ public:
    *                        through setAutoAssociate.
    */
   bool setNcm(bool enabled, bool associate_only = true, bool remember = false, NCMMode mode = GS_NCM_STATION);
+
+/*******************************************************
+ * Transparent mode
+ *******************************************************/
+
+  /**
+   * Enter transparent data mode (auto connect mode). The module sets up
+   * the connection configured with setAutoConnectClient() or
+   * setAutoConnectServer() (associating first using the
+   * setAutoAssociate() parameters when not associated yet) and then
+   * passes all data unframed between the UART and the connection.
+   *
+   * After this, data can be read and written using readRaw() and
+   * writeRaw(), or more conveniently through GSTransparentStream.
+   * This skips all framing on transmission and all parsing and
+   * buffering on reception, so it is the fastest way to move a single
+   * stream of data. Other connections cannot be used in the meanwhile,
+   * received frames for them are lost.
+   *
+   * Use leaveTransparentMode() to go back to command mode (sending any
+   * command does this automatically). When transparent mode is
+   * entered again later, the connection is resumed if it is still
+   * open.
+   *
+   * @returns true when transparent mode was entered.
+   */
+  bool enterTransparentMode();
+
+  /**
+   * The connection used by transparent mode, or INVALID_CID when it
+   * is unknown.
+   */
+  cid_t getTransparentCid() {
+    if (!this->transparent && !this->transparent_suspended)
+      return INVALID_CID;
+    return this->transparent_cid;
+  }
+
+/*******************************************************
+ * Scanning
+ *******************************************************/
+
+  /** Maximum length of an SSID */
+  static const uint8_t MAX_SSID_SIZE = 32;
+
+  /** A network found by scan() */
+  struct ScanResult {
+    /** The BSSID (MAC address) of the access point */
+    uint8_t bssid[6];
+    /** The SSID, NUL-terminated */
+    char ssid[MAX_SSID_SIZE + 1];
+    uint8_t channel;
+    /** GS_INFRASTRUCTURE or GS_ADHOC */
+    WMode mode;
+    /** Signal strength, in dBm */
+    int8_t rssi;
+    /**
+     * The security used, or GS_SECURITY_AUTO when the module reported
+     * something unknown.
+     */
+    GSSecurity security;
+  };
+
+  /**
+   * Called by scan() for every network found.
+   *
+   * @param result   The network found. Only valid during the call.
+   * @param data     The data pointer passed to scan().
+   */
+  typedef void (*scan_callback_t)(const ScanResult &result, void *data);
+
+  /**
+   * Scan for wireless networks. Results are passed to the callback as
+   * the module reports them, so no buffer for the full scan output is
+   * needed.
+   *
+   * Within the callback, no new commands should be sent to the module.
+   *
+   * @param callback  Called for every network found.
+   * @param data      Passed to the callback.
+   * @param ssid      When not NULL, only look for this SSID (which
+   *                  also finds hidden networks).
+   * @param channel   When not 0, only scan this channel.
+   *
+   * @returns true when the scan completed.
+   */
+  bool scan(scan_callback_t callback, void *data, const char *ssid = NULL, uint8_t channel = 0);
+
+protected:
+  /** State for parseScanField() */
+  struct ScanState {
+    scan_callback_t callback;
+    void *data;
+    ScanResult result;
+    /** Did all fields of the current line parse so far? */
+    bool valid;
+  };
+
+  /** Field callback for scan() */
+  static void parseScanField(const uint8_t *buf, uint8_t len, uint8_t field, bool last, void *data);
+
+  /**
+   * Parse a MAC address of the form "12:34:56:78:9a:bc".
+   *
+   * @returns true when the parsing succeeded.
+   */
+  static bool parseMacAddress(uint8_t *mac, const uint8_t *buf, uint8_t len);
+
+  /**
+   * Send the command to add a certificate of the given length. After
+   * this, exactly len bytes of certificate must be written with
+   * writeRaw(), followed by readResponse().
+   */
+  bool beginAddCert(const char *certname, bool to_flash, uint16_t len);
+
+  /** callback for addCert() with a stream */
+  static uint16_t readCertStream(uint8_t *buf, uint16_t len, void *data);
+
+  /**
+   * Tell the module to switch to the given baud rate, for
+   * setBaudRate().
+   *
+   * @returns true when the module accepted, false when the baud rate
+   *          cannot be changed.
+   */
+  bool beginBaudRateChange(Stream &serial, uint32_t baud);
+
+  /**
+   * Check the link after a baud rate change and save the profile, for
+   * setBaudRate().
+   *
+   * @returns true when the module answered at the new baud rate.
+   */
+  bool finishBaudRateChange(int8_t save_profile);
+
+  /**
+   * Tell the module to switch back to the given baud rate, without
+   * waiting for a reply.
+   */
+  void abortBaudRateChange(uint32_t baud);
+
+  /**
+   * Check that the module answers again after abortBaudRateChange(),
+   * logging an error if not.
+   */
+  void checkBaudRateAborted();
+
+  struct DnsCacheEntry {
+    /** Name looked up, empty when the entry is unused */
+    char name[MAX_DNS_NAME_SIZE];
+    /** The result, 0 for a failed lookup */
+    uint32_t ip;
+    /** millis() when the lookup was done */
+    unsigned long time;
+  };
+
+  /**
+   * Find the cache entry for the given name. Expired entries, and all
+   * entries from before the last disassociation, are removed first.
+   *
+   * @returns the entry, or NULL when the name is not cached.
+   */
+  DnsCacheEntry *findDnsCacheEntry(const char *name);
+
+  /**
+   * Store a lookup result in the cache, replacing the oldest entry
+   * when the cache is full.
+   */
+  void addDnsCacheEntry(const char *name, uint32_t ip);
+
+  struct PooledConnection {
+    cid_t cid;
+    /** Certificate used for TLS, NULL for a plain connection */
+    const char *certname;
+    /** millis() when the connection was parked */
+    unsigned long time;
+  };
+
+  /**
+   * Close the parked connection at the given index in pool and remove
+   * it from the pool.
+   */
+  void closePooled(uint8_t i);
+
+  /**
+   * Remove the entry at the given index from pool, without closing
+   * the connection.
+   */
+  void removePooled(uint8_t i);
+
+  /**
+   * Should be called with the reply to a command that sets up a new
+   * cid. When the module ran out of cids, closes the oldest parked
+   * connection.
+   *
+   * @returns true when a connection was closed, so the command should
+   *          be retried.
+   */
+  bool makeRoomForCid(GSResponse res);
+
+#if GS_POOL_SIZE
+  /** Parked connections, oldest first */
+  PooledConnection pool[MAX_POOL_SIZE];
+  /** Number of entries in pool */
+  uint8_t pool_len = 0;
+  /** Maximum number of entries in pool, 0 when disabled */
+  uint8_t pool_size = 0;
+  unsigned long pool_idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+#endif
+
+#if GS_DNS_CACHE_SIZE
+  DnsCacheEntry dns_cache[DNS_CACHE_SIZE] = {};
+  /** Value of GSCore::disassociations the cache entries belong to */
+  uint8_t dns_cache_disassociations = 0;
+  unsigned long dns_ttl = DEFAULT_DNS_TTL;
+  unsigned long dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+#endif
+
+  /** The connection set up by enterTransparentMode() */
+  cid_t transparent_cid = INVALID_CID;
 };
 
 #endif // GS_MODULE_H
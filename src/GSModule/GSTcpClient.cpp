@@ -31,23 +31,74 @@ int GSTcpClient::connect(IPAddress ip, uint16_t port)
   if (connected())
     return false;
 
-  GSModule::cid_t cid = gs.connectTcp(ip, port);
+  GSModule::cid_t cid = gs.reuseConnection(ip, port);
+  if (cid == GSModule::INVALID_CID)
+    cid = gs.connectTcp(ip, port);
   if (cid == GSModule::INVALID_CID)
     return false;
 
   this->cid = cid;
+  this->certname = NULL;
+  return true;
+}
+
+int GSTcpClient::connect(IPAddress ip, uint16_t port, const char *certname)
+{
+  if (connected())
+    return false;
+
+  GSModule::cid_t cid = gs.reuseConnection(ip, port, certname);
+  if (cid != GSModule::INVALID_CID) {
+    this->cid = cid;
+    this->certname = certname;
+    return true;
+  }
+
+  // Don't use connect(ip, port), that could reuse a plain connection
+  cid = gs.connectTcp(ip, port);
+  if (cid == GSModule::INVALID_CID)
+    return false;
+
+  this->cid = cid;
+  if (!enableTls(certname)) {
+    // Don't leave a plain connection behind that looks like a TLS one
+    gs.disconnect(cid);
+    this->cid = GSModule::INVALID_CID;
+    return false;
+  }
   return true;
 }
 
 int GSTcpClient::connect(const char *host, uint16_t port)
 {
-  // TODO
-  return false;
+  IPAddress ip = gs.dnsLookup(host);
+  if (ip == INADDR_NONE)
+    return false;
+
+  return connect(ip, port);
 }
 
 bool GSTcpClient::enableTls(const char *certname)
 {
-  return gs.enableTls(this->cid, certname);
+  if (!gs.enableTls(this->cid, certname))
+    return false;
+  this->certname = certname;
+  return true;
+}
+
+void GSTcpClient::stop()
+{
+  // Keep the connection open for reuse when possible, but only when
+  // all data was sent
+  if (connected() && flushTx()) {
+    gs.flushTxQueue();
+    if (gs.parkConnection(this->cid, this->certname)) {
+      // The connection now belongs to the pool
+      this->cid = GSModule::INVALID_CID;
+      return;
+    }
+  }
+  GSClient::stop();
 }
 
 uint8_t GSTcpClient::sslConnected()
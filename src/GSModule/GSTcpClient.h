@@ -31,13 +31,14 @@
 
 class GSTcpClient : public  GSClient {
   public:
-    GSTcpClient(GSModule &gs) : GSClient(gs) { } ;
+    using GSClient::GSClient;
 
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
      ****************************************************************/
     virtual int connect(IPAddress ip, uint16_t port);
     virtual int connect(const char *host, uint16_t port);
+    virtual void stop();
 
 
     /****************************************************************
@@ -46,9 +47,21 @@ class GSTcpClient : public  GSClient {
     virtual uint8_t sslConnected();
     virtual bool enableTls(const char *certname);
 
+    /**
+     * Connect and enable TLS using the given certificate (see
+     * GSModule::enableTls()). When the module has a connection pool,
+     * this can reuse a parked TLS connection, skipping the TLS
+     * handshake as well.
+     */
+    virtual int connect(IPAddress ip, uint16_t port, const char *certname);
+
     // Explicitely inherit operator=, since the default assignment
     // operator shows it.
     using GSClient::operator=;
+
+  protected:
+    // Certificate passed to enableTls(), used to park the connection
+    const char *certname = NULL;
 };
 
 #endif // _GS_TCP_CLIENT_H
@@ -0,0 +1,98 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "GSTcpServer.h"
+#include "util.h"
+
+void GSTcpServer::begin()
+{
+  begin(this->port);
+}
+
+bool GSTcpServer::begin(uint16_t port)
+{
+  if (this->cid != GSModule::INVALID_CID)
+    stop();
+
+  GSModule::cid_t cid = this->gs.listenTcp(port);
+  if (cid == GSModule::INVALID_CID)
+    return false;
+
+  this->port = port;
+  this->cid = cid;
+  return true;
+}
+
+GSModule::cid_t GSTcpServer::accept()
+{
+  if (this->cid == GSModule::INVALID_CID)
+    return GSModule::INVALID_CID;
+
+  return this->gs.acceptConnection(this->cid);
+}
+
+GSTcpClient GSTcpServer::available()
+{
+  GSTcpClient client(this->gs);
+  client = accept();
+  return client;
+}
+
+size_t GSTcpServer::write(uint8_t c)
+{
+  return write(&c, sizeof(c));
+}
+
+size_t GSTcpServer::write(const uint8_t *buf, size_t size)
+{
+  if (this->cid == GSModule::INVALID_CID)
+    return 0;
+
+  bool ok = false;
+  for (GSModule::cid_t cid = 0; cid <= GSModule::MAX_CID; ++cid) {
+    const GSModule::ConnectionInfo &info = this->gs.getConnectionInfo(cid);
+    if (info.connected && info.server_cid == this->cid && this->gs.writeData(cid, buf, size))
+      ok = true;
+  }
+  return ok ? size : 0;
+}
+
+void GSTcpServer::stop()
+{
+  if (this->cid == GSModule::INVALID_CID)
+    return;
+
+  this->gs.disconnect(this->cid);
+  // Incoming connections that were not taken yet will never be used
+  GSModule::cid_t cid;
+  while ((cid = this->gs.acceptConnection(this->cid)) != GSModule::INVALID_CID) {
+    this->gs.disconnect(cid);
+    this->gs.skipData(cid, 0xffff);
+  }
+  this->cid = GSModule::INVALID_CID;
+}
+
+// vim: set sw=2 sts=2 expandtab:
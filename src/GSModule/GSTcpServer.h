@@ -0,0 +1,105 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GS_TCP_SERVER_H
+#define _GS_TCP_SERVER_H
+
+#include <Arduino.h>
+#include <Server.h>
+
+#include "GSModule.h"
+#include "GSTcpClient.h"
+
+class GSTcpServer : public Server {
+  public:
+    GSTcpServer(GSModule &gs, uint16_t port) : gs(gs), port(port) { } ;
+
+    /****************************************************************
+     * Stuff from Server / Print
+     ****************************************************************/
+
+    /**
+     * Start listening on the port passed to the constructor.
+     */
+    virtual void begin();
+
+    /**
+     * Write data to all connected clients accepted by this server.
+     */
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+
+    // Include other overloads of write
+    using Print::write;
+
+    /****************************************************************
+     * Gainspan-specific stuff
+     ****************************************************************/
+
+    /**
+     * Start listening on the given port.
+     *
+     * @returns true when the server was started.
+     */
+    bool begin(uint16_t port);
+
+    /**
+     * Take the oldest incoming connection not taken yet, without
+     * blocking. Unlike with other Arduino servers, every connection is
+     * returned only once, so the application is responsible for it
+     * from then on (e.g. calling stop() when done).
+     *
+     * The returned client does not buffer writes, to use a tx buffer,
+     * assign the result of accept() to a client instead.
+     *
+     * @returns the client, which is false when there is no new
+     * connection.
+     */
+    GSTcpClient available();
+
+    /**
+     * Like available(), but returns the cid of the new connection,
+     * or INVALID_CID when there is none. This can be assigned to an
+     * existing GSTcpClient.
+     */
+    GSModule::cid_t accept();
+
+    /**
+     * Stop listening. Connections accepted already stay open.
+     */
+    void stop();
+
+    operator bool() { return this->cid != GSModule::INVALID_CID; }
+
+  protected:
+    GSModule &gs;
+    uint16_t port;
+    GSModule::cid_t cid = GSModule::INVALID_CID;
+};
+
+#endif // _GS_TCP_SERVER_H
+
+// vim: set sw=2 sts=2 expandtab:
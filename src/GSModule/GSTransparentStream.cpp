@@ -0,0 +1,115 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "GSTransparentStream.h"
+
+bool GSTransparentStream::begin()
+{
+  if (gs.isTransparent())
+    return true;
+  this->peeked = -1;
+  this->skip_lf = gs.enterTransparentMode();
+  return this->skip_lf;
+}
+
+bool GSTransparentStream::end()
+{
+  this->peeked = -1;
+  return gs.leaveTransparentMode();
+}
+
+size_t GSTransparentStream::write(uint8_t c)
+{
+  return write(&c, sizeof(c));
+}
+
+size_t GSTransparentStream::write(const uint8_t *buf, size_t size)
+{
+  if (!gs.isTransparent())
+    return 0;
+
+  size_t done = 0;
+  while (done < size) {
+    uint16_t len = size - done > 0xffff ? 0xffff : size - done;
+    gs.writeRaw(buf + done, len);
+    done += len;
+  }
+  return size;
+}
+
+int GSTransparentStream::available()
+{
+  if (!gs.isTransparent())
+    return 0;
+
+  // The module does not tell how much data is pending, so just see if
+  // there is at least one byte
+  return peek() != -1;
+}
+
+int GSTransparentStream::read()
+{
+  int c = peek();
+  this->peeked = -1;
+  return c;
+}
+
+int GSTransparentStream::read(uint8_t *buf, size_t size)
+{
+  if (!gs.isTransparent())
+    return 0;
+
+  size_t done = 0;
+  if (size && peek() != -1) {
+    buf[done++] = this->peeked;
+    this->peeked = -1;
+  }
+  while (done < size) {
+    uint16_t len = size - done > 0xffff ? 0xffff : size - done;
+    uint16_t read = gs.readRaw(buf + done, len);
+    done += read;
+    if (read < len)
+      break;
+  }
+  return done;
+}
+
+int GSTransparentStream::peek()
+{
+  if (this->peeked == -1 && gs.isTransparent()) {
+    this->peeked = gs.readRaw();
+    // The reply to the command that entered transparent mode ends
+    // with \r\n, but readResponse() stops at the \r
+    if (this->skip_lf && this->peeked != -1) {
+      this->skip_lf = false;
+      if (this->peeked == '\n')
+        this->peeked = gs.readRaw();
+    }
+  }
+  return this->peeked;
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,91 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GS_TRANSPARENT_STREAM_H
+#define _GS_TRANSPARENT_STREAM_H
+
+#include <Arduino.h>
+#include <Stream.h>
+
+#include "GSModule.h"
+
+/**
+ * Stream that reads and writes the connection of transparent mode (see
+ * GSModule::enterTransparentMode()) directly, without any framing or
+ * buffering inside the library. When transparent mode is not active,
+ * nothing can be read and writes fail.
+ */
+class GSTransparentStream : public Stream {
+  public:
+    GSTransparentStream(GSModule &gs) : gs(gs) { } ;
+
+    /**
+     * Enter transparent mode.
+     *
+     * @see GSModule::enterTransparentMode()
+     */
+    bool begin();
+
+    /**
+     * Go back to command mode, leaving the connection open. Any data
+     * not read yet is lost.
+     *
+     * @see GSCore::leaveTransparentMode()
+     */
+    bool end();
+
+    /****************************************************************
+     * Stuff from Stream / Print
+     ****************************************************************/
+
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush() { }
+
+    /** @returns true when transparent mode is active */
+    operator bool() { return gs.isTransparent(); }
+
+    // Include other overloads of write
+    using Print::write;
+
+  protected:
+    GSModule &gs;
+    /** Byte read from the module by peek() or available(), or -1 */
+    int peeked = -1;
+    /**
+     * Set after entering transparent mode, when the \n ending the
+     * module's reply can still be pending.
+     */
+    bool skip_lf = false;
+};
+
+#endif // _GS_TRANSPARENT_STREAM_H
+
+// vim: set sw=2 sts=2 expandtab:
@@ -41,6 +41,9 @@ int GSUdpClient::connect(IPAddress ip, uint16_t port)
 
 int GSUdpClient::connect(const char *host, uint16_t port)
 {
-  // TODO
-  return false;
+  IPAddress ip = gs.dnsLookup(host);
+  if (ip == INADDR_NONE)
+    return false;
+
+  return connect(ip, port);
 }
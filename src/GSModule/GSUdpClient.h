@@ -31,7 +31,9 @@
 
 class GSUdpClient : public  GSClient {
   public:
-    GSUdpClient(GSModule &gs) : GSClient(gs) { } ;
+    // Passing a tx buffer makes every flush() (or full buffer or idle
+    // timeout) send a single packet, instead of every write.
+    using GSClient::GSClient;
 
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
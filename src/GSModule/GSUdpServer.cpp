@@ -27,6 +27,40 @@
 #include "GSUdpServer.h"
 #include "util.h"
 
+// Buffer used by servers without their own buffer. When all servers
+// have their own buffer, the linker leaves this buffer out.
+static uint8_t shared_tx_buf[GSUdpServer::DEFAULT_TX_SIZE];
+
+GSUdpServer *GSUdpServer::shared_tx_owner = NULL;
+
+GSUdpServer::GSUdpServer(GSModule &gs) : GSUdpServer(gs, shared_tx_buf, sizeof(shared_tx_buf))
+{
+  this->tx_shared = true;
+}
+
+GSUdpServer::~GSUdpServer()
+{
+  releaseTxBuffer();
+}
+
+bool GSUdpServer::claimTxBuffer()
+{
+  if (!this->tx_shared)
+    return true;
+
+  if (shared_tx_owner && shared_tx_owner != this)
+    return false;
+
+  shared_tx_owner = this;
+  return true;
+}
+
+void GSUdpServer::releaseTxBuffer()
+{
+  if (shared_tx_owner == this)
+    shared_tx_owner = NULL;
+}
+
 uint8_t GSUdpServer::begin(uint16_t port)
 {
   GSModule::cid_t cid = this->gs.listenUdp(port);
@@ -44,10 +78,10 @@ int GSUdpServer::parsePacket()
   // instead leave the rest and return no valid packet yet, our caller
   // will probably retry with another parsePacket call which will
   // continue dropping bytes.
-  while(this->rx_frame.length) {
-    if (this->gs.readData(this->cid) < 0)
+  if (this->rx_frame.length) {
+    this->rx_frame.length -= this->gs.skipData(this->cid, this->rx_frame.length);
+    if (this->rx_frame.length)
       return 0;
-    --this->rx_frame.length;
   }
 
   this->rx_frame = this->gs.getFrameHeader(this->cid);
@@ -66,46 +100,52 @@ uint16_t GSUdpServer::remotePort()
 
 int GSUdpServer::beginPacket(IPAddress ip, uint16_t port)
 {
+  if (!claimTxBuffer())
+    return false;
+
   this->tx_ip = ip;
   this->tx_port = port;
+  this->tx_len = 0;
+  this->tx_overflow = false;
 
   return true;
 }
 
 int GSUdpServer::beginPacket(const char *host, uint16_t port)
 {
-  if (!GSCore::parseIpAddress(&(this->tx_ip), host, strlen(host))) return false;
-  this->tx_port = port;
-  return true;
+  IPAddress ip = gs.dnsLookup(host);
+  if (ip == INADDR_NONE)
+    return false;
+  return beginPacket(ip, port);
 }
 
 int GSUdpServer::endPacket()
 {
-  int res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
-  free(this->tx_buf);
-  this->tx_buf = NULL;
+  // Don't send a truncated packet, or when another server is using
+  // the shared buffer
+  int res = false;
+  if (claimTxBuffer() && !this->tx_overflow)
+    res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
   this->tx_len = 0;
+  this->tx_overflow = false;
+  releaseTxBuffer();
   return res;
 }
 
 size_t GSUdpServer::write(uint8_t c)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + 1);
-  if (!newbuf)
-    return 0;
-
-  this->tx_buf = newbuf;
-  this->tx_buf[this->tx_len++] = c;
-  return 1;
+  return write(&c, 1);
 }
 
 size_t GSUdpServer::write(const uint8_t *buf, size_t size)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + size);
-  if (!newbuf)
+  // Writes that do not fit are refused completely, and make sure the
+  // truncated packet is not sent at all.
+  if (!claimTxBuffer() || size > (size_t)(this->tx_size - this->tx_len)) {
+    this->tx_overflow = true;
     return 0;
+  }
 
-  this->tx_buf = newbuf;
   memcpy(this->tx_buf + this->tx_len, buf, size);
   this->tx_len += size;
 
@@ -146,6 +186,25 @@ int GSUdpServer::peek()
   return gs.peekData(this->cid);
 }
 
+size_t GSUdpServer::borrow(const uint8_t **buf)
+{
+  if (!this->rx_frame.length)
+    return 0;
+
+  size_t len = gs.borrowData(this->cid, buf);
+  if (len > this->rx_frame.length)
+    len = this->rx_frame.length;
+  return len;
+}
+
+void GSUdpServer::consume(size_t len)
+{
+  if (len > this->rx_frame.length)
+    len = this->rx_frame.length;
+  gs.consumeData(this->cid, len);
+  this->rx_frame.length -= len;
+}
+
 void GSUdpServer::flush()
 {
   // Nothing todo, we can't write anything to the gainspan module
@@ -154,6 +213,8 @@ void GSUdpServer::flush()
 
 void GSUdpServer::stop()
 {
+  this->tx_len = 0;
+  releaseTxBuffer();
   gs.disconnect(this->cid);
 }
 
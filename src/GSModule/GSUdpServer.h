@@ -34,7 +34,35 @@
 
 class GSUdpServer : public UDP {
   public:
-    GSUdpServer(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
+    /**
+     * Create a server that builds outgoing packets in a buffer of
+     * DEFAULT_TX_SIZE bytes, which is shared by all servers created
+     * this way. Only one of them can be building a packet at the same
+     * time, beginPacket() fails for the others.
+     *
+     * By default, the buffer fits the biggest packet the module can
+     * send. When GS_UDP_TX_SIZE is defined smaller (to save RAM),
+     * packets bigger than that are refused: write() returns 0 and
+     * endPacket() fails.
+     */
+    GSUdpServer(GSModule &gs);
+
+    /**
+     * Create a server that builds outgoing packets in the given buffer,
+     * which limits the size of outgoing packets. Since a packet must fit
+     * in a single frame, the buffer size can be at most
+     * GSCore::MAX_DATA_FRAME_SIZE.
+     */
+    template <size_t N>
+    GSUdpServer(GSModule &gs, uint8_t (&tx_buf)[N]) : GSUdpServer(gs, tx_buf, N) {
+      static_assert(N <= GSCore::MAX_DATA_FRAME_SIZE, "tx buffer is bigger than a data frame");
+    }
+
+    ~GSUdpServer();
+
+    /** Size of the buffer shared by servers created without a buffer */
+    static const uint16_t DEFAULT_TX_SIZE = GS_UDP_TX_SIZE;
+    static_assert(DEFAULT_TX_SIZE <= GSCore::MAX_DATA_FRAME_SIZE, "GS_UDP_TX_SIZE is bigger than a data frame");
 
     /****************************************************************
      * Stuff from Udp / Stream / Print
@@ -60,10 +88,46 @@ class GSUdpServer : public UDP {
     virtual void flush();
     GSUdpServer& operator =(GSCore::cid_t cid);
 
+    /****************************************************************
+     * Zero-copy reading
+     ****************************************************************/
+
+    /**
+     * Get direct access to data of the current packet, without copying it.
+     *
+     * @see GSCore::borrowData() for details and limitations.
+     *
+     * @returns the number of bytes available at *buf.
+     */
+    size_t borrow(const uint8_t **buf);
+
+    /**
+     * Remove data previously returned by borrow().
+     */
+    void consume(size_t len);
+
     // Include other overloads of write
     using Print::write;
 
   protected:
+    GSUdpServer(GSModule &gs, uint8_t *tx_buf, uint16_t tx_size)
+      : gs(gs), tx_buf(tx_buf), tx_size(tx_size) { } ;
+
+    /**
+     * @returns true when this server can write to tx_buf, claiming the
+     * shared buffer if needed.
+     */
+    bool claimTxBuffer();
+
+    /**
+     * Make the shared buffer available for other servers again, if this
+     * server is using it.
+     */
+    void releaseTxBuffer();
+
+    /** The server currently building a packet in the shared buffer */
+    static GSUdpServer *shared_tx_owner;
+
     GSModule &gs;
     GSModule::cid_t cid = GSModule::INVALID_CID;
     // Packet currently being received. When length is 0, the other
@@ -74,9 +138,15 @@ class GSUdpServer : public UDP {
     IPAddress tx_ip = INADDR_NONE;
     uint16_t tx_port = 0;
     // Buffer into which we're accumulating the next packet.
-    uint8_t *tx_buf = NULL;
-    // Length of data in sendBuf
-    size_t tx_len = 0;
+    uint8_t *tx_buf;
+    // Size of tx_buf
+    uint16_t tx_size;
+    // Length of data in tx_buf
+    uint16_t tx_len = 0;
+    // Is tx_buf the buffer shared between servers?
+    bool tx_shared = false;
+    // Set when a write did not fit in tx_buf, so the packet is dropped
+    bool tx_overflow = false;
 
 };
 